@@ -39,6 +39,7 @@
 #include "packet.h"
 #include "encoder.h"
 #include "nrf_driver.h"
+#include "isr_prof.h"
 
 #include <math.h>
 #include <string.h>
@@ -331,6 +332,32 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		mcconf.foc_sat_comp = buffer_get_float32_auto(data, &ind);
 		mcconf.foc_temp_comp = data[ind++];
 		mcconf.foc_temp_comp_base_temp = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_observer_type = data[ind++];
+		mcconf.foc_observer_iterations = data[ind++];
+		mcconf.foc_observer_iter_min_erpm = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_est_decimation = data[ind++];
+		mcconf.foc_fw_current_max = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_fw_duty_start = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_fw_ramp_time = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_motor_ld_lq_diff = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_mtpa_enable = data[ind++];
+		mcconf.foc_hfi_voltage = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_hfi_bw = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_hfi_polarity_current = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_online_est = data[ind++];
+		mcconf.foc_cc_decoupling = data[ind++];
+		mcconf.foc_pll_adaptive = data[ind++];
+		mcconf.foc_pll_bw_min = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_pll_bw_max = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_pll_bw_erpm = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_pll_obs_speed = data[ind++];
+		mcconf.foc_overmod_mode = data[ind++];
+		mcconf.foc_dpwm_mode = data[ind++];
+		mcconf.foc_dpwm_mod_min = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_f_sw_sched = data[ind++];
+		mcconf.foc_f_sw_min = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_f_sw_sched_erpm = buffer_get_float32_auto(data, &ind);
+		mcconf.foc_f_sw_temp_margin = buffer_get_float32_auto(data, &ind);
 
 		mcconf.s_pid_kp = buffer_get_float32_auto(data, &ind);
 		mcconf.s_pid_ki = buffer_get_float32_auto(data, &ind);
@@ -486,6 +513,32 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		buffer_append_float32_auto(send_buffer, mcconf.foc_sat_comp, &ind);
 		send_buffer[ind++] = mcconf.foc_temp_comp;
 		buffer_append_float32_auto(send_buffer, mcconf.foc_temp_comp_base_temp, &ind);
+		send_buffer[ind++] = mcconf.foc_observer_type;
+		send_buffer[ind++] = mcconf.foc_observer_iterations;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_observer_iter_min_erpm, &ind);
+		send_buffer[ind++] = mcconf.foc_est_decimation;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_fw_current_max, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_fw_duty_start, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_fw_ramp_time, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_motor_ld_lq_diff, &ind);
+		send_buffer[ind++] = mcconf.foc_mtpa_enable;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_hfi_voltage, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_hfi_bw, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_hfi_polarity_current, &ind);
+		send_buffer[ind++] = mcconf.foc_online_est;
+		send_buffer[ind++] = mcconf.foc_cc_decoupling;
+		send_buffer[ind++] = mcconf.foc_pll_adaptive;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_pll_bw_min, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_pll_bw_max, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_pll_bw_erpm, &ind);
+		send_buffer[ind++] = mcconf.foc_pll_obs_speed;
+		send_buffer[ind++] = mcconf.foc_overmod_mode;
+		send_buffer[ind++] = mcconf.foc_dpwm_mode;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_dpwm_mod_min, &ind);
+		send_buffer[ind++] = mcconf.foc_f_sw_sched;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_f_sw_min, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_f_sw_sched_erpm, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_f_sw_temp_margin, &ind);
 
 		buffer_append_float32_auto(send_buffer, mcconf.s_pid_kp, &ind);
 		buffer_append_float32_auto(send_buffer, mcconf.s_pid_ki, &ind);
@@ -655,18 +708,54 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 
 		float r = 0.0;
 		float l = 0.0;
-		bool res = mcpwm_foc_measure_res_ind(&r, &l);
+		float ld_lq_diff = 0.0;
+		bool res = mcpwm_foc_measure_res_ind(&r, &l, &ld_lq_diff);
 		mc_interface_set_configuration(&mcconf_old);
 
 		if (!res) {
 			r = 0.0;
 			l = 0.0;
+			ld_lq_diff = 0.0;
 		}
 
 		ind = 0;
 		send_buffer[ind++] = COMM_DETECT_MOTOR_R_L;
 		buffer_append_float32(send_buffer, r, 1e6, &ind);
 		buffer_append_float32(send_buffer, l, 1e3, &ind);
+		buffer_append_float32(send_buffer, ld_lq_diff, 1e3, &ind);
+		if (send_func_last) {
+			send_func_last(send_buffer, ind);
+		} else {
+			commands_send_packet(send_buffer, ind);
+		}
+	}
+	break;
+
+	case COMM_DETECT_CURRENT_GAINS: {
+		ind = 0;
+		float bw = buffer_get_float32_auto(data, &ind);
+		bool apply = data[ind++];
+
+		send_func_last = send_func;
+
+		float r = 0.0;
+		float l = 0.0;
+		float ld_lq_diff = 0.0;
+		float kp = 0.0;
+		float ki = 0.0;
+		float phase_margin = 0.0;
+		bool res = conf_general_detect_current_gains(bw, apply, &r, &l, &ld_lq_diff,
+				&kp, &ki, &phase_margin);
+
+		ind = 0;
+		send_buffer[ind++] = COMM_DETECT_CURRENT_GAINS;
+		send_buffer[ind++] = res;
+		buffer_append_float32_auto(send_buffer, r, &ind);
+		buffer_append_float32_auto(send_buffer, l, &ind);
+		buffer_append_float32_auto(send_buffer, ld_lq_diff, &ind);
+		buffer_append_float32_auto(send_buffer, kp, &ind);
+		buffer_append_float32_auto(send_buffer, ki, &ind);
+		buffer_append_float32_auto(send_buffer, phase_margin, &ind);
 		if (send_func_last) {
 			send_func_last(send_buffer, ind);
 		} else {
@@ -853,6 +942,43 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		commands_send_packet(send_buffer, ind);
 		break;
 
+	case COMM_GET_ISR_PROF: {
+		// Optional first byte: reset the statistics after sending them
+		bool reset = len > 0 && data[0];
+
+		ind = 0;
+		send_buffer[ind++] = packet_id;
+		buffer_append_uint32(send_buffer, SYSTEM_CORE_CLOCK, &ind);
+		send_buffer[ind++] = ISR_PROF_SECTION_NUM;
+
+		for (int i = 0;i < ISR_PROF_SECTION_NUM;i++) {
+			isr_prof_stats stats;
+			isr_prof_get_stats(i, &stats);
+			buffer_append_uint32(send_buffer, stats.samples, &ind);
+			buffer_append_uint32(send_buffer, stats.min, &ind);
+			buffer_append_uint32(send_buffer, stats.max, &ind);
+			buffer_append_float32_auto(send_buffer, stats.mean, &ind);
+			buffer_append_uint32(send_buffer, stats.p99, &ind);
+		}
+
+		if (reset) {
+			isr_prof_reset();
+		}
+
+		commands_send_packet(send_buffer, ind);
+	} break;
+
+	case COMM_GET_MOTOR_EST:
+		ind = 0;
+		send_buffer[ind++] = packet_id;
+		buffer_append_float32_auto(send_buffer, mcpwm_foc_get_est_res(), &ind);
+		buffer_append_float32_auto(send_buffer, mcpwm_foc_get_est_flux_linkage(), &ind);
+		buffer_append_float32_auto(send_buffer, mcpwm_foc_get_est_temp(), &ind);
+		buffer_append_uint32(send_buffer, mcpwm_foc_get_est_samples(), &ind);
+		send_buffer[ind++] = mc_interface_get_configuration()->foc_online_est;
+		commands_send_packet(send_buffer, ind);
+		break;
+
 	default:
 		break;
 	}
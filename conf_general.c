@@ -21,6 +21,7 @@
 #include "ch.h"
 #include "eeprom.h"
 #include "mcpwm.h"
+#include "mcpwm_foc.h"
 #include "mc_interface.h"
 #include "hw.h"
 #include "utils.h"
@@ -255,6 +256,32 @@ void conf_general_get_default_mc_configuration(mc_configuration *conf) {
 	conf->foc_sat_comp = MCCONF_FOC_SAT_COMP;
 	conf->foc_temp_comp = MCCONF_FOC_TEMP_COMP;
 	conf->foc_temp_comp_base_temp = MCCONF_FOC_TEMP_COMP_BASE_TEMP;
+	conf->foc_observer_type = MCCONF_FOC_OBSERVER_TYPE;
+	conf->foc_observer_iterations = MCCONF_FOC_OBSERVER_ITERATIONS;
+	conf->foc_observer_iter_min_erpm = MCCONF_FOC_OBSERVER_ITER_MIN_ERPM;
+	conf->foc_est_decimation = MCCONF_FOC_EST_DECIMATION;
+	conf->foc_fw_current_max = MCCONF_FOC_FW_CURRENT_MAX;
+	conf->foc_fw_duty_start = MCCONF_FOC_FW_DUTY_START;
+	conf->foc_fw_ramp_time = MCCONF_FOC_FW_RAMP_TIME;
+	conf->foc_motor_ld_lq_diff = MCCONF_FOC_MOTOR_LD_LQ_DIFF;
+	conf->foc_mtpa_enable = MCCONF_FOC_MTPA_ENABLE;
+	conf->foc_hfi_voltage = MCCONF_FOC_HFI_VOLTAGE;
+	conf->foc_hfi_bw = MCCONF_FOC_HFI_BW;
+	conf->foc_hfi_polarity_current = MCCONF_FOC_HFI_POLARITY_CURRENT;
+	conf->foc_online_est = MCCONF_FOC_ONLINE_EST;
+	conf->foc_cc_decoupling = MCCONF_FOC_CC_DECOUPLING;
+	conf->foc_pll_adaptive = MCCONF_FOC_PLL_ADAPTIVE;
+	conf->foc_pll_bw_min = MCCONF_FOC_PLL_BW_MIN;
+	conf->foc_pll_bw_max = MCCONF_FOC_PLL_BW_MAX;
+	conf->foc_pll_bw_erpm = MCCONF_FOC_PLL_BW_ERPM;
+	conf->foc_pll_obs_speed = MCCONF_FOC_PLL_OBS_SPEED;
+	conf->foc_overmod_mode = MCCONF_FOC_OVERMOD_MODE;
+	conf->foc_dpwm_mode = MCCONF_FOC_DPWM_MODE;
+	conf->foc_dpwm_mod_min = MCCONF_FOC_DPWM_MOD_MIN;
+	conf->foc_f_sw_sched = MCCONF_FOC_F_SW_SCHED;
+	conf->foc_f_sw_min = MCCONF_FOC_F_SW_MIN;
+	conf->foc_f_sw_sched_erpm = MCCONF_FOC_F_SW_SCHED_ERPM;
+	conf->foc_f_sw_temp_margin = MCCONF_FOC_F_SW_TEMP_MARGIN;
 
 	conf->s_pid_kp = MCCONF_S_PID_KP;
 	conf->s_pid_ki = MCCONF_S_PID_KI;
@@ -777,3 +804,68 @@ bool conf_general_measure_flux_linkage(float current, float duty,
 
 	return true;
 }
+
+/**
+ * Measure the motor resistance and inductance with FOC and calculate the
+ * current controller gains for a bandwidth from them.
+ *
+ * @param bw
+ * The current controller bandwidth in rad/s.
+ *
+ * @param apply
+ * Store the measured motor parameters and the calculated gains in the
+ * motor configuration when they are valid.
+ *
+ * @param res
+ * The measured motor resistance in ohm.
+ *
+ * @param ind
+ * The measured motor inductance, (Ld + Lq) / 2, in henry.
+ *
+ * @param ld_lq_diff
+ * The measured Lq - Ld in henry.
+ *
+ * @param kp
+ * The calculated proportional gain.
+ *
+ * @param ki
+ * The calculated integral gain.
+ *
+ * @param phase_margin
+ * The phase margin of the current loop with the calculated gains in degrees.
+ *
+ * @return
+ * True if the measurement worked and the gains have enough phase margin
+ * at the lowest switching frequency the configuration allows, false otherwise.
+ */
+bool conf_general_detect_current_gains(float bw, bool apply, float *res, float *ind,
+		float *ld_lq_diff, float *kp, float *ki, float *phase_margin) {
+	mcconf = *mc_interface_get_configuration();
+	mcconf_old = mcconf;
+
+	mcconf.motor_type = MOTOR_TYPE_FOC;
+	mc_interface_set_configuration(&mcconf);
+
+	float ind_uh = 0.0;
+	float ld_lq_diff_uh = 0.0;
+	bool ok = mcpwm_foc_measure_res_ind(res, &ind_uh, &ld_lq_diff_uh);
+	mc_interface_set_configuration(&mcconf_old);
+
+	*ind = ind_uh * 1e-6;
+	*ld_lq_diff = ld_lq_diff_uh * 1e-6;
+
+	// Evaluated with the switching frequencies of the restored configuration
+	ok = mcpwm_foc_calc_current_gains(bw, *res, *ind, kp, ki, phase_margin) && ok;
+
+	if (ok && apply) {
+		mcconf_old.foc_motor_r = *res;
+		mcconf_old.foc_motor_l = *ind;
+		mcconf_old.foc_motor_ld_lq_diff = *ld_lq_diff;
+		mcconf_old.foc_current_kp = *kp;
+		mcconf_old.foc_current_ki = *ki;
+		conf_general_store_mc_configuration(&mcconf_old);
+		mc_interface_set_configuration(&mcconf_old);
+	}
+
+	return ok;
+}
@@ -22,7 +22,7 @@
 
 // Firmware version
 #define FW_VERSION_MAJOR		3
-#define FW_VERSION_MINOR		31
+#define FW_VERSION_MINOR		32
 
 #include "datatypes.h"
 
@@ -123,6 +123,16 @@
 #define SERVO_OUT_PULSE_MAX_US		2000	// Maximum pulse length in microseconds
 #define SERVO_OUT_RATE_HZ			50		// Update rate in Hz
 
+/*
+ * Measure the execution time of the motor control interrupt handlers and some of
+ * their sections with the DWT cycle counter. Costs a few hundred cycles per
+ * interrupt when enabled, so it is off by default. Build with ISR_PROF_ENABLE=1
+ * to use it.
+ */
+#ifndef ISR_PROF_ENABLE
+#define ISR_PROF_ENABLE				0
+#endif
+
 // Correction factor for computations that depend on the old resistor division factor
 #define VDIV_CORR					((VIN_R2 / (VIN_R2 + VIN_R1)) / (2.2 / (2.2 + 33.0)))
 
@@ -171,5 +181,7 @@ bool conf_general_detect_motor_param(float current, float min_rpm, float low_dut
 		float *int_limit, float *bemf_coupling_k, int8_t *hall_table, int *hall_res);
 bool conf_general_measure_flux_linkage(float current, float duty,
 		float min_erpm, float res, float *linkage);
+bool conf_general_detect_current_gains(float bw, bool apply, float *res, float *ind,
+		float *ld_lq_diff, float *kp, float *ki, float *phase_margin);
 
 #endif /* CONF_GENERAL_H_ */
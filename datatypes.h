@@ -35,12 +35,14 @@ typedef enum {
 typedef enum {
 	PWM_MODE_NONSYNCHRONOUS_HISW = 0, // This mode is not recommended
 	PWM_MODE_SYNCHRONOUS, // The recommended and most tested mode
-	PWM_MODE_BIPOLAR // Some glitches occasionally, can kill MOSFETs
+	PWM_MODE_BIPOLAR, // Some glitches occasionally, can kill MOSFETs
+	PWM_MODE_SINE_HALL // Hall-interpolated sine drive, synchronous six-step without hall sensors
 } mc_pwm_mode;
 
 typedef enum {
 	COMM_MODE_INTEGRATE = 0,
-	COMM_MODE_DELAY
+	COMM_MODE_DELAY,
+	COMM_MODE_ZC_INTERPOLATE
 } mc_comm_mode;
 
 typedef enum {
@@ -52,9 +54,36 @@ typedef enum {
 typedef enum {
 	FOC_SENSOR_MODE_SENSORLESS = 0,
 	FOC_SENSOR_MODE_ENCODER,
-	FOC_SENSOR_MODE_HALL
+	FOC_SENSOR_MODE_HALL,
+	FOC_SENSOR_MODE_HFI
 } mc_foc_sensor_mode;
 
+typedef enum {
+	FOC_OBSERVER_ITERATIVE = 0,
+	FOC_OBSERVER_RK2,
+	FOC_OBSERVER_ANALYTIC
+} mc_foc_observer_type;
+
+typedef enum {
+	FOC_CC_DECOUPLING_DISABLED = 0,
+	FOC_CC_DECOUPLING_CROSS,
+	FOC_CC_DECOUPLING_BEMF,
+	FOC_CC_DECOUPLING_CROSS_BEMF
+} mc_foc_cc_decoupling_mode;
+
+typedef enum {
+	FOC_OVERMOD_DISABLED = 0,
+	FOC_OVERMOD_HEXAGON,
+	FOC_OVERMOD_SIX_STEP
+} mc_foc_overmod_mode;
+
+typedef enum {
+	FOC_DPWM_DISABLED = 0,
+	FOC_DPWM_MIN,
+	FOC_DPWM_MAX,
+	FOC_DPWM_1
+} mc_foc_dpwm_mode;
+
 typedef enum {
 	MOTOR_TYPE_BLDC = 0,
 	MOTOR_TYPE_DC,
@@ -205,6 +234,32 @@ typedef struct {
 	float foc_sat_comp;
 	bool foc_temp_comp;
 	float foc_temp_comp_base_temp;
+	mc_foc_observer_type foc_observer_type;
+	int foc_observer_iterations;
+	float foc_observer_iter_min_erpm;
+	int foc_est_decimation;
+	float foc_fw_current_max;
+	float foc_fw_duty_start;
+	float foc_fw_ramp_time;
+	float foc_motor_ld_lq_diff;
+	bool foc_mtpa_enable;
+	float foc_hfi_voltage;
+	float foc_hfi_bw;
+	float foc_hfi_polarity_current;
+	bool foc_online_est;
+	mc_foc_cc_decoupling_mode foc_cc_decoupling;
+	bool foc_pll_adaptive;
+	float foc_pll_bw_min;
+	float foc_pll_bw_max;
+	float foc_pll_bw_erpm;
+	bool foc_pll_obs_speed;
+	mc_foc_overmod_mode foc_overmod_mode;
+	mc_foc_dpwm_mode foc_dpwm_mode;
+	float foc_dpwm_mod_min;
+	bool foc_f_sw_sched;
+	float foc_f_sw_min;
+	float foc_f_sw_sched_erpm;
+	float foc_f_sw_temp_margin;
 	// Speed PID
 	float s_pid_kp;
 	float s_pid_ki;
@@ -473,7 +528,10 @@ typedef enum {
 	COMM_FORWARD_CAN,
 	COMM_SET_CHUCK_DATA,
 	COMM_CUSTOM_APP_DATA,
-	COMM_NRF_START_PAIRING
+	COMM_NRF_START_PAIRING,
+	COMM_GET_ISR_PROF,
+	COMM_GET_MOTOR_EST,
+	COMM_DETECT_CURRENT_GAINS
 } COMM_PACKET_ID;
 
 // CAN commands
@@ -588,4 +646,24 @@ typedef enum {
 	NRF_PAIR_FAIL
 } NRF_PAIR_RES;
 
+typedef enum {
+	ISR_PROF_FOC_TOTAL = 0,
+	ISR_PROF_FOC_OBSERVER,
+	ISR_PROF_FOC_PLL,
+	ISR_PROF_FOC_CONTROL_CURRENT,
+	ISR_PROF_FOC_SVM,
+	ISR_PROF_FOC_MCIF,
+	ISR_PROF_BLDC_TOTAL,
+	ISR_PROF_BLDC_MCIF,
+	ISR_PROF_SECTION_NUM
+} isr_prof_section;
+
+typedef struct {
+	uint32_t samples;
+	uint32_t min;
+	uint32_t max;
+	float mean;
+	uint32_t p99;
+} isr_prof_stats;
+
 #endif /* DATATYPES_H_ */
@@ -21,6 +21,9 @@
 #include  <math.h>
 #include  <stdint.h>
 
+// Private functions
+static inline float fir_mac(float acc, const float *coeffs, const float *samples, int len);
+
 // Found at http://paulbourke.net/miscellaneous//dft/
 void filter_fft(int dir, int m, float *real, float *imag) {
 	long n,i,i1,j,k,i2,l,l1,l2;
@@ -201,6 +204,24 @@ void filter_create_fir_lowpass(float *filter_vector, float f_break, int bits, in
  * returns: The filtered result sample.
  */
 float filter_run_fir_iteration(float *vector, float *filter, int bits, uint32_t offset) {
+	int size = 1 << bits;
+	offset &= size - 1;
+
+	// Run the two linear parts of the circular buffer one after the other
+	// instead of wrapping the index for every tap. The taps are accumulated
+	// in the same order as before, so the result does not change.
+	float result = fir_mac(0.0, filter, vector + offset, size - offset);
+	result = fir_mac(result, filter + (size - offset), vector, offset);
+
+	return result;
+}
+
+/*
+ * The original FIR iteration that wraps the index for every tap. Kept as the
+ * reference for the fir_bench terminal command, same arguments as
+ * filter_run_fir_iteration.
+ */
+float filter_run_fir_iteration_ref(float *vector, float *filter, int bits, uint32_t offset) {
 	float result = 0;
 	int size = 1 << bits;
 	uint32_t cnt_mask = 0xFFFFFFFF >> (32 - bits);
@@ -232,3 +253,79 @@ void filter_add_sample(float *buffer, float sample, int bits, uint32_t *offset)
 	*offset += 1;
 	*offset &= cnt_mask;
 }
+
+/**
+ * Initialize a moving average filter.
+ *
+ * @param ma
+ * The filter state.
+ *
+ * @param buffer
+ * Sample buffer with a length of (1 << bits). Has to stay valid as long as
+ * the filter is used.
+ *
+ * @param bits
+ * The length of the filter in bits.
+ */
+void filter_ma_init(filter_ma_state *ma, float *buffer, int bits) {
+	ma->buffer = buffer;
+	ma->bits = bits;
+	ma->offset = 0;
+	ma->sum = 0.0;
+	ma->sum_lap = 0.0;
+
+	for (int i = 0;i < (1 << bits);i++) {
+		buffer[i] = 0.0;
+	}
+}
+
+/**
+ * Add a sample to a moving average filter. This takes constant time
+ * regardless of the filter length.
+ *
+ * @param ma
+ * The filter state.
+ *
+ * @param sample
+ * The sample to add.
+ */
+void filter_ma_add_sample(filter_ma_state *ma, float sample) {
+	ma->sum += sample - ma->buffer[ma->offset];
+	ma->sum_lap += sample;
+	filter_add_sample(ma->buffer, sample, ma->bits, &ma->offset);
+
+	// When the buffer wraps around, all samples in it have been added to
+	// sum_lap since the last wrap. Restarting from that sum keeps the
+	// rounding errors of the running sum from building up.
+	if (ma->offset == 0) {
+		ma->sum = ma->sum_lap;
+		ma->sum_lap = 0.0;
+	}
+}
+
+/**
+ * Get the output of a moving average filter.
+ *
+ * @param ma
+ * The filter state.
+ *
+ * @return
+ * The average of the last (1 << bits) samples.
+ */
+float filter_ma_get(filter_ma_state *ma) {
+	return ma->sum / (float)(1 << ma->bits);
+}
+
+/*
+ * Multiply-accumulate len samples with len coefficients. Not unrolled by hand,
+ * an unrolled block lets the compiler vectorize the multiplies and round them
+ * separately from the additions, so with fused multiply-adds the result would
+ * differ from the masked loop.
+ */
+static inline float fir_mac(float acc, const float *coeffs, const float *samples, int len) {
+	for (int i = 0;i < len;i++) {
+		acc += coeffs[i] * samples[i];
+	}
+
+	return acc;
+}
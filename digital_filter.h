@@ -22,6 +22,15 @@
 
 #include <stdint.h>
 
+// Moving average (first order CIC) over a power of two length
+typedef struct {
+	float *buffer;
+	int bits;
+	uint32_t offset;
+	float sum;
+	float sum_lap;
+} filter_ma_state;
+
 // Functions
 void filter_fft(int dir, int m, float *real, float *imag);
 void filter_dft(int dir, int len, float *real, float *imag);
@@ -30,6 +39,10 @@ void filter_hamming(float *data, int len);
 void filter_zeroPad(float *data, float *result, int dataLen, int resultLen);
 void filter_create_fir_lowpass(float *filter_vector, float f_break, int bits, int use_hamming);
 float filter_run_fir_iteration(float *vector, float *filter, int bits, uint32_t offset);
+float filter_run_fir_iteration_ref(float *vector, float *filter, int bits, uint32_t offset);
 void filter_add_sample(float *buffer, float sample, int bits, uint32_t *offset);
+void filter_ma_init(filter_ma_state *ma, float *buffer, int bits);
+void filter_ma_add_sample(filter_ma_state *ma, float sample);
+float filter_ma_get(filter_ma_state *ma);
 
 #endif /* DIGITAL_FILTER_H_ */
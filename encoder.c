@@ -27,6 +27,9 @@
 // Defines
 #define AS5047P_READ_ANGLECOM		(0x3FFF | 0x4000 | 0x8000) // This is just ones
 #define AS5047_SAMPLE_RATE_HZ		20000
+#define HALL_CAP_TIMER_FREQ			4000000
+#define HALL_CAP_FILTER				0xA // fDTS / 16, N = 8
+#define HALL_CAP_FILTER_DELAY		(8.0 * 16.0 / (168000000.0 / 2.0))
 
 #if AS5047_USE_HW_SPI_PINS
 #ifdef HW_SPI_DEV
@@ -62,7 +65,8 @@
 typedef enum {
 	ENCODER_MODE_NONE = 0,
 	ENCODER_MODE_ABI,
-	ENCODER_MODE_AS5047P_SPI
+	ENCODER_MODE_AS5047P_SPI,
+	ENCODER_MODE_HALL_CAPTURE
 } encoder_mode;
 
 // Private variables
@@ -70,6 +74,8 @@ static bool index_found = false;
 static uint32_t enc_counts = 10000;
 static encoder_mode mode = ENCODER_MODE_NONE;
 static float last_enc_angle = 0.0;
+static volatile int hall_state = 0;
+static volatile bool hall_overflow = true;
 
 // Private functions
 static void spi_transfer(uint16_t *in_buf, const uint16_t *out_buf, int length);
@@ -89,6 +95,7 @@ void encoder_deinit(void) {
 
 	palSetPadMode(HW_HALL_ENC_GPIO1, HW_HALL_ENC_PIN1, PAL_MODE_INPUT_PULLUP);
 	palSetPadMode(HW_HALL_ENC_GPIO2, HW_HALL_ENC_PIN2, PAL_MODE_INPUT_PULLUP);
+	palSetPadMode(HW_HALL_ENC_GPIO3, HW_HALL_ENC_PIN3, PAL_MODE_INPUT_PULLUP);
 
 	index_found = false;
 	mode = ENCODER_MODE_NONE;
@@ -177,8 +184,110 @@ void encoder_init_as5047p_spi(void) {
 	index_found = true;
 }
 
+/**
+ * Capture the hall sensor edges with the hall sensor interface of the
+ * encoder timer. The three inputs are XORed on TI1, and every edge captures
+ * the counter into CCR1 and resets it, so the counter is the time since the
+ * last edge. The hall state is latched from the capture interrupt.
+ *
+ * Only available when HW_HAS_HALL_CAPTURE is defined, that is when the hall
+ * pins are channel 1 to 3 of HW_ENC_TIM. Otherwise this does nothing and the
+ * hall sensors have to be polled.
+ */
+void encoder_init_hall_capture(void) {
+#ifdef HW_HAS_HALL_CAPTURE
+	TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
+	TIM_ICInitTypeDef TIM_ICInitStructure;
+
+	palSetPadMode(HW_HALL_ENC_GPIO1, HW_HALL_ENC_PIN1, PAL_MODE_ALTERNATE(HW_ENC_TIM_AF) | PAL_STM32_PUDR_PULLUP);
+	palSetPadMode(HW_HALL_ENC_GPIO2, HW_HALL_ENC_PIN2, PAL_MODE_ALTERNATE(HW_ENC_TIM_AF) | PAL_STM32_PUDR_PULLUP);
+	palSetPadMode(HW_HALL_ENC_GPIO3, HW_HALL_ENC_PIN3, PAL_MODE_ALTERNATE(HW_ENC_TIM_AF) | PAL_STM32_PUDR_PULLUP);
+
+	// Enable timer clock
+	HW_ENC_TIM_CLK_EN();
+
+	// Time Base configuration
+	TIM_TimeBaseStructure.TIM_Prescaler = ((168000000 / 2 / HALL_CAP_TIMER_FREQ) - 1);
+	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseStructure.TIM_Period = 0xFFFF;
+	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+	TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
+	TIM_TimeBaseInit(HW_ENC_TIM, &TIM_TimeBaseStructure);
+
+	// XOR the three inputs on TI1 and capture on both edges of it
+	TIM_SelectHallSensor(HW_ENC_TIM, ENABLE);
+	TIM_ICInitStructure.TIM_Channel = TIM_Channel_1;
+	TIM_ICInitStructure.TIM_ICPolarity = TIM_ICPolarity_Rising;
+	TIM_ICInitStructure.TIM_ICSelection = TIM_ICSelection_TRC;
+	TIM_ICInitStructure.TIM_ICPrescaler = TIM_ICPSC_DIV1;
+	TIM_ICInitStructure.TIM_ICFilter = HALL_CAP_FILTER;
+	TIM_ICInit(HW_ENC_TIM, &TIM_ICInitStructure);
+
+	// Reset the counter on every edge
+	TIM_SelectInputTrigger(HW_ENC_TIM, TIM_TS_TI1F_ED);
+	TIM_SelectSlaveMode(HW_ENC_TIM, TIM_SlaveMode_Reset);
+
+	// Only overflows set the update flag, so it means that the counter
+	// no longer is the time since the last edge.
+	TIM_UpdateRequestConfig(HW_ENC_TIM, TIM_UpdateSource_Regular);
+
+	hall_overflow = true;
+	hall_state = READ_HALL1() | (READ_HALL2() << 1) | (READ_HALL3() << 2);
+	mode = ENCODER_MODE_HALL_CAPTURE;
+
+	TIM_ClearITPendingBit(HW_ENC_TIM, TIM_IT_Update | TIM_IT_CC1);
+	TIM_ITConfig(HW_ENC_TIM, TIM_IT_Update | TIM_IT_CC1, ENABLE);
+
+	// Enable timer
+	TIM_Cmd(HW_ENC_TIM, ENABLE);
+
+	// Above the control loop interrupts, so that they see the latched state
+	// and the counter of the same edge.
+	nvicEnableVector(HW_ENC_TIM_ISR_CH, 2);
+#endif
+}
+
 bool encoder_is_configured(void) {
-	return mode != ENCODER_MODE_NONE;
+	return mode == ENCODER_MODE_ABI || mode == ENCODER_MODE_AS5047P_SPI;
+}
+
+/**
+ * Check if the hall sensor edges are captured by the timer.
+ *
+ * @return
+ * True if encoder_hall_read and encoder_hall_edge_age can be used.
+ */
+bool encoder_hall_capture_active(void) {
+	return mode == ENCODER_MODE_HALL_CAPTURE;
+}
+
+/**
+ * Get the hall sensor state latched at the last captured edge.
+ *
+ * @return
+ * The hall sensor state, with hall 1 in bit 0.
+ */
+int encoder_hall_read(void) {
+	return hall_state;
+}
+
+/**
+ * Get the time since the last hall sensor edge. Read the state with
+ * encoder_hall_read before calling this, so that a new edge in between
+ * only makes the time shorter.
+ *
+ * @return
+ * The time since the last edge in seconds, or -1.0 if there has not been
+ * an edge for longer than the timer period.
+ */
+float encoder_hall_edge_age(void) {
+	const uint32_t cnt = HW_ENC_TIM->CNT;
+
+	if (hall_overflow || (HW_ENC_TIM->SR & TIM_SR_UIF)) {
+		return -1.0;
+	}
+
+	return (float)cnt / (float)HALL_CAP_TIMER_FREQ + HALL_CAP_FILTER_DELAY;
 }
 
 float encoder_read_deg(void) {
@@ -239,6 +348,12 @@ void encoder_reset(void) {
  * Timer interrupt
  */
 void encoder_tim_isr(void) {
+	if (mode == ENCODER_MODE_HALL_CAPTURE) {
+		// No edge during a whole timer period
+		hall_overflow = true;
+		return;
+	}
+
 	uint16_t pos;
 
 	spi_begin();
@@ -249,6 +364,17 @@ void encoder_tim_isr(void) {
 	last_enc_angle = ((float)pos * 360.0) / 16384.0;
 }
 
+/**
+ * Hall sensor edge capture interrupt. Reading the pins once here replaces
+ * reading them from every control loop interrupt. The input filter already
+ * required a stable level, so there is no need to filter the reading.
+ */
+void encoder_hall_capture_isr(void) {
+	(void)HW_ENC_TIM->CCR1;
+	hall_state = READ_HALL1() | (READ_HALL2() << 1) | (READ_HALL3() << 2);
+	hall_overflow = false;
+}
+
 /**
  * Set the number of encoder counts.
  *
@@ -26,10 +26,15 @@
 void encoder_deinit(void);
 void encoder_init_abi(uint32_t counts);
 void encoder_init_as5047p_spi(void);
+void encoder_init_hall_capture(void);
 bool encoder_is_configured(void);
+bool encoder_hall_capture_active(void);
+int encoder_hall_read(void);
+float encoder_hall_edge_age(void);
 float encoder_read_deg(void);
 void encoder_reset(void);
 void encoder_tim_isr(void);
+void encoder_hall_capture_isr(void);
 void encoder_set_counts(uint32_t counts);
 bool encoder_index_found(void);
 
@@ -152,6 +152,7 @@
 #define HW_ENC_EXTI_ISR_VEC		EXTI9_5_IRQHandler
 #define HW_ENC_TIM_ISR_CH		TIM4_IRQn
 #define HW_ENC_TIM_ISR_VEC		TIM4_IRQHandler
+#define HW_HAS_HALL_CAPTURE		// The hall pins are channel 1 to 3 of HW_ENC_TIM
 
 // NRF pins
 #define NRF_PORT_CSN			HW_ICU_GPIO
@@ -22,6 +22,7 @@
 #include "stm32f4xx_conf.h"
 #include "isr_vector_table.h"
 #include "mc_interface.h"
+#include "mcpwm.h"
 #include "mcpwm_foc.h"
 #include "servo.h"
 #include "hw.h"
@@ -43,6 +44,17 @@ CH_IRQ_HANDLER(ADC1_2_3_IRQHandler) {
 	CH_IRQ_EPILOGUE();
 }
 
+CH_IRQ_HANDLER(TIM2_IRQHandler) {
+	CH_IRQ_PROLOGUE();
+	if (TIM_GetITStatus(TIM2, TIM_IT_CC1) != RESET) {
+		// Clear the IT pending bit
+		TIM_ClearITPendingBit(TIM2, TIM_IT_CC1);
+
+		mcpwm_comm_int_handler();
+	}
+	CH_IRQ_EPILOGUE();
+}
+
 CH_IRQ_HANDLER(HW_ENC_EXTI_ISR_VEC) {
 	if (EXTI_GetITStatus(HW_ENC_EXTI_LINE) != RESET) {
 		encoder_reset();
@@ -59,6 +71,14 @@ CH_IRQ_HANDLER(HW_ENC_TIM_ISR_VEC) {
 		// Clear the IT pending bit
 		TIM_ClearITPendingBit(HW_ENC_TIM, TIM_IT_Update);
 	}
+
+	// Hall sensor edge. Handled after the overflow, as the edge resets the counter.
+	if (TIM_GetITStatus(HW_ENC_TIM, TIM_IT_CC1) != RESET) {
+		encoder_hall_capture_isr();
+
+		// Clear the IT pending bit
+		TIM_ClearITPendingBit(HW_ENC_TIM, TIM_IT_CC1);
+	}
 }
 
 CH_IRQ_HANDLER(TIM8_CC_IRQHandler) {
@@ -0,0 +1,181 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#include "isr_prof.h"
+#include "ch.h"
+#include "utils.h"
+#include <string.h>
+
+/*
+ * Execution time statistics for the motor control interrupt handlers, measured
+ * in core clock cycles with the DWT cycle counter.
+ *
+ * Every section keeps min, max, sum and a log-linear histogram. The histogram
+ * has 2^ISR_PROF_HIST_SUB_BITS bins per power of two, so percentiles are resolved
+ * to within 25 % while the update in the interrupt stays at a handful of cycles.
+ */
+
+// Private types
+typedef struct {
+	uint32_t samples;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t hist[ISR_PROF_HIST_BINS];
+} prof_section_t;
+
+// Private variables
+static volatile prof_section_t m_sections[ISR_PROF_SECTION_NUM];
+
+static const char *m_section_names[ISR_PROF_SECTION_NUM] = {
+		"FOC total",
+		"FOC observer",
+		"FOC pll",
+		"FOC control_current",
+		"FOC svm",
+		"FOC mcif",
+		"BLDC total",
+		"BLDC mcif"
+};
+
+// Private functions
+static uint32_t bin_upper_edge(int bin);
+
+void isr_prof_init(void) {
+#if ISR_PROF_ENABLE
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+	isr_prof_reset();
+}
+
+void isr_prof_reset(void) {
+	utils_sys_lock_cnt();
+	memset((void*)m_sections, 0, sizeof(m_sections));
+	for (int i = 0;i < ISR_PROF_SECTION_NUM;i++) {
+		m_sections[i].min = UINT32_MAX;
+	}
+	utils_sys_unlock_cnt();
+}
+
+/**
+ * Add a measurement to a section. This is called from the interrupt handlers,
+ * so keep it short.
+ *
+ * @param section
+ * The section the measurement belongs to.
+ *
+ * @param cycles
+ * The duration of the section in core clock cycles.
+ */
+void isr_prof_add(isr_prof_section section, uint32_t cycles) {
+	volatile prof_section_t *s = &m_sections[section];
+
+	s->samples++;
+	s->sum += cycles;
+
+	if (cycles < s->min) {
+		s->min = cycles;
+	}
+
+	if (cycles > s->max) {
+		s->max = cycles;
+	}
+
+	const uint32_t sub = 1 << ISR_PROF_HIST_SUB_BITS;
+	int bin;
+	if (cycles < sub) {
+		bin = cycles;
+	} else {
+		const int msb = 31 - __builtin_clz(cycles);
+		const int shift = msb - ISR_PROF_HIST_SUB_BITS;
+		bin = (shift + 1) * sub + ((cycles >> shift) & (sub - 1));
+		if (bin >= ISR_PROF_HIST_BINS) {
+			bin = ISR_PROF_HIST_BINS - 1;
+		}
+	}
+
+	s->hist[bin]++;
+}
+
+/**
+ * Get the statistics of a section.
+ *
+ * @param section
+ * The section to get the statistics for.
+ *
+ * @param stats
+ * Pointer to store the statistics in. All times are in core clock cycles. p99 is
+ * the upper edge of the histogram bin where 99 % of the samples are reached.
+ */
+void isr_prof_get_stats(isr_prof_section section, isr_prof_stats *stats) {
+	prof_section_t s;
+
+	utils_sys_lock_cnt();
+	s = *((prof_section_t*)&m_sections[section]);
+	utils_sys_unlock_cnt();
+
+	memset(stats, 0, sizeof(isr_prof_stats));
+
+	if (s.samples == 0) {
+		return;
+	}
+
+	stats->samples = s.samples;
+	stats->min = s.min;
+	stats->max = s.max;
+	stats->mean = (float)((double)s.sum / (double)s.samples);
+
+	const uint64_t target = ((uint64_t)s.samples * 99 + 99) / 100;
+	uint64_t cnt = 0;
+	stats->p99 = s.max;
+	for (int i = 0;i < (ISR_PROF_HIST_BINS - 1);i++) {
+		cnt += s.hist[i];
+		if (cnt >= target) {
+			stats->p99 = bin_upper_edge(i);
+			break;
+		}
+	}
+
+	if (stats->p99 > stats->max) {
+		stats->p99 = stats->max;
+	}
+}
+
+const char *isr_prof_section_name(isr_prof_section section) {
+	if (section < ISR_PROF_SECTION_NUM) {
+		return m_section_names[section];
+	} else {
+		return "Unknown";
+	}
+}
+
+static uint32_t bin_upper_edge(int bin) {
+	const int sub = 1 << ISR_PROF_HIST_SUB_BITS;
+
+	if (bin < sub) {
+		return bin;
+	}
+
+	const int shift = bin / sub - 1;
+	return (((uint32_t)(sub + bin % sub) + 1) << shift) - 1;
+}
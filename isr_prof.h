@@ -0,0 +1,49 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#ifndef ISR_PROF_H_
+#define ISR_PROF_H_
+
+#include "conf_general.h"
+#include "datatypes.h"
+#include "stm32f4xx.h"
+#include <stdint.h>
+
+// Functions
+void isr_prof_init(void);
+void isr_prof_reset(void);
+void isr_prof_add(isr_prof_section section, uint32_t cycles);
+void isr_prof_get_stats(isr_prof_section section, isr_prof_stats *stats);
+const char *isr_prof_section_name(isr_prof_section section);
+
+// Macros
+#if ISR_PROF_ENABLE
+#define ISR_PROF_NOW()						(DWT->CYCCNT)
+#define ISR_PROF_ADD(section, start)		isr_prof_add(section, DWT->CYCCNT - (start))
+#else
+#define ISR_PROF_NOW()						0
+#define ISR_PROF_ADD(section, start)		(void)(start)
+#endif
+
+// Defines
+#define ISR_PROF_HIST_SUB_BITS				2 // Histogram bins per power of two = 2^ISR_PROF_HIST_SUB_BITS
+#define ISR_PROF_HIST_BINS					64
+
+#endif /* ISR_PROF_H_ */
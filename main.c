@@ -48,12 +48,13 @@
 #include "nrf_driver.h"
 #include "rfhelp.h"
 #include "spi_sw.h"
+#include "isr_prof.h"
 
 /*
  * Timers used:
  * TIM7: servo
  * TIM1: mcpwm
- * TIM2: mcpwm
+ * TIM2: mcpwm (RPM measurement, commutation timing)
  * TIM12: mcpwm
  * TIM8: mcpwm
  * TIM3: servo_dec/Encoder (HW_R2)/servo_simple
@@ -196,6 +197,8 @@ int main(void) {
 
 	conf_general_init();
 	ledpwm_init();
+	isr_prof_init();
+	utils_trig_init();
 
 	mc_configuration mcconf;
 	conf_general_read_mc_configuration(&mcconf);
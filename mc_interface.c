@@ -139,6 +139,11 @@ void mc_interface_init(mc_configuration *configuration) {
 	// Initialize encoder
 #if !WS2811_ENABLE
 	switch (m_conf.m_sensor_port_mode) {
+	case SENSOR_PORT_MODE_HALL:
+		// Does nothing without HW_HAS_HALL_CAPTURE, the halls are polled then
+		encoder_init_hall_capture();
+		break;
+
 	case SENSOR_PORT_MODE_ABI:
 		encoder_init_abi(m_conf.m_encoder_counts);
 		break;
@@ -177,6 +182,11 @@ void mc_interface_set_configuration(mc_configuration *configuration) {
 	if (m_conf.m_sensor_port_mode != configuration->m_sensor_port_mode) {
 		encoder_deinit();
 		switch (configuration->m_sensor_port_mode) {
+		case SENSOR_PORT_MODE_HALL:
+			// Does nothing without HW_HAS_HALL_CAPTURE, the halls are polled then
+			encoder_init_hall_capture();
+			break;
+
 		case SENSOR_PORT_MODE_ABI:
 			encoder_init_abi(configuration->m_encoder_counts);
 			break;
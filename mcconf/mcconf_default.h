@@ -314,6 +314,84 @@
 #ifndef MCCONF_FOC_TEMP_COMP_BASE_TEMP
 #define MCCONF_FOC_TEMP_COMP_BASE_TEMP	25.0	// Motor temperature compensation base temperature
 #endif
+#ifndef MCCONF_FOC_OBSERVER_TYPE
+#define MCCONF_FOC_OBSERVER_TYPE		FOC_OBSERVER_ITERATIVE	// Observer integration method
+#endif
+#ifndef MCCONF_FOC_OBSERVER_ITERATIONS
+#define MCCONF_FOC_OBSERVER_ITERATIONS	6	// Euler steps per control period for the iterative observer
+#endif
+#ifndef MCCONF_FOC_OBSERVER_ITER_MIN_ERPM
+#define MCCONF_FOC_OBSERVER_ITER_MIN_ERPM	0.0	// Use only one observer step below this ERPM (0 = always iterate)
+#endif
+#ifndef MCCONF_FOC_EST_DECIMATION
+#define MCCONF_FOC_EST_DECIMATION		1	// Run the observer, PLL and position control every n cycles
+#endif
+#ifndef MCCONF_FOC_FW_CURRENT_MAX
+#define MCCONF_FOC_FW_CURRENT_MAX		0.0	// Maximum field weakening current, 0 disables it
+#endif
+#ifndef MCCONF_FOC_FW_DUTY_START
+#define MCCONF_FOC_FW_DUTY_START		0.9	// Start field weakening at this fraction of l_max_duty
+#endif
+#ifndef MCCONF_FOC_FW_RAMP_TIME
+#define MCCONF_FOC_FW_RAMP_TIME			0.2	// Time to ramp the field weakening current from 0 to max
+#endif
+#ifndef MCCONF_FOC_MOTOR_LD_LQ_DIFF
+#define MCCONF_FOC_MOTOR_LD_LQ_DIFF		0.0	// Lq - Ld, used by MTPA
+#endif
+#ifndef MCCONF_FOC_MTPA_ENABLE
+#define MCCONF_FOC_MTPA_ENABLE			false	// Split the current into Id and Iq for maximum torque per amp
+#endif
+#ifndef MCCONF_FOC_HFI_VOLTAGE
+#define MCCONF_FOC_HFI_VOLTAGE			4.0	// High frequency injection voltage amplitude
+#endif
+#ifndef MCCONF_FOC_HFI_BW
+#define MCCONF_FOC_HFI_BW				250.0	// Bandwidth of the HFI angle tracker (rad/s)
+#endif
+#ifndef MCCONF_FOC_HFI_POLARITY_CURRENT
+#define MCCONF_FOC_HFI_POLARITY_CURRENT	10.0	// D axis current for the magnet polarity detection
+#endif
+#ifndef MCCONF_FOC_ONLINE_EST
+#define MCCONF_FOC_ONLINE_EST			false	// Use the online R and flux linkage estimates in the observer
+#endif
+#ifndef MCCONF_FOC_CC_DECOUPLING
+#define MCCONF_FOC_CC_DECOUPLING		FOC_CC_DECOUPLING_DISABLED	// Current controller decoupling feed-forward
+#endif
+#ifndef MCCONF_FOC_PLL_ADAPTIVE
+#define MCCONF_FOC_PLL_ADAPTIVE			false	// Schedule the PLL bandwidth on speed and observer confidence
+#endif
+#ifndef MCCONF_FOC_PLL_BW_MIN
+#define MCCONF_FOC_PLL_BW_MIN			100.0	// PLL bandwidth at standstill (rad/s)
+#endif
+#ifndef MCCONF_FOC_PLL_BW_MAX
+#define MCCONF_FOC_PLL_BW_MAX			1500.0	// PLL bandwidth at foc_pll_bw_erpm and above (rad/s)
+#endif
+#ifndef MCCONF_FOC_PLL_BW_ERPM
+#define MCCONF_FOC_PLL_BW_ERPM			20000.0	// ERPM at which the PLL bandwidth reaches its maximum
+#endif
+#ifndef MCCONF_FOC_PLL_OBS_SPEED
+#define MCCONF_FOC_PLL_OBS_SPEED		false	// Speed from the observer flux angle derivative instead of the PLL integrator
+#endif
+#ifndef MCCONF_FOC_OVERMOD_MODE
+#define MCCONF_FOC_OVERMOD_MODE			FOC_OVERMOD_DISABLED	// Overmodulation at the maximum duty cycle
+#endif
+#ifndef MCCONF_FOC_DPWM_MODE
+#define MCCONF_FOC_DPWM_MODE			FOC_DPWM_DISABLED	// Discontinuous PWM above foc_dpwm_mod_min
+#endif
+#ifndef MCCONF_FOC_DPWM_MOD_MIN
+#define MCCONF_FOC_DPWM_MOD_MIN			0.5	// Modulation index above which discontinuous PWM is used
+#endif
+#ifndef MCCONF_FOC_F_SW_SCHED
+#define MCCONF_FOC_F_SW_SCHED			false	// Lower the switching frequency with speed, FET temperature and current
+#endif
+#ifndef MCCONF_FOC_F_SW_MIN
+#define MCCONF_FOC_F_SW_MIN				10000.0	// Lowest scheduled switching frequency
+#endif
+#ifndef MCCONF_FOC_F_SW_SCHED_ERPM
+#define MCCONF_FOC_F_SW_SCHED_ERPM		30000.0	// ERPM at which the switching frequency reaches foc_f_sw_min
+#endif
+#ifndef MCCONF_FOC_F_SW_TEMP_MARGIN
+#define MCCONF_FOC_F_SW_TEMP_MARGIN		15.0	// Start lowering the switching frequency this much below l_temp_fet_start
+#endif
 
 // Misc
 #ifndef MCCONF_M_FAULT_STOP_TIME
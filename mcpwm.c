@@ -31,6 +31,7 @@
 #include "ledpwm.h"
 #include "terminal.h"
 #include "encoder.h"
+#include "isr_prof.h"
 
 // Structs
 typedef struct {
@@ -52,6 +53,8 @@ static volatile int direction;
 static volatile float dutycycle_set;
 static volatile float dutycycle_now;
 static volatile float rpm_now;
+static volatile uint32_t rpm_seq;
+static volatile int32_t speed_pid_ticks;
 static volatile float speed_pid_set_rpm;
 static volatile float pos_pid_set_pos;
 static volatile float current_set;
@@ -90,18 +93,30 @@ static volatile int hall_detect_table[8][7];
 static volatile bool init_done;
 static volatile mc_comm_mode comm_mode_next;
 
+// Zero crossing interpolation. Times are in RPM timer (TIM2) ticks since the
+// last commutation.
+static volatile int32_t zc_time;
+static volatile int32_t zc_time_last;
+static volatile uint32_t zc_step_ticks_last;
+static volatile bool zc_sample_valid;
+static volatile int zc_sample_v;
+static volatile uint32_t zc_sample_time;
+static volatile bool zc_comm_pending;
+
+// Hall-interpolated sine drive
+static volatile uint32_t sine_sector_ticks;
+static volatile float sine_angle;
+
 #ifdef HW_HAS_3_SHUNTS
 static volatile int curr2_sum;
 static volatile int curr2_offset;
 #endif
 
-// KV FIR filter
-#define KV_FIR_TAPS_BITS		7
-#define KV_FIR_LEN				(1 << KV_FIR_TAPS_BITS)
-#define KV_FIR_FCUT				0.02
-static volatile float kv_fir_coeffs[KV_FIR_LEN];
-static volatile float kv_fir_samples[KV_FIR_LEN];
-static volatile int kv_fir_index = 0;
+// KV moving average filter
+#define KV_MA_BITS				5
+#define KV_MA_LEN				(1 << KV_MA_BITS)
+static float kv_ma_samples[KV_MA_LEN];
+static filter_ma_state kv_ma;
 
 // Amplitude FIR filter
 #define AMP_FIR_TAPS_BITS		7
@@ -136,10 +151,14 @@ static void stop_pwm_ll(void);
 static void stop_pwm_hw(void);
 static void full_brake_ll(void);
 static void full_brake_hw(void);
-static void run_pid_control_speed(void);
+static void run_pid_control_speed(float dt);
 static void run_pid_control_pos(float dt);
 static void set_next_comm_step(int next_step);
-static void update_rpm_tacho(void);
+static bool zc_schedule_commutation(int v_diff, uint32_t time_now);
+static void update_rpm_tacho(uint32_t edge_ticks);
+static void update_rpm(float rpm_sample, float dt);
+static void update_rpm_idle(void);
+static void update_sine_drive(void);
 static void update_sensor_mode(void);
 static int read_hall(void);
 static void update_adc_sample_pos(mc_timer_struct *timer_tmp);
@@ -151,14 +170,14 @@ static void do_dc_cal(void);
 
 // Defines
 #define IS_DETECTING()			(state == MC_STATE_DETECTING)
+#define IS_SINE_DRIVE()			(conf->motor_type == MOTOR_TYPE_BLDC && \
+								conf->pwm_mode == PWM_MODE_SINE_HALL && \
+								!sensorless_now && !IS_DETECTING())
 
 // Threads
 static THD_WORKING_AREA(timer_thread_wa, 2048);
 static THD_FUNCTION(timer_thread, arg);
-static THD_WORKING_AREA(rpm_thread_wa, 1024);
-static THD_FUNCTION(rpm_thread, arg);
 static volatile bool timer_thd_stop;
-static volatile bool rpm_thd_stop;
 
 void mcpwm_init(volatile mc_configuration *configuration) {
 	utils_sys_lock_cnt();
@@ -176,6 +195,8 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 	detect_step = 0;
 	direction = 1;
 	rpm_now = 0.0;
+	rpm_seq = 0;
+	speed_pid_ticks = 0;
 	dutycycle_set = 0.0;
 	dutycycle_now = 0.0;
 	speed_pid_set_rpm = 0.0;
@@ -204,11 +225,18 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 	memset((void*)hall_detect_table, 0, sizeof(hall_detect_table[0][0]) * 8 * 7);
 	update_sensor_mode();
 	comm_mode_next = conf->comm_mode;
+	zc_time = -1;
+	zc_time_last = -1;
+	zc_step_ticks_last = 0;
+	zc_sample_valid = false;
+	zc_comm_pending = false;
+	sine_sector_ticks = 0;
+	sine_angle = 0.0;
 
 	mcpwm_init_hall_table((int8_t*)conf->hall_table);
 
-	// Create KV FIR filter
-	filter_create_fir_lowpass((float*)kv_fir_coeffs, KV_FIR_FCUT, KV_FIR_TAPS_BITS, 1);
+	// Create KV moving average filter
+	filter_ma_init(&kv_ma, kv_ma_samples, KV_MA_BITS);
 
 	// Create amplitude FIR filter
 	filter_create_fir_lowpass((float*)amp_fir_coeffs, AMP_FIR_FCUT, AMP_FIR_TAPS_BITS, 1);
@@ -423,6 +451,12 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
 	TIM_TimeBaseInit(TIM2, &TIM_TimeBaseStructure);
 
+	// Compare channel 1 schedules commutations in the zero crossing
+	// interpolation mode. Same priority as the ADC DMA interrupt, so that
+	// they never run commutate at the same time.
+	TIM_ClearITPendingBit(TIM2, TIM_IT_CC1);
+	nvicEnableVector(TIM2_IRQn, 3);
+
 	// TIM2 enable counter
 	TIM_Cmd(TIM2, ENABLE);
 
@@ -456,9 +490,7 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 
 	// Start threads
 	timer_thd_stop = false;
-	rpm_thd_stop = false;
 	chThdCreateStatic(timer_thread_wa, sizeof(timer_thread_wa), NORMALPRIO, timer_thread, NULL);
-	chThdCreateStatic(rpm_thread_wa, sizeof(rpm_thread_wa), NORMALPRIO, rpm_thread, NULL);
 
 	// WWDG configuration
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_WWDG, ENABLE);
@@ -479,9 +511,8 @@ void mcpwm_deinit(void) {
 	WWDG_DeInit();
 
 	timer_thd_stop = true;
-	rpm_thd_stop = true;
 
-	while (timer_thd_stop || rpm_thd_stop) {
+	while (timer_thd_stop) {
 		chThdSleepMilliseconds(1);
 	}
 
@@ -492,6 +523,7 @@ void mcpwm_deinit(void) {
 	ADC_DeInit();
 	DMA_DeInit(DMA2_Stream4);
 	nvicDisableVector(ADC_IRQn);
+	nvicDisableVector(TIM2_IRQn);
 	dmaStreamRelease(STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 4)));
 }
 
@@ -750,7 +782,7 @@ float mcpwm_get_kv(void) {
 }
 
 /**
- * Calculate the FIR-filtered KV (RPM per volt) value for the motor. This
+ * Calculate the filtered KV (RPM per volt) value for the motor. This
  * function has to be used while the motor is moving. Note that the return
  * value has to be divided by half the number of motor poles.
  *
@@ -758,10 +790,7 @@ float mcpwm_get_kv(void) {
  * The filtered KV value.
  */
 float mcpwm_get_kv_filtered(void) {
-	float value = filter_run_fir_iteration((float*)kv_fir_samples,
-			(float*)kv_fir_coeffs, KV_FIR_TAPS_BITS, kv_fir_index);
-
-	return value;
+	return filter_ma_get(&kv_ma);
 }
 
 /**
@@ -1096,7 +1125,7 @@ static void set_duty_cycle_hw(float dutyCycle) {
 	if (conf->motor_type == MOTOR_TYPE_DC) {
 		switching_frequency_now = conf->m_dc_f_sw;
 	} else {
-		if (IS_DETECTING() || conf->pwm_mode == PWM_MODE_BIPOLAR) {
+		if (IS_DETECTING() || conf->pwm_mode == PWM_MODE_BIPOLAR || IS_SINE_DRIVE()) {
 			switching_frequency_now = conf->m_bldc_f_sw_max;
 		} else {
 			switching_frequency_now = (float)conf->m_bldc_f_sw_min * (1.0 - fabsf(dutyCycle)) +
@@ -1117,7 +1146,7 @@ static void set_duty_cycle_hw(float dutyCycle) {
 	set_next_timer_settings(&timer_tmp);
 }
 
-static void run_pid_control_speed(void) {
+static void run_pid_control_speed(float dt) {
 	static float i_term = 0;
 	static float prev_error = 0;
 	float p_term;
@@ -1148,8 +1177,8 @@ static void run_pid_control_speed(void) {
 #if BLDC_SPEED_CONTROL_CURRENT
 	// Compute parameters
 	p_term = error * conf->s_pid_kp * (1.0 / 20.0);
-	i_term += error * (conf->s_pid_ki * MCPWM_PID_TIME_K) * (1.0 / 20.0);
-	d_term = (error - prev_error) * (conf->s_pid_kd / MCPWM_PID_TIME_K) * (1.0 / 20.0);
+	i_term += error * (conf->s_pid_ki * dt) * (1.0 / 20.0);
+	d_term = (error - prev_error) * (conf->s_pid_kd / dt) * (1.0 / 20.0);
 
 	// I-term wind-up protection
 	utils_truncate_number(&i_term, -1.0, 1.0);
@@ -1159,7 +1188,7 @@ static void run_pid_control_speed(void) {
 
 	// Some d_term filtering
 	static float d_filtered = 0.0;
-	UTILS_LP_FAST(d_filtered, d_term, 0.1);
+	UTILS_LP_FAST(d_filtered, d_term, fminf(0.1 * dt / MCPWM_PID_TIME_K, 1.0));
 	d_term = d_filtered;
 
 	// Calculate output
@@ -1188,8 +1217,8 @@ static void run_pid_control_speed(void) {
 
 	// Compute parameters
 	p_term = error * conf->s_pid_kp * scale;
-	i_term += error * (conf->s_pid_ki * MCPWM_PID_TIME_K) * scale;
-	d_term = (error - prev_error) * (conf->s_pid_kd / MCPWM_PID_TIME_K) * scale;
+	i_term += error * (conf->s_pid_ki * dt) * scale;
+	d_term = (error - prev_error) * (conf->s_pid_kd / dt) * scale;
 
 	// I-term wind-up protection
 	utils_truncate_number(&i_term, -1.0, 1.0);
@@ -1252,68 +1281,6 @@ static void run_pid_control_pos(float dt) {
 	current_set = output * conf->lo_current_max;
 }
 
-static THD_FUNCTION(rpm_thread, arg) {
-	(void)arg;
-
-	chRegSetThreadName("rpm timer");
-
-	for (;;) {
-		if (rpm_thd_stop) {
-			rpm_thd_stop = false;
-			return;
-		}
-
-		if (rpm_dep.comms != 0) {
-			utils_sys_lock_cnt();
-			const float comms = (float)rpm_dep.comms;
-			const float time_at_comm = (float)rpm_dep.time_at_comm;
-			rpm_dep.comms = 0;
-			rpm_dep.time_at_comm = 0;
-			utils_sys_unlock_cnt();
-
-			rpm_now = (comms * MCPWM_RPM_TIMER_FREQ * 60.0) / (time_at_comm * 6.0);
-		} else {
-			// In case we have slowed down
-			float rpm_tmp = (MCPWM_RPM_TIMER_FREQ * 60.0) / ((float) TIM2 ->CNT * 6.0);
-
-			if (fabsf(rpm_tmp) < fabsf(rpm_now)) {
-				rpm_now = rpm_tmp;
-			}
-		}
-
-		// Some low-pass filtering
-		static float rpm_filtered = 0.0;
-		UTILS_LP_FAST(rpm_filtered, rpm_now, 0.1);
-		rpm_now = rpm_filtered;
-		const float rpm_abs = fabsf(rpm_now);
-
-		// Update the cycle integrator limit
-		rpm_dep.cycle_int_limit = conf->sl_cycle_int_limit;
-		rpm_dep.cycle_int_limit_running = rpm_dep.cycle_int_limit + (float)ADC_Value[ADC_IND_VIN_SENS] *
-				conf->sl_bemf_coupling_k / (rpm_abs > conf->sl_min_erpm ? rpm_abs : conf->sl_min_erpm);
-		rpm_dep.cycle_int_limit_running = utils_map(rpm_abs, 0,
-				conf->sl_cycle_int_rpm_br, rpm_dep.cycle_int_limit_running,
-				rpm_dep.cycle_int_limit_running * conf->sl_phase_advance_at_br);
-		rpm_dep.cycle_int_limit_max = rpm_dep.cycle_int_limit + (float)ADC_Value[ADC_IND_VIN_SENS] *
-				conf->sl_bemf_coupling_k / conf->sl_min_erpm_cycle_int_limit;
-
-		if (rpm_dep.cycle_int_limit_running < 1.0) {
-			rpm_dep.cycle_int_limit_running = 1.0;
-		}
-
-		if (rpm_dep.cycle_int_limit_running > rpm_dep.cycle_int_limit_max) {
-			rpm_dep.cycle_int_limit_running = rpm_dep.cycle_int_limit_max;
-		}
-
-		rpm_dep.comm_time_sum = conf->m_bldc_f_sw_max / ((rpm_abs / 60.0) * 6.0);
-		rpm_dep.comm_time_sum_min_rpm = conf->m_bldc_f_sw_max / ((conf->sl_min_erpm / 60.0) * 6.0);
-
-		run_pid_control_speed();
-
-		chThdSleepMilliseconds(1);
-	}
-}
-
 static THD_FUNCTION(timer_thread, arg) {
 	(void)arg;
 
@@ -1404,22 +1371,23 @@ static THD_FUNCTION(timer_thread, arg) {
 			tachometer_for_direction = 0;
 		}
 
-		// Fill KV filter vector at 100Hz
+		// Fill KV filter at 100Hz
 		static int cnt_tmp = 0;
 		cnt_tmp++;
 		if (cnt_tmp >= 10) {
 			cnt_tmp = 0;
 			if (state == MC_STATE_RUNNING) {
-				filter_add_sample((float*)kv_fir_samples, mcpwm_get_kv(),
-						KV_FIR_TAPS_BITS, (uint32_t*)&kv_fir_index);
+				filter_ma_add_sample(&kv_ma, mcpwm_get_kv());
 			} else if (state == MC_STATE_OFF) {
 				if (dutycycle_now >= conf->l_min_duty) {
-					filter_add_sample((float*)kv_fir_samples, mcpwm_get_kv(),
-							KV_FIR_TAPS_BITS, (uint32_t*)&kv_fir_index);
+					filter_ma_add_sample(&kv_ma, mcpwm_get_kv());
 				}
 			}
 		}
 
+		// RPM and speed control while there are no commutations
+		update_rpm_idle();
+
 		chThdSleepMilliseconds(1);
 	}
 }
@@ -1491,7 +1459,7 @@ void mcpwm_adc_inj_int_handler(void) {
 #endif
 
 #if CURR1_DOUBLE_SAMPLE || CURR2_DOUBLE_SAMPLE
-	if (conf->pwm_mode != PWM_MODE_BIPOLAR && conf->motor_type == MOTOR_TYPE_BLDC) {
+	if (conf->pwm_mode != PWM_MODE_BIPOLAR && conf->motor_type == MOTOR_TYPE_BLDC && !IS_SINE_DRIVE()) {
 		if (direction) {
 			if (CURR1_DOUBLE_SAMPLE && comm_step == 3) {
 				curr0 = (curr0 + curr0_2) / 2.0;
@@ -1556,6 +1524,21 @@ void mcpwm_adc_inj_int_handler(void) {
 			float c1 = (float)ADC_curr_norm_value[1];
 			float c2 = (float)ADC_curr_norm_value[2];
 			curr_tot_sample = sqrtf((c0*c0 + c1*c1 + c2*c2) / 1.5);
+		} else if (IS_SINE_DRIVE()) {
+			// Current along the applied voltage vector, scaled so that it matches
+			// the current of the two conducting phases in six-step mode.
+			const float ia = (float)ADC_curr_norm_value[0];
+#ifdef HW_HAS_3_SHUNTS
+			const float ib = (float)ADC_curr_norm_value[1];
+			const float ic = (float)ADC_curr_norm_value[2];
+#else
+			const float ib = (float)ADC_curr_norm_value[2];
+			const float ic = (float)ADC_curr_norm_value[1];
+#endif
+			const float i_beta = ONE_BY_SQRT3 * (ib - ic);
+			float s, c;
+			utils_fast_sincos_better(sine_angle, &s, &c);
+			curr_tot_sample = SQRT3_BY_2 * (ia * c + i_beta * s);
 		} else {
 #ifdef HW_HAS_3_SHUNTS
 			if (direction) {
@@ -1705,6 +1688,7 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 	(void)flags;
 
 	TIM12->CNT = 0;
+	const uint32_t prof_start = ISR_PROF_NOW();
 
 	// Set the next timer settings if an update is far enough away
 	update_timer_attempt();
@@ -1773,7 +1757,8 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 						// produce any torque because of misalignment at start, two
 						// commutations ahead should produce full torque.
 						commutate(2);
-					} else if (conf->comm_mode == COMM_MODE_DELAY) {
+					} else if (conf->comm_mode == COMM_MODE_DELAY ||
+							conf->comm_mode == COMM_MODE_ZC_INTERPOLATE) {
 						commutate(1);
 					}
 
@@ -1814,6 +1799,11 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 					break;
 				}
 
+				// Sample for zero crossing interpolation, before the noise limit below
+				const int v_diff_zc = v_diff;
+				const uint32_t zc_time_now = TIM2->CNT;
+				const int zc_comm_step = comm_step;
+
 				// Collect hall sensor samples in the first half of the commutation cycle. This is
 				// because positive timing is much better than negative timing in case they are
 				// mis-aligned.
@@ -1856,7 +1846,11 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 						cycle_integrator = 0.0;
 						cycle_sum = 0.0;
 					}
-				} else if (conf->comm_mode == COMM_MODE_DELAY) {
+				} else if (conf->comm_mode == COMM_MODE_ZC_INTERPOLATE && v_diff > 0 &&
+						state == MC_STATE_RUNNING && zc_schedule_commutation(v_diff_zc, zc_time_now)) {
+					// The commutation for this step is scheduled on the RPM timer
+				} else if (conf->comm_mode == COMM_MODE_DELAY ||
+						conf->comm_mode == COMM_MODE_ZC_INTERPOLATE) {
 					if (v_diff > 0) {
 						cycle_sum += conf->m_bldc_f_sw_max / switching_frequency_now;
 
@@ -1874,6 +1868,13 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 						cycle_sum = 0.0;
 					}
 				}
+
+				// Only keep the sample when it belongs to the step that follows
+				if (comm_step == zc_comm_step) {
+					zc_sample_v = v_diff_zc;
+					zc_sample_time = zc_time_now;
+					zc_sample_valid = true;
+				}
 			} else {
 				cycle_integrator = 0.0;
 			}
@@ -1885,7 +1886,16 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 			if (comm_step != hall_phase) {
 				comm_step = hall_phase;
 
-				update_rpm_tacho();
+				// Captured edges tell how long ago the hall transition was
+				uint32_t edge_ticks = 0;
+				if (encoder_hall_capture_active()) {
+					const float age = encoder_hall_edge_age();
+					if (age > 0.0) {
+						edge_ticks = (uint32_t)(age * MCPWM_RPM_TIMER_FREQ);
+					}
+				}
+
+				update_rpm_tacho(edge_ticks);
 
 				if (state == MC_STATE_RUNNING) {
 					set_next_comm_step(comm_step);
@@ -1895,6 +1905,10 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 				set_next_comm_step(comm_step);
 				commutate(0);
 			}
+
+			if (state == MC_STATE_RUNNING && IS_SINE_DRIVE()) {
+				update_sine_drive();
+			}
 		}
 	} else {
 		float amp = 0.0;
@@ -1915,6 +1929,14 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 		}
 	}
 
+	// Run the speed controller when the commutation path has a new speed, but
+	// not faster than MCPWM_SPEED_PID_MIN_DT. Not from update_rpm_tacho, as
+	// the speed controller itself can end up commutating.
+	if (speed_pid_ticks >= (int32_t)(MCPWM_SPEED_PID_MIN_DT * MCPWM_RPM_TIMER_FREQ)) {
+		run_pid_control_speed((float)speed_pid_ticks / MCPWM_RPM_TIMER_FREQ);
+		speed_pid_ticks = 0;
+	}
+
 	const float current_nofilter = mcpwm_get_tot_current();
 	const float current_in_nofilter = current_nofilter * fabsf(dutycycle_now);
 
@@ -2062,12 +2084,15 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 		set_duty_cycle_ll(dutycycle_now);
 	}
 
+	const uint32_t prof_sec = ISR_PROF_NOW();
 	mc_interface_mc_timer_isr();
+	ISR_PROF_ADD(ISR_PROF_BLDC_MCIF, prof_sec);
 
 	if (encoder_is_configured()) {
 		run_pid_control_pos(1.0 / switching_frequency_now);
 	}
 
+	ISR_PROF_ADD(ISR_PROF_BLDC_TOTAL, prof_start);
 	last_adc_isr_duration = (float)TIM12->CNT / 10000000.0;
 }
 
@@ -2145,6 +2170,9 @@ float mcpwm_read_reset_avg_cycle_integrator(void) {
  * COMM_MODE_INTEGRATE: More robust, but requires many parameters.
  * COMM_MODE_DELAY: Like most hobby ESCs. Requires less parameters,
  * but has worse startup and is less robust.
+ * COMM_MODE_ZC_INTERPOLATE: Like COMM_MODE_DELAY, but the zero crossing is
+ * interpolated between samples and the commutation is timed with the RPM
+ * timer instead of on a sample. Less jitter at high speed.
  *
  */
 void mcpwm_set_comm_mode(mc_comm_mode mode) {
@@ -2164,7 +2192,17 @@ float mcpwm_get_last_inj_adc_isr_duration(void) {
 }
 
 mc_rpm_dep_struct mcpwm_get_rpm_dep(void) {
-	return rpm_dep;
+	mc_rpm_dep_struct res;
+	uint32_t seq;
+
+	// The commutation path may update rpm_dep in the middle of the copy, so
+	// retry until a consistent snapshot is read.
+	do {
+		seq = rpm_seq;
+		res = rpm_dep;
+	} while ((seq & 1) || seq != rpm_seq);
+
+	return res;
 }
 
 bool mcpwm_is_dccal_done(void) {
@@ -2175,6 +2213,21 @@ void mcpwm_switch_comm_mode(mc_comm_mode next) {
 	comm_mode_next = next;
 }
 
+/**
+ * RPM timer compare interrupt handler. Runs a commutation scheduled by
+ * zero crossing interpolation.
+ */
+void mcpwm_comm_int_handler(void) {
+	TIM2->DIER &= ~TIM_DIER_CC1IE;
+
+	if (zc_comm_pending && state == MC_STATE_RUNNING && sensorless_now &&
+			conf->comm_mode == COMM_MODE_ZC_INTERPOLATE) {
+		commutate(1);
+	}
+
+	zc_comm_pending = false;
+}
+
 /**
  * Reset the hall sensor detection table
  */
@@ -2246,6 +2299,10 @@ int mcpwm_read_hall_phase(void) {
 }
 
 static int read_hall(void) {
+	if (encoder_hall_capture_active()) {
+		return encoder_hall_read();
+	}
+
 	return READ_HALL1() | (READ_HALL2() << 1) | (READ_HALL3() << 2);
 }
 
@@ -2401,6 +2458,21 @@ static void update_adc_sample_pos(mc_timer_struct *timer_tmp) {
 					}
 					break;
 				}
+			} else if (IS_SINE_DRIVE()) {
+				// Voltage samples
+				val_sample = duty / 2;
+
+				// All low sides are on after the largest compare value, which
+				// is at most duty
+				curr1_sample = duty + (top - duty) / 2;
+				if (curr1_sample > (top - 70)) {
+					curr1_sample = top - 70;
+				}
+
+				curr2_sample = curr1_sample;
+#ifdef HW_HAS_3_SHUNTS
+				curr3_sample = curr1_sample;
+#endif
 			} else {
 				// Voltage samples
 				val_sample = duty / 2;
@@ -2498,7 +2570,15 @@ static void update_adc_sample_pos(mc_timer_struct *timer_tmp) {
 #endif
 }
 
-static void update_rpm_tacho(void) {
+/**
+ * Update the tachometers and the RPM after a commutation.
+ *
+ * @param edge_ticks
+ * RPM timer ticks since the event that caused the commutation, when that is
+ * known better than the interrupt rate, as with captured hall edges. The RPM
+ * timer continues from there instead of from zero.
+ */
+static void update_rpm_tacho(uint32_t edge_ticks) {
 	int step = comm_step - 1;
 	static int last_step = 0;
 	int tacho_diff = (step - last_step) % 6;
@@ -2511,9 +2591,21 @@ static void update_rpm_tacho(void) {
 	}
 
 	if (tacho_diff != 0) {
-		rpm_dep.comms += tacho_diff;
-		rpm_dep.time_at_comm += TIM2->CNT;
-		TIM2->CNT = 0;
+		uint32_t ticks = TIM2->CNT;
+		if (edge_ticks > ticks) {
+			edge_ticks = ticks;
+		}
+		TIM2->CNT = edge_ticks;
+		ticks -= edge_ticks;
+
+		if (ticks > 0) {
+			rpm_dep.comms = tacho_diff;
+			rpm_dep.time_at_comm = ticks;
+			sine_sector_ticks = tacho_diff == 1 ? ticks : 0;
+			update_rpm(((float)tacho_diff * MCPWM_RPM_TIMER_FREQ * 60.0) / ((float)ticks * 6.0),
+					(float)ticks / MCPWM_RPM_TIMER_FREQ);
+			speed_pid_ticks += ticks;
+		}
 	}
 
 	// Tachometers
@@ -2527,6 +2619,132 @@ static void update_rpm_tacho(void) {
 	}
 }
 
+/**
+ * Filter a new RPM sample and update the RPM dependent parameters.
+ * Called from the commutation path and from update_rpm_idle.
+ *
+ * @param rpm_sample
+ * The unfiltered RPM.
+ *
+ * @param dt
+ * Time since the previous sample. Keeps the filter time constant
+ * independent of the commutation rate.
+ */
+static void update_rpm(float rpm_sample, float dt) {
+	float rpm = rpm_now;
+	UTILS_LP_FAST(rpm, rpm_sample, fminf(dt / MCPWM_RPM_FILTER_TAU, 1.0));
+	const float rpm_abs = fabsf(rpm);
+
+	rpm_seq++;
+
+	rpm_now = rpm;
+
+	// Update the cycle integrator limit
+	rpm_dep.cycle_int_limit = conf->sl_cycle_int_limit;
+	rpm_dep.cycle_int_limit_running = rpm_dep.cycle_int_limit + (float)ADC_Value[ADC_IND_VIN_SENS] *
+			conf->sl_bemf_coupling_k / (rpm_abs > conf->sl_min_erpm ? rpm_abs : conf->sl_min_erpm);
+	rpm_dep.cycle_int_limit_running = utils_map(rpm_abs, 0,
+			conf->sl_cycle_int_rpm_br, rpm_dep.cycle_int_limit_running,
+			rpm_dep.cycle_int_limit_running * conf->sl_phase_advance_at_br);
+	rpm_dep.cycle_int_limit_max = rpm_dep.cycle_int_limit + (float)ADC_Value[ADC_IND_VIN_SENS] *
+			conf->sl_bemf_coupling_k / conf->sl_min_erpm_cycle_int_limit;
+
+	if (rpm_dep.cycle_int_limit_running < 1.0) {
+		rpm_dep.cycle_int_limit_running = 1.0;
+	}
+
+	if (rpm_dep.cycle_int_limit_running > rpm_dep.cycle_int_limit_max) {
+		rpm_dep.cycle_int_limit_running = rpm_dep.cycle_int_limit_max;
+	}
+
+	rpm_dep.comm_time_sum = conf->m_bldc_f_sw_max / ((rpm_abs / 60.0) * 6.0);
+	rpm_dep.comm_time_sum_min_rpm = conf->m_bldc_f_sw_max / ((conf->sl_min_erpm / 60.0) * 6.0);
+
+	rpm_seq++;
+}
+
+/**
+ * Called from the timer thread. When there has been no commutation for
+ * MCPWM_RPM_IDLE_TIME, let the RPM follow the time since the last
+ * commutation down and run the speed controller from here.
+ */
+static void update_rpm_idle(void) {
+	utils_sys_lock_cnt();
+
+	const uint32_t ticks = TIM2->CNT;
+
+	if (ticks >= (uint32_t)(MCPWM_RPM_IDLE_TIME * MCPWM_RPM_TIMER_FREQ)) {
+		// In case we have slowed down
+		float rpm_sample = rpm_now;
+		const float rpm_tmp = (MCPWM_RPM_TIMER_FREQ * 60.0) / ((float)ticks * 6.0);
+
+		if (rpm_tmp < fabsf(rpm_now)) {
+			rpm_sample = SIGN(rpm_now) * rpm_tmp;
+		}
+
+		update_rpm(rpm_sample, MCPWM_RPM_IDLE_TIME);
+
+		const int32_t pid_ticks = speed_pid_ticks + (int32_t)ticks;
+		if (pid_ticks >= (int32_t)(MCPWM_RPM_IDLE_TIME * MCPWM_RPM_TIMER_FREQ)) {
+			run_pid_control_speed((float)pid_ticks / MCPWM_RPM_TIMER_FREQ);
+
+			// The next commutation adds all ticks since the last one
+			speed_pid_ticks = -(int32_t)ticks;
+		}
+	}
+
+	utils_sys_unlock_cnt();
+}
+
+/**
+ * Hall-interpolated sine drive, called from the ADC interrupt. The six-step
+ * voltage vector of the current commutation step is the average of the ideal
+ * vector over the hall sector, so the vector is swept from 30 degrees before
+ * to 30 degrees after it based on how long the previous sector took. Without
+ * a previous sector, or when it took longer than MCPWM_SINE_MAX_SECTOR_TIME,
+ * the six-step vector itself is used.
+ *
+ * The line-line amplitude is the duty cycle. The phase voltages are shifted
+ * down until the lowest one is zero, so that the largest compare value never
+ * exceeds the six-step duty cycle and the current sampling window stays the
+ * same.
+ */
+static void update_sine_drive(void) {
+	// Forward steps 1 to 6 apply vectors at 90, 30, -30, -90, -150 and 150 degrees
+	float angle = (float)(90 - 60 * (comm_step - 1)) * (M_PI / 180.0);
+
+	const uint32_t sector_ticks = sine_sector_ticks;
+	if (sector_ticks > 0 && sector_ticks < (uint32_t)(MCPWM_SINE_MAX_SECTOR_TIME * MCPWM_RPM_TIMER_FREQ)) {
+		float frac = (float)TIM2->CNT / (float)sector_ticks;
+		utils_truncate_number(&frac, 0.0, 1.0);
+		angle += (M_PI / 6.0) - (M_PI / 3.0) * frac;
+	}
+
+	// Reverse swaps phase 2 and 3, which mirrors the vectors
+	if (!direction) {
+		angle = -angle;
+	}
+
+	utils_norm_angle_rad(&angle);
+	sine_angle = angle;
+
+	float s, c;
+	utils_fast_sincos_better(angle, &s, &c);
+
+	const float amp = fabsf(dutycycle_now) * ONE_BY_SQRT3;
+	const float va = amp * c;
+	const float vb = amp * (-0.5 * c + SQRT3_BY_2 * s);
+	const float vc = amp * (-0.5 * c - SQRT3_BY_2 * s);
+	const float v_min = fminf(va, fminf(vb, vc));
+
+	const float top = (float)TIM1->ARR;
+	TIM1->CR1 |= TIM_CR1_UDIS;
+	TIM1->CCR1 = (uint32_t)((va - v_min) * top);
+	TIM1->CCR2 = (uint32_t)((vb - v_min) * top);
+	TIM1->CCR3 = (uint32_t)((vc - v_min) * top);
+	TIM1->CR1 &= ~TIM_CR1_UDIS;
+}
+
 static void update_sensor_mode(void) {
 	if (conf->sensor_mode == SENSOR_MODE_SENSORLESS ||
 			(conf->sensor_mode == SENSOR_MODE_HYBRID &&
@@ -2537,7 +2755,78 @@ static void update_sensor_mode(void) {
 	}
 }
 
+/**
+ * Find the back-emf zero crossing of this step by linear interpolation
+ * between the last two samples and schedule the commutation half a step
+ * (minus phase advance) after it on the RPM timer compare.
+ *
+ * @param v_diff
+ * Back-emf sample, positive after the zero crossing.
+ *
+ * @param time_now
+ * RPM timer count for the sample.
+ *
+ * @return
+ * true if the commutation of this step is taken care of, false if the zero
+ * crossing of this or the previous step was not seen between two samples and
+ * the delay mode has to be used.
+ */
+static bool zc_schedule_commutation(int v_diff, uint32_t time_now) {
+	if (zc_time >= 0) {
+		return zc_comm_pending;
+	}
+
+	// The crossing has to lie between two samples of this step. When the
+	// first sample after the blanking is past it already, the sample time is
+	// only an upper bound, and timing from it makes the next step late. Leave
+	// this step and the next one to the delay mode then.
+	if (!zc_sample_valid || zc_sample_v > 0 || v_diff <= zc_sample_v) {
+		return false;
+	}
+
+	const float t_zc = (float)zc_sample_time + (float)(time_now - zc_sample_time) *
+			(float)(-zc_sample_v) / (float)(v_diff - zc_sample_v);
+	zc_time = (int32_t)t_zc;
+
+	if (zc_time_last < 0 || zc_step_ticks_last == 0) {
+		return false;
+	}
+
+	// Time between the last two zero crossings. Fall back to the delay mode
+	// on implausible steps, e.g. during fast transients.
+	const float zc_period = (float)zc_step_ticks_last - (float)zc_time_last + t_zc;
+	if (zc_period < 0.5 * (float)zc_step_ticks_last ||
+			zc_period > 2.0 * (float)zc_step_ticks_last) {
+		return false;
+	}
+
+	const float advance = utils_map(fabsf(rpm_now), 0, conf->sl_cycle_int_rpm_br,
+			1.0, conf->sl_phase_advance_at_br);
+	const uint32_t t_comm = (uint32_t)(t_zc + zc_period * 0.5 * advance);
+
+	if (t_comm <= (TIM2->CNT + MCPWM_ZC_MIN_COMM_TICKS)) {
+		commutate(1);
+		return true;
+	}
+
+	TIM2->CCR1 = t_comm;
+	TIM2->SR = ~TIM_SR_CC1IF;
+	zc_comm_pending = true;
+	TIM2->DIER |= TIM_DIER_CC1IE;
+
+	// The compare may have been missed while setting it up
+	if (TIM2->CNT >= t_comm) {
+		commutate(1);
+	}
+
+	return true;
+}
+
 static void commutate(int steps) {
+	// Cancel a commutation scheduled by zero crossing interpolation
+	TIM2->DIER &= ~TIM_DIER_CC1IE;
+	zc_comm_pending = false;
+
 	last_pwm_cycles_sum = pwm_cycles_sum;
 	last_pwm_cycles_sums[comm_step - 1] = pwm_cycles_sum;
 	pwm_cycles_sum = 0;
@@ -2552,7 +2841,14 @@ static void commutate(int steps) {
 			comm_step += 6;
 		}
 
-		update_rpm_tacho();
+		// The zero crossing of the last step can only be used to time the
+		// next one when exactly one step was taken.
+		zc_step_ticks_last = TIM2->CNT;
+		zc_time_last = steps == 1 ? zc_time : -1;
+		zc_time = -1;
+		zc_sample_valid = false;
+
+		update_rpm_tacho(0);
 
 		if (!(state == MC_STATE_RUNNING)) {
 			update_sensor_mode();
@@ -2601,9 +2897,12 @@ static void update_timer_attempt(void) {
 
 		// Set the new configuration
 		TIM1->ARR = timer_struct.top;
-		TIM1->CCR1 = timer_struct.duty;
-		TIM1->CCR2 = timer_struct.duty;
-		TIM1->CCR3 = timer_struct.duty;
+		if (!IS_SINE_DRIVE()) {
+			// The sine drive sets the compare values itself every cycle
+			TIM1->CCR1 = timer_struct.duty;
+			TIM1->CCR2 = timer_struct.duty;
+			TIM1->CCR3 = timer_struct.duty;
+		}
 		TIM8->CCR1 = timer_struct.val_sample;
 		TIM1->CCR4 = timer_struct.curr1_sample;
 		TIM8->CCR2 = timer_struct.curr2_sample;
@@ -2686,9 +2985,34 @@ static void set_next_comm_step(int next_step) {
 		case PWM_MODE_BIPOLAR:
 			negative_oc_mode = TIM_OCMode_PWM2;
 			break;
+
+		case PWM_MODE_SINE_HALL:
+			// Synchronous six-step while running without hall sensors
+			break;
 		}
 	}
 
+	if (IS_SINE_DRIVE()) {
+#ifdef HW_HAS_DRV8313
+		ENABLE_BR1();
+		ENABLE_BR2();
+		ENABLE_BR3();
+#endif
+		// All phases are modulated, see update_sine_drive
+		TIM_SelectOCxM(TIM1, TIM_Channel_1, TIM_OCMode_PWM1);
+		TIM_CCxCmd(TIM1, TIM_Channel_1, TIM_CCx_Enable);
+		TIM_CCxNCmd(TIM1, TIM_Channel_1, TIM_CCxN_Enable);
+
+		TIM_SelectOCxM(TIM1, TIM_Channel_2, TIM_OCMode_PWM1);
+		TIM_CCxCmd(TIM1, TIM_Channel_2, TIM_CCx_Enable);
+		TIM_CCxNCmd(TIM1, TIM_Channel_2, TIM_CCxN_Enable);
+
+		TIM_SelectOCxM(TIM1, TIM_Channel_3, TIM_OCMode_PWM1);
+		TIM_CCxCmd(TIM1, TIM_Channel_3, TIM_CCx_Enable);
+		TIM_CCxNCmd(TIM1, TIM_Channel_3, TIM_CCxN_Enable);
+		return;
+	}
+
 	if (next_step == 1) {
 		if (direction) {
 #ifdef HW_HAS_DRV8313
@@ -70,6 +70,7 @@ void mcpwm_switch_comm_mode(mc_comm_mode next);
 // Interrupt handlers
 void mcpwm_adc_inj_int_handler(void);
 void mcpwm_adc_int_handler(void *p, uint32_t flags);
+void mcpwm_comm_int_handler(void);
 
 // External variables
 extern volatile float mcpwm_detect_currents[];
@@ -81,10 +82,15 @@ extern volatile int mcpwm_vzero;
  * Fixed parameters
  */
 #define MCPWM_RPM_TIMER_FREQ			1000000.0	// Frequency of the RPM measurement timer
+#define MCPWM_ZC_MIN_COMM_TICKS			3			// Commutate right away when a scheduled commutation is closer than this (RPM timer ticks)
+#define MCPWM_SINE_MAX_SECTOR_TIME		0.1			// Longest hall sector (s) that the sine drive interpolates over
 #define MCPWM_CMD_STOP_TIME				0		// Ignore commands for this duration in msec after a stop has been sent
 #define MCPWM_DETECT_STOP_TIME			500		// Ignore commands for this duration in msec after a detect command
 
 // Speed PID parameters
-#define MCPWM_PID_TIME_K				0.001	// Pid controller sample time in seconds
+#define MCPWM_PID_TIME_K				0.001	// Reference sample time for the speed PID derivative filter in seconds
+#define MCPWM_SPEED_PID_MIN_DT			0.00025	// Run the speed PID at most this often from the commutation path
+#define MCPWM_RPM_FILTER_TAU			0.01	// Time constant of the RPM filter in seconds
+#define MCPWM_RPM_IDLE_TIME				0.001	// Update RPM and speed PID from the timer thread when there is no commutation for this long
 
 #endif /* MC_PWM_H_ */
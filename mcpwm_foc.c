@@ -33,6 +33,7 @@
 #include "encoder.h"
 #include "commands.h"
 #include "timeout.h"
+#include "isr_prof.h"
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
@@ -62,17 +63,115 @@ typedef struct {
 	float vq;
 	float vd_int;
 	float vq_int;
+	float v_inj_d; // Injected d axis voltage, added after the current controller
 	uint32_t svm_sector;
 } motor_state_t;
 
+// High frequency injection state. Only used from the interrupt.
+typedef struct {
+	float phase;
+	float speed;
+	float i_alpha_last;
+	float i_beta_last;
+	float di_d_pos;
+	float di_q_pos;
+	float polarity_acc;
+	float polarity_mag; // Summed d axis response magnitude of the bias windows
+	float id_bias; // d axis current during polarity detection
+	int cnt;
+	int start_cnt;
+	int polarity_votes; // Consecutive clear bias window results, signed
+	int polarity_retries;
+	bool ready;
+	bool active;
+} hfi_state_t;
+
 typedef struct {
 	int sample_num;
 	float avg_current_tot;
+	float avg_current_dir[3]; // Per pulse direction, for Ld and Lq
 	float avg_voltage_tot;
 	bool measure_inductance_now;
 	float measure_inductance_duty;
 } mc_sample_t;
 
+#define MTPA_LUT_SIZE		32
+// Smallest polarity_acc relative to polarity_mag that counts as a clear
+// polarity result, and the number of clear results in a row with the same
+// sign that decide it.
+#define HFI_POLARITY_MIN_RATIO	0.01
+#define HFI_POLARITY_VOTES		2
+
+// Quantities derived from the bus voltage. Updated once at the start of every
+// control cycle, see MCPWM_FOC_ISR_CACHE, and only used from the interrupt.
+typedef struct {
+	float v_bus_inv; // 1 / v_bus
+	float mod_scale; // 1 / ((2 / 3) * v_bus), volts to modulation
+	float v_scale; // (2 / 3) * v_bus, modulation to volts
+	float v_max; // Largest voltage vector at full duty cycle
+} isr_cache_t;
+
+// Constants derived from the configuration only. Rebuilt from thread context
+// whenever the configuration changes and published by swapping m_const, so the
+// interrupt always sees one complete block.
+typedef struct {
+	uint32_t top; // Timer top for the switching frequency in use
+	float dt; // Control loop period
+	int est_div; // Estimators run every est_div control loop cycles
+	float dt_est; // Estimator period
+	float mod_comp_fact; // Deadtime compensation
+	float l_max_duty;
+	float current_kp;
+	float current_ki;
+	float duty_dowmramp_kp;
+	float duty_dowmramp_ki;
+	float pll_kp;
+	float pll_ki;
+	float obs_l; // (3 / 2) * Lq
+	bool obs_salient;
+	float obs_lambda;
+	float obs_lambda_id_fact; // (3 / 2) * (Ld - Lq), active flux change per d axis current
+	float obs_r; // (3 / 2) * R
+	float obs_lambda_2;
+	float obs_sat_comp; // foc_sat_comp / l_current_max
+	bool obs_temp_comp;
+	float obs_temp_comp_base_temp;
+	mc_foc_observer_type obs_type;
+	int obs_iterations;
+	float obs_iter_min_speed; // rad/s
+	float fw_current_max;
+	float fw_duty_start; // Absolute duty cycle
+	float fw_step; // Field weakening current change per cycle
+	bool mtpa_enable;
+	float mtpa_idx_scale; // Current to MTPA table index
+	float mtpa_lut[MTPA_LUT_SIZE + 1]; // D axis current for current magnitude
+	bool hfi_ok; // HFI possible, needs Lq > Ld
+	float hfi_voltage;
+	float hfi_err_scale; // d axis current response to angle error
+	float hfi_kp;
+	float hfi_ki;
+	int hfi_converge_cycles;
+	int hfi_polarity_cycles;
+	float hfi_polarity_current;
+	bool online_est; // Use m_est_r and m_est_lambda in the observer
+	bool dec_cross; // Cross coupling feed-forward in the current controller
+	bool dec_bemf; // Back EMF feed-forward in the current controller
+	float dec_ld; // (3 / 2) * Ld
+	float dec_lq; // (3 / 2) * Lq
+	bool pll_adaptive;
+	float pll_bw_min;
+	float pll_bw_max;
+	float pll_bw_speed_fact; // 1 / speed in rad/s at which pll_bw_max is reached
+	bool pll_obs_speed; // Speed from the observer phase derivative, sensorless and HFI only
+	mc_foc_overmod_mode overmod_mode;
+	float overmod_max; // Largest modulation vector at the maximum duty cycle
+	float overmod_hold_fact; // Six step hold fraction per modulation above the hexagon vertex
+	uint32_t sample_win; // Half of the minimum low side on time around the current sample in timer ticks
+	mc_foc_dpwm_mode dpwm_mode;
+	float dpwm_mod_on_sq; // Squared modulation at which DPWM starts
+	float dpwm_mod_off_sq; // Squared modulation at which DPWM stops
+} foc_const_t;
+
 // Private variables
 static volatile mc_configuration *m_conf;
 static volatile mc_state m_state;
@@ -109,16 +208,134 @@ static volatile float last_inj_adc_isr_duration;
 static volatile float m_pos_pid_now;
 static volatile bool m_init_done;
 static volatile float m_gamma_now;
+static volatile float m_i_fw_set;
+static volatile float m_est_r;
+static volatile float m_est_lambda;
+static volatile float m_est_temp;
+static volatile uint32_t m_est_samples;
+static volatile uint32_t m_conf_seq; // Configuration change counter, restarts the parameter estimation
+static volatile float m_obs_flux_err;
+static volatile float m_obs_speed;
+static volatile float m_pll_conf;
+static volatile float m_pll_bw;
+static volatile bool m_dpwm_on;
+static volatile float m_f_sw_now;
+static isr_cache_t m_cache;
+static hfi_state_t m_hfi;
+__attribute__((section(".ram4"))) static foc_const_t m_const_buf[2];
+static const foc_const_t * volatile m_const;
+static volatile uint32_t m_const_seq; // Change counter, incremented after each publish
+static mutex_t m_const_mtx;
 
 #ifdef HW_HAS_3_SHUNTS
 static volatile int m_curr2_sum;
 static volatile int m_curr2_offset;
 #endif
 
+#if MCPWM_FOC_CURRENT_LOOP_Q31
+// Fixed point helpers for the current loop. The saturating DSP instructions are
+// used on the Cortex-M4 and plain C elsewhere.
+#define Q31_CURRENT_FS				(4096.0 * FAC_CURRENT) // Current that corresponds to 1.0
+#define Q31_GAIN_BITS				8 // Integer bits of the controller gains
+#define Q31_GAIN_SCALE				(1.0 / (float)(1 << Q31_GAIN_BITS))
+#define Q31_VBUS_TOL				(1.0 / 256.0) // Relative bus voltage change that rebuilds the gains
+#define Q31_SQRT3_BY_2				1859775393 // SQRT3_BY_2 in Q31
+#define Q31_OVERMOD_EDGE			2147268900 // 0.9999 in Q31
+
+// State of the fixed point current loop. The gains are kept in Q31 and only
+// rebuilt when the constant block, the loop period or the bus voltage scale
+// changes.
+typedef struct {
+	uint32_t const_seq; // m_const_seq the gains were built for
+	float dt; // Loop period the gains were built for
+	float mod_scale; // Bus voltage scale the gains were built for
+	int32_t kp;
+	int32_t ki;
+	float dec_ld; // Decoupling gains per rad/s, scaled like kp
+	float dec_lq;
+	int32_t mod_comp_alpha; // Deadtime compensation per sign step
+	int32_t mod_comp_beta;
+	int32_t mod_max_overmod;
+	int32_t mod_d_int; // Integrators in modulation units
+	int32_t mod_q_int;
+	float vd_int; // Integrators last written back to the motor state
+	float vq_int;
+} q31_loop_t;
+
+static q31_loop_t m_q31;
+
+static inline int32_t q31_sat(int64_t x) {
+	if (x > INT32_MAX) {
+		return INT32_MAX;
+	} else if (x < INT32_MIN) {
+		return INT32_MIN;
+	}
+	return (int32_t)x;
+}
+
+#ifdef __ARM_FEATURE_DSP
+#define Q31_ADD(a, b)				((int32_t)__QADD((a), (b)))
+#define Q31_SUB(a, b)				((int32_t)__QSUB((a), (b)))
+#else
+#define Q31_ADD(a, b)				q31_sat((int64_t)(a) + (int64_t)(b))
+#define Q31_SUB(a, b)				q31_sat((int64_t)(a) - (int64_t)(b))
+#endif
+#define Q31_MUL(a, b)				q31_sat(((int64_t)(a) * (int64_t)(b)) >> 31)
+
+static inline int32_t q31_mul_gain(int32_t x, int32_t gain) {
+	return q31_sat(((int64_t)x * (int64_t)gain) >> (31 - Q31_GAIN_BITS));
+}
+
+static inline int32_t q31_truncate_abs(int32_t x, int32_t max) {
+	if (x > max) {
+		return max;
+	} else if (x < -max) {
+		return -max;
+	}
+	return x;
+}
+
+static inline int32_t float_to_q31(float x) {
+	x *= 2147483648.0;
+	if (x >= 2147483648.0) {
+		return INT32_MAX;
+	} else if (x <= -2147483648.0) {
+		return INT32_MIN;
+	}
+	return (int32_t)x;
+}
+
+static inline float q31_to_float(int32_t x) {
+	return (float)x * (1.0 / 2147483648.0);
+}
+#endif
+
 // Private functions
+static void update_const(void);
+static void update_const_locked(void);
+static float control_period(float f_sw);
+static void set_switching_frequency(float f_sw, bool write_now);
+static void sched_switching_frequency(void);
+static inline float mtpa_id(const foc_const_t *c, float i_abs);
+static inline void isr_cache_update(float v_bus);
+static inline const isr_cache_t *isr_cache(void);
 static void do_dc_cal(void);
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 		float dt, volatile float *x1, volatile float *x2, volatile float *phase);
+static void run_observer(bool est_now, float dt);
+static bool hfi_update(const foc_const_t *c, float dt);
+static inline void decoupling_ff(const foc_const_t *c, float id, float iq,
+		float *vd_ff, float *vq_ff);
+#if MCPWM_FOC_CURRENT_LOOP_Q31
+static void overmodulate_q31(int32_t *alpha, int32_t *beta);
+#else
+static void overmodulate(const foc_const_t *c, float *alpha, float *beta);
+#endif
+static void sample_window_guard(const foc_const_t *c, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3);
+static bool dpwm_apply(const foc_const_t *c, float mod_sq, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3);
+static void run_param_est(float dt);
 static void pll_run(float phase, float dt, volatile float *phase_var,
 		volatile float *speed_var);
 static void control_current(volatile motor_state_t *state_m, float dt);
@@ -154,6 +371,24 @@ static volatile bool timer_thd_stop;
 		TIM1->CR1 &= ~TIM_CR1_UDIS;
 #endif
 
+#ifdef HW_HAS_3_SHUNTS
+#define TIMER_UPDATE_DUTY_TOP(duty1, duty2, duty3, top) \
+		TIM1->CR1 |= TIM_CR1_UDIS; \
+		TIM1->ARR = top; \
+		TIM1->CCR1 = duty1; \
+		TIM1->CCR2 = duty2; \
+		TIM1->CCR3 = duty3; \
+		TIM1->CR1 &= ~TIM_CR1_UDIS;
+#else
+#define TIMER_UPDATE_DUTY_TOP(duty1, duty2, duty3, top) \
+		TIM1->CR1 |= TIM_CR1_UDIS; \
+		TIM1->ARR = top; \
+		TIM1->CCR1 = duty1; \
+		TIM1->CCR2 = duty3; \
+		TIM1->CCR3 = duty2; \
+		TIM1->CR1 &= ~TIM_CR1_UDIS;
+#endif
+
 #define TIMER_UPDATE_SAMP(samp) \
 		TIM8->CCR1 = samp;
 
@@ -229,8 +464,29 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	last_inj_adc_isr_duration = 0;
 	m_pos_pid_now = 0.0;
 	m_gamma_now = 0.0;
+	m_i_fw_set = 0.0;
+	m_est_r = m_conf->foc_motor_r;
+	m_est_lambda = m_conf->foc_motor_flux_linkage;
+	m_est_temp = m_conf->foc_temp_comp_base_temp;
+	m_est_samples = 0;
+	m_conf_seq++;
+	m_obs_flux_err = 0.0;
+	m_obs_speed = 0.0;
+	m_pll_conf = 0.0;
+	m_pll_bw = 0.0;
+	m_dpwm_on = false;
+	m_f_sw_now = m_conf->foc_f_sw;
 	memset((void*)&m_motor_state, 0, sizeof(motor_state_t));
 	memset((void*)&m_samples, 0, sizeof(mc_sample_t));
+	memset(&m_hfi, 0, sizeof(hfi_state_t));
+#if MCPWM_FOC_CURRENT_LOOP_Q31
+	memset(&m_q31, 0, sizeof(q31_loop_t));
+#endif
+
+	m_const = 0;
+	m_const_seq = 0;
+	chMtxObjectInit(&m_const_mtx);
+	update_const_locked();
 
 #ifdef HW_HAS_3_SHUNTS
 	m_curr2_sum = 0;
@@ -480,12 +736,12 @@ bool mcpwm_foc_init_done(void) {
 
 void mcpwm_foc_set_configuration(volatile mc_configuration *configuration) {
 	m_conf = configuration;
+	m_conf_seq++;
 
 	m_control_mode = CONTROL_MODE_NONE;
 	m_state = MC_STATE_OFF;
 	stop_pwm_hw();
-	uint32_t top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_switching_frequency(m_conf->foc_f_sw, true);
 }
 
 mc_state mcpwm_foc_get_state(void) {
@@ -687,7 +943,7 @@ float mcpwm_foc_get_pid_pos_now(void) {
  * The switching frequency in Hz.
  */
 float mcpwm_foc_get_switching_frequency_now(void) {
-	return m_conf->foc_f_sw;
+	return m_f_sw_now;
 }
 
 /**
@@ -699,12 +955,12 @@ float mcpwm_foc_get_switching_frequency_now(void) {
 float mcpwm_foc_get_sampling_frequency_now(void) {
 #ifdef HW_HAS_PHASE_SHUNTS
 	if (m_conf->foc_sample_v0_v7) {
-		return m_conf->foc_f_sw;
+		return m_f_sw_now;
 	} else {
-		return m_conf->foc_f_sw / 2.0;
+		return m_f_sw_now / 2.0;
 	}
 #else
-	return m_conf->foc_f_sw / 2.0;
+	return m_f_sw_now / 2.0;
 #endif
 }
 
@@ -925,6 +1181,48 @@ float mcpwm_foc_get_vq(void) {
 	return m_motor_state.vq;
 }
 
+/**
+ * Get the online motor resistance estimate.
+ *
+ * @return
+ * The resistance in ohm, in the same unit as foc_motor_r.
+ */
+float mcpwm_foc_get_est_res(void) {
+	return m_est_r;
+}
+
+/**
+ * Get the online flux linkage estimate.
+ *
+ * @return
+ * The flux linkage in weber.
+ */
+float mcpwm_foc_get_est_flux_linkage(void) {
+	return m_est_lambda;
+}
+
+/**
+ * Get the winding temperature inferred from the resistance estimate, using
+ * foc_motor_r at foc_temp_comp_base_temp as reference.
+ *
+ * @return
+ * The winding temperature in degrees celsius.
+ */
+float mcpwm_foc_get_est_temp(void) {
+	return m_est_temp;
+}
+
+/**
+ * Get the number of samples the online estimates are based on since the last
+ * configuration change.
+ *
+ * @return
+ * The number of samples.
+ */
+uint32_t mcpwm_foc_get_est_samples(void) {
+	return m_est_samples;
+}
+
 /**
  * Measure encoder offset and direction.
  *
@@ -1224,7 +1522,42 @@ float mcpwm_foc_measure_resistance(float current, int samples) {
  * The average d and q axis inductance in microhenry.
  */
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr) {
+	return mcpwm_foc_measure_inductance_dq(duty, samples, curr, 0, 0);
+}
+
+/**
+ * Measure the motor inductance with short voltage pulses, and split it into
+ * the d and q axis inductance.
+ *
+ * The pulses are applied along the three phase axes. The inverse inductance
+ * seen along an axis at electrical angle a is
+ * (1 / Ld + 1 / Lq) / 2 + (1 / Ld - 1 / Lq) / 2 * cos(2 * (a - rotor angle)),
+ * so the mean and the second harmonic of the three currents give Ld and Lq
+ * for any rotor position. Ld <= Lq is assumed.
+ *
+ * @param duty
+ * The duty cycle to use in the pulses.
+ *
+ * @param samples
+ * The number of samples to average over.
+ *
+ * @param curr
+ * The current that was used for this measurement.
+ *
+ * @param ld
+ * The d axis inductance in microhenry. Can be null.
+ *
+ * @param lq
+ * The q axis inductance in microhenry. Can be null.
+ *
+ * @return
+ * The average d and q axis inductance in microhenry.
+ */
+float mcpwm_foc_measure_inductance_dq(float duty, int samples, float *curr, float *ld, float *lq) {
 	m_samples.avg_current_tot = 0.0;
+	m_samples.avg_current_dir[0] = 0.0;
+	m_samples.avg_current_dir[1] = 0.0;
+	m_samples.avg_current_dir[2] = 0.0;
 	m_samples.avg_voltage_tot = 0.0;
 	m_samples.sample_num = 0;
 	m_samples.measure_inductance_duty = duty;
@@ -1268,7 +1601,27 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr) {
 		*curr = avg_current;
 	}
 
-	return ((avg_voltage * t) / avg_current) * 1e6 * (2.0 /  3.0);
+	const float l_fact = avg_voltage * t * 1e6 * (2.0 / 3.0);
+
+	if (ld || lq) {
+		const float dir_samples = (float)m_samples.sample_num / 3.0;
+		const float i0 = m_samples.avg_current_dir[0] / dir_samples;
+		const float i1 = m_samples.avg_current_dir[1] / dir_samples;
+		const float i2 = m_samples.avg_current_dir[2] / dir_samples;
+
+		const float i_mean = (i0 + i1 + i2) / 3.0;
+		const float i_harm = (2.0 / 3.0) * sqrtf(SQ(i0 - 0.5 * (i1 + i2)) + SQ(SQRT3_BY_2 * (i1 - i2)));
+
+		if (ld) {
+			*ld = l_fact / (i_mean + i_harm);
+		}
+
+		if (lq) {
+			*lq = l_fact / (i_mean - i_harm);
+		}
+	}
+
+	return l_fact / avg_current;
 }
 
 /**
@@ -1278,12 +1631,15 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr) {
  * The measured resistance in ohm.
  *
  * @param ind
- * The measured inductance in microhenry.
+ * The measured inductance in microhenry, (Ld + Lq) / 2.
+ *
+ * @param ld_lq_diff
+ * The measured difference Lq - Ld in microhenry. Can be null.
  *
  * @return
  * True if the measurement succeeded, false otherwise.
  */
-bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
+bool mcpwm_foc_measure_res_ind(float *res, float *ind, float *ld_lq_diff) {
 	const float f_sw_old = m_conf->foc_f_sw;
 	const float kp_old = m_conf->foc_current_kp;
 	const float ki_old = m_conf->foc_current_ki;
@@ -1291,9 +1647,7 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	m_conf->foc_f_sw = 10000.0;
 	m_conf->foc_current_kp = 0.01;
 	m_conf->foc_current_ki = 10.0;
-
-	uint32_t top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_switching_frequency(m_conf->foc_f_sw, true);
 
 	float res_tmp = 0.0;
 	float i_last = 0.0;
@@ -1313,8 +1667,7 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	*res = mcpwm_foc_measure_resistance(i_last, 200);
 
 	m_conf->foc_f_sw = 3000.0;
-	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_switching_frequency(m_conf->foc_f_sw, true);
 
 	float duty_last = 0.0;
 	for (float i = 0.02;i < 0.5;i *= 1.5) {
@@ -1327,18 +1680,75 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 		}
 	}
 
-	*ind = mcpwm_foc_measure_inductance(duty_last, 200, 0);
+	float ld = 0.0;
+	float lq = 0.0;
+	mcpwm_foc_measure_inductance_dq(duty_last, 200, 0, &ld, &lq);
+	*ind = (ld + lq) / 2.0;
+	if (ld_lq_diff) {
+		*ld_lq_diff = lq - ld;
+	}
 
 	m_conf->foc_f_sw = f_sw_old;
 	m_conf->foc_current_kp = kp_old;
 	m_conf->foc_current_ki = ki_old;
-
-	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_switching_frequency(m_conf->foc_f_sw, true);
 
 	return true;
 }
 
+/**
+ * Calculate the current controller gains for a closed loop bandwidth. The PI
+ * zero cancels the pole of the motor, so that the open loop becomes an
+ * integrator that crosses over at the bandwidth:
+ * kp = (3 / 2) * L * bw
+ * ki = (3 / 2) * R * bw
+ * The control loop delays the output by about 1.5 periods (one period for the
+ * calculation and half a period from the PWM update), which costs bw * delay
+ * of phase at the crossover frequency. The delay is longest at the lowest
+ * switching frequency the configuration allows, foc_f_sw_min with
+ * foc_f_sw_sched and foc_f_sw otherwise, so the margin is checked there.
+ *
+ * @param bw
+ * The current controller bandwidth in rad/s.
+ *
+ * @param res
+ * The motor resistance in ohm.
+ *
+ * @param ind
+ * The motor inductance in henry.
+ *
+ * @param kp
+ * The calculated proportional gain.
+ *
+ * @param ki
+ * The calculated integral gain.
+ *
+ * @param phase_margin
+ * The phase margin in degrees at the lowest allowed switching frequency. Can
+ * be NULL.
+ *
+ * @return
+ * True if the parameters are valid and the phase margin is at least
+ * MCPWM_FOC_CC_MIN_PHASE_MARGIN, false otherwise.
+ */
+bool mcpwm_foc_calc_current_gains(float bw, float res, float ind,
+		float *kp, float *ki, float *phase_margin) {
+	const float f_sw_min = m_conf->foc_f_sw_sched ?
+			fminf(m_conf->foc_f_sw_min, m_conf->foc_f_sw) : m_conf->foc_f_sw;
+	const float delay = 1.5 * control_period(f_sw_min);
+	const float margin = (M_PI / 2.0 - bw * delay) * (180.0 / M_PI);
+
+	*kp = (3.0 / 2.0) * ind * bw;
+	*ki = (3.0 / 2.0) * res * bw;
+
+	if (phase_margin) {
+		*phase_margin = margin;
+	}
+
+	return bw > 0.0 && res > 0.0 && ind > 0.0 &&
+			margin >= MCPWM_FOC_CC_MIN_PHASE_MARGIN;
+}
+
 /**
  * Run the motor in open loop and figure out at which angles the hall sensors are.
  *
@@ -1454,6 +1864,18 @@ void mcpwm_foc_print_state(void) {
 	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);
 	commands_printf("Obs_x1:       %.2f", (double)m_observer_x1);
 	commands_printf("Obs_x2:       %.2f", (double)m_observer_x2);
+	commands_printf("I_fw:         %.2f", (double)m_i_fw_set);
+	commands_printf("HFI phase:    %.2f", (double)m_hfi.phase);
+	commands_printf("HFI retries:  %d", m_hfi.polarity_retries);
+	commands_printf("PLL bw:       %.1f", (double)m_pll_bw);
+	commands_printf("PLL conf:     %.2f", (double)m_pll_conf);
+	commands_printf("Obs speed:    %.1f", (double)m_obs_speed);
+	commands_printf("DPWM:         %s", m_dpwm_on ? "on" : "off");
+	commands_printf("F_sw:         %.0f Hz", (double)m_f_sw_now);
+	commands_printf("Est R:        %.4f", (double)m_est_r);
+	commands_printf("Est lambda:   %.6f", (double)m_est_lambda);
+	commands_printf("Est temp:     %.1f", (double)m_est_temp);
+	commands_printf("Const seq:    %u", m_const_seq);
 }
 
 float mcpwm_foc_get_last_inj_adc_isr_duration(void) {
@@ -1472,6 +1894,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	(void)flags;
 
 	TIM12->CNT = 0;
+	const uint32_t prof_start = ISR_PROF_NOW();
 
 	bool is_v7 = !(TIM1->CR1 & TIM_CR1_DIR);
 
@@ -1586,6 +2009,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			TIMER_UPDATE_DUTY(duty_cnt,	0, duty_cnt);
 		} else if (inductance_state == 3) {
 			m_samples.avg_current_tot += -((float)curr1 * FAC_CURRENT);
+			m_samples.avg_current_dir[0] += -((float)curr1 * FAC_CURRENT);
 			m_samples.avg_voltage_tot += GET_INPUT_VOLTAGE();
 			m_samples.sample_num++;
 			TIMER_UPDATE_DUTY(0, 0, 0);
@@ -1593,6 +2017,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			TIMER_UPDATE_DUTY(0, duty_cnt, duty_cnt);
 		} else if (inductance_state == 6) {
 			m_samples.avg_current_tot += -((float)curr0 * FAC_CURRENT);
+			m_samples.avg_current_dir[1] += -((float)curr0 * FAC_CURRENT);
 			m_samples.avg_voltage_tot += GET_INPUT_VOLTAGE();
 			m_samples.sample_num++;
 			TIMER_UPDATE_DUTY(0, 0, 0);
@@ -1605,8 +2030,10 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		} else if (inductance_state == 9) {
 #ifdef HW_HAS_3_SHUNTS
 			m_samples.avg_current_tot += -((float)curr2 * FAC_CURRENT);
+			m_samples.avg_current_dir[2] += -((float)curr2 * FAC_CURRENT);
 #else
 			m_samples.avg_current_tot += -((float)curr0 * FAC_CURRENT + (float)curr1 * FAC_CURRENT);
+			m_samples.avg_current_dir[2] += -((float)curr0 * FAC_CURRENT + (float)curr1 * FAC_CURRENT);
 #endif
 			m_samples.avg_voltage_tot += GET_INPUT_VOLTAGE();
 			m_samples.sample_num++;
@@ -1622,19 +2049,28 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		return;
 	}
 
-#ifdef HW_HAS_PHASE_SHUNTS
-	float dt;
-	if (m_conf->foc_sample_v0_v7) {
-		dt = 1.0 / m_conf->foc_f_sw;
-	} else {
-		dt = 1.0 / (m_conf->foc_f_sw / 2.0);
+	const foc_const_t *c = m_const;
+
+	// The timer top that the control loop writes only becomes active at the
+	// underflow before the next interrupt, so the period following this
+	// interrupt still runs with the top written in the previous cycle.
+	static float dt_next = 0.0;
+	const float dt = dt_next > 0.0 ? dt_next : c->dt;
+	dt_next = c->dt;
+
+	// Only the current loop runs every cycle, the estimators every est_div cycles.
+	static int est_cnt = 0;
+	bool est_now = false;
+	if (++est_cnt >= c->est_div) {
+		est_cnt = 0;
+		est_now = true;
 	}
-#else
-	const float dt = 1.0 / (m_conf->foc_f_sw / 2.0);
-#endif
 
 	UTILS_LP_FAST(m_motor_state.v_bus, GET_INPUT_VOLTAGE(), 0.1);
 
+	// Update the derived quantities once for this cycle
+	isr_cache_update(m_motor_state.v_bus);
+
 	float enc_ang = 0;
 	if (encoder_is_configured()) {
 		enc_ang = encoder_read_deg();
@@ -1664,7 +2100,8 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		const float duty_abs = fabsf(m_motor_state.duty_now);
 		float id_set_tmp = m_id_set;
 		float iq_set_tmp = m_iq_set;
-		m_motor_state.max_duty = m_conf->l_max_duty;
+		m_motor_state.max_duty = c->l_max_duty;
+		m_motor_state.v_inj_d = 0.0;
 
 		static float duty_filtered = 0.0;
 		UTILS_LP_FAST(duty_filtered, m_motor_state.duty_now, 0.1);
@@ -1698,14 +2135,14 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 				// Truncating the duty cycle here would be dangerous, so run a PID controller.
 
 				// Compensation for supply voltage variations
-				float scale = 1.0 / GET_INPUT_VOLTAGE();
+				const float scale = isr_cache()->v_bus_inv;
 
 				// Compute error
 				float error = duty_set - m_motor_state.duty_now;
 
 				// Compute parameters
-				float p_term = error * m_conf->foc_duty_dowmramp_kp * scale;
-				duty_i_term += error * (m_conf->foc_duty_dowmramp_ki * dt) * scale;
+				float p_term = error * c->duty_dowmramp_kp * scale;
+				duty_i_term += error * (c->duty_dowmramp_ki * dt) * scale;
 
 				// I-term wind-up protection
 				utils_truncate_number(&duty_i_term, -1.0, 1.0);
@@ -1738,9 +2175,9 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 		// Run observer
 		if (!m_phase_override) {
-			observer_update(m_motor_state.v_alpha, m_motor_state.v_beta,
-					m_motor_state.i_alpha, m_motor_state.i_beta, dt,
-					&m_observer_x1, &m_observer_x2, &m_phase_now_observer);
+			uint32_t prof_sec = ISR_PROF_NOW();
+			run_observer(est_now, dt);
+			ISR_PROF_ADD(ISR_PROF_FOC_OBSERVER, prof_sec);
 		}
 
 		switch (m_conf->foc_sensor_mode) {
@@ -1764,6 +2201,23 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 				id_set_tmp = 0.0;
 			}
 			break;
+		case FOC_SENSOR_MODE_HFI:
+			if (hfi_update(c, dt)) {
+				m_motor_state.phase = m_hfi.phase;
+			} else {
+				m_motor_state.phase = m_phase_now_observer;
+			}
+
+			if (!m_phase_override) {
+				id_set_tmp = 0.0;
+
+				// No torque until the magnet polarity is known
+				if (m_hfi.active && !m_hfi.ready) {
+					id_set_tmp = m_hfi.id_bias;
+					iq_set_tmp = 0.0;
+				}
+			}
+			break;
 		case FOC_SENSOR_MODE_SENSORLESS:
 			if (m_phase_observer_override) {
 				m_motor_state.phase = m_phase_now_observer_override;
@@ -1815,14 +2269,58 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			utils_truncate_number(&iq_set_tmp, -m_conf->lo_current_max, -m_conf->lo_current_min);
 		}
 
-		utils_saturate_vector_2d(&id_set_tmp, &iq_set_tmp,
-				utils_max_abs(m_conf->lo_current_max, m_conf->lo_current_min));
+		const bool id_free = !m_phase_override &&
+				m_control_mode != CONTROL_MODE_HANDBRAKE &&
+				m_control_mode != CONTROL_MODE_OPENLOOP;
+
+		// MTPA. The requested current is used as the current magnitude and split
+		// into D and Q axis current for maximum torque.
+		if (c->mtpa_enable && id_free) {
+			const float id_mtpa = mtpa_id(c, fabsf(iq_set_tmp));
+			id_set_tmp += id_mtpa;
+			iq_set_tmp = SIGN(iq_set_tmp) * sqrtf(SQ(iq_set_tmp) - SQ(id_mtpa));
+		}
+
+		// Field weakening. Ramp up negative D axis current while the modulation is
+		// above the start threshold and back towards zero when it is below, which
+		// integrates the voltage error.
+		if (c->fw_current_max > 0.0 && id_free) {
+			float i_fw = m_i_fw_set;
+			if (fabsf(duty_filtered) > c->fw_duty_start) {
+				i_fw += c->fw_step;
+			} else {
+				i_fw -= c->fw_step;
+			}
+			utils_truncate_number(&i_fw, 0.0, c->fw_current_max);
+			m_i_fw_set = i_fw;
+			id_set_tmp -= i_fw;
+		} else {
+			m_i_fw_set = 0.0;
+		}
+
+		// lo_current_min is negative, the limit is the larger magnitude of the two
+		const float i_max = fmaxf(fabsf(m_conf->lo_current_max), fabsf(m_conf->lo_current_min));
+
+		// Give the field weakening current priority over the torque current.
+		if (m_i_fw_set > 0.0) {
+			utils_truncate_number_abs(&id_set_tmp, i_max);
+			utils_truncate_number_abs(&iq_set_tmp, sqrtf(SQ(i_max) - SQ(id_set_tmp)));
+		}
+
+		utils_saturate_vector_2d(&id_set_tmp, &iq_set_tmp, i_max);
 
 		m_motor_state.id_target = id_set_tmp;
 		m_motor_state.iq_target = iq_set_tmp;
 
+		uint32_t prof_sec = ISR_PROF_NOW();
 		control_current(&m_motor_state, dt);
+		ISR_PROF_ADD(ISR_PROF_FOC_CONTROL_CURRENT, prof_sec);
 	} else {
+		m_i_fw_set = 0.0;
+		m_hfi.ready = false;
+		m_hfi.active = false;
+		m_motor_state.v_inj_d = 0.0;
+
 		// Track back emf
 #ifdef HW_HAS_3_SHUNTS
 		float Va = ADC_VOLTS(ADC_IND_SENS1) * ((VIN_R1 + VIN_R2) / VIN_R2);
@@ -1855,8 +2353,8 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.vq_int = m_motor_state.vq;
 
 		// Update corresponding modulation
-		m_motor_state.mod_d = m_motor_state.vd / ((2.0 / 3.0) * m_motor_state.v_bus);
-		m_motor_state.mod_q = m_motor_state.vq / ((2.0 / 3.0) * m_motor_state.v_bus);
+		m_motor_state.mod_d = m_motor_state.vd * isr_cache()->mod_scale;
+		m_motor_state.mod_q = m_motor_state.vq * isr_cache()->mod_scale;
 
 		// The current is 0 when the motor is undriven
 		m_motor_state.i_alpha = 0.0;
@@ -1870,9 +2368,9 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.i_abs_filter = 0.0;
 
 		// Run observer
-		observer_update(m_motor_state.v_alpha, m_motor_state.v_beta,
-				m_motor_state.i_alpha, m_motor_state.i_beta, dt, &m_observer_x1,
-				&m_observer_x2, &m_phase_now_observer);
+		uint32_t prof_sec = ISR_PROF_NOW();
+		run_observer(est_now, dt);
+		ISR_PROF_ADD(ISR_PROF_FOC_OBSERVER, prof_sec);
 
 		switch (m_conf->foc_sensor_mode) {
 		case FOC_SENSOR_MODE_ENCODER:
@@ -1883,6 +2381,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			m_motor_state.phase = m_phase_now_observer;
 			break;
 		case FOC_SENSOR_MODE_SENSORLESS:
+		case FOC_SENSOR_MODE_HFI:
 			m_motor_state.phase = m_phase_now_observer;
 			break;
 		}
@@ -1894,7 +2393,11 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 					m_motor_state.mod_q * m_motor_state.mod_q) / SQRT3_BY_2;
 
 	// Run PLL for speed estimation
-	pll_run(m_motor_state.phase, dt, &m_pll_phase, &m_pll_speed);
+	if (est_now) {
+		uint32_t prof_sec = ISR_PROF_NOW();
+		pll_run(m_motor_state.phase, c->dt_est, &m_pll_phase, &m_pll_speed);
+		ISR_PROF_ADD(ISR_PROF_FOC_PLL, prof_sec);
+	}
 
 	// Update tachometer (resolution = 60 deg as for BLDC)
 	float ph_tmp = m_motor_state.phase;
@@ -1934,13 +2437,17 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	}
 
 	// Run position control
-	if (m_state == MC_STATE_RUNNING) {
-		run_pid_control_pos(m_pos_pid_now, m_pos_pid_set, dt);
+	if (est_now && m_state == MC_STATE_RUNNING) {
+		run_pid_control_pos(m_pos_pid_now, m_pos_pid_set, c->dt_est);
 	}
 
-	// MCIF handler
+	// MCIF handler. Runs every cycle, as it does the over current and DRV
+	// fault checks.
+	uint32_t prof_sec = ISR_PROF_NOW();
 	mc_interface_mc_timer_isr();
+	ISR_PROF_ADD(ISR_PROF_FOC_MCIF, prof_sec);
 
+	ISR_PROF_ADD(ISR_PROF_FOC_TOTAL, prof_start);
 	last_inj_adc_isr_duration = (float) TIM12->CNT / 10000000.0;
 }
 
@@ -2036,12 +2543,367 @@ static THD_FUNCTION(timer_thread, arg) {
 		m_gamma_now = utils_map(fabsf(m_motor_state.duty_now), 0.0, 1.0,
 				m_conf->foc_observer_gain * m_conf->foc_observer_gain_slow, m_conf->foc_observer_gain);
 
+		sched_switching_frequency();
+		run_param_est(dt);
 		run_pid_control_speed(dt);
 		chThdSleepMilliseconds(1);
 	}
 
 }
 
+/**
+ * Estimate the motor resistance and flux linkage from the steady state q axis
+ * voltage equation
+ * vq - w * (3 / 2) * Ld * id = (3 / 2) * R * iq + w * lambda
+ * with recursive least squares and a forgetting factor. The inputs are
+ * filtered equally and only used at steady speed and current, and the
+ * covariance is bounded so that it does not wind up while there is no
+ * excitation (constant speed and current only identify a combination of R
+ * and lambda).
+ *
+ * @param dt
+ * The time since the last call.
+ */
+static void run_param_est(float dt) {
+	static uint32_t seq_last = 0;
+	static float p[2][2];
+	static float r = 0.0;
+	static float lambda = 0.0;
+	static float vq_f = 0.0;
+	static float id_f = 0.0;
+	static float iq_f = 0.0;
+	static float speed_f = 0.0;
+	static float steady_time = 0.0;
+
+	const float r_conf = m_conf->foc_motor_r;
+	const float lambda_conf = m_conf->foc_motor_flux_linkage;
+
+	// Restart from the configured values after every configuration change.
+	// Switching frequency changes only rebuild the constants and keep the
+	// estimate.
+	const uint32_t seq = m_conf_seq;
+	if (seq != seq_last) {
+		seq_last = seq;
+		r = r_conf;
+		lambda = lambda_conf;
+		p[0][0] = SQ(0.5 * r_conf) * 100.0;
+		p[0][1] = 0.0;
+		p[1][0] = 0.0;
+		p[1][1] = SQ(0.2 * lambda_conf) * 100.0;
+		steady_time = 0.0;
+		m_est_samples = 0;
+	}
+
+	const float speed = m_pll_speed;
+	UTILS_LP_FAST(vq_f, m_motor_state.vq, 0.05);
+	UTILS_LP_FAST(id_f, m_motor_state.id_filter, 0.05);
+	UTILS_LP_FAST(iq_f, m_motor_state.iq_filter, 0.05);
+	UTILS_LP_FAST(speed_f, speed, 0.05);
+
+	// Only use steady state operation with the observer in charge
+	const float min_speed = (m_conf->foc_sl_erpm * 2.0 * M_PI) / 60.0;
+	const bool valid = m_state == MC_STATE_RUNNING && !m_phase_override &&
+			m_control_mode != CONTROL_MODE_OPENLOOP &&
+			m_control_mode != CONTROL_MODE_HANDBRAKE &&
+			fabsf(speed) > min_speed &&
+			fabsf(speed - speed_f) < 0.02 * fabsf(speed_f) &&
+			fabsf(m_motor_state.iq_filter - iq_f) < (0.02 * m_conf->l_current_max) &&
+			fabsf(m_motor_state.duty_now) < 0.9 * m_conf->l_max_duty;
+
+	if (valid) {
+		steady_time += dt;
+	} else {
+		steady_time = 0.0;
+	}
+
+	if (steady_time < 0.05 || r_conf <= 0.0 || lambda_conf <= 0.0) {
+		return;
+	}
+
+	const float ld = m_conf->foc_motor_l - m_conf->foc_motor_ld_lq_diff / 2.0;
+	const float y = vq_f - speed_f * (3.0 / 2.0) * ld * id_f;
+	const float phi0 = (3.0 / 2.0) * iq_f;
+	const float phi1 = speed_f;
+
+	// Recursive least squares update, forgetting factor about 2 s
+	const float forget = 0.9995;
+	const float p_phi0 = p[0][0] * phi0 + p[0][1] * phi1;
+	const float p_phi1 = p[1][0] * phi0 + p[1][1] * phi1;
+	const float denom = forget + phi0 * p_phi0 + phi1 * p_phi1;
+	const float k0 = p_phi0 / denom;
+	const float k1 = p_phi1 / denom;
+	const float err = y - (phi0 * r + phi1 * lambda);
+
+	r += k0 * err;
+	lambda += k1 * err;
+
+	p[0][0] = (p[0][0] - k0 * p_phi0) / forget;
+	p[0][1] = (p[0][1] - k0 * p_phi1) / forget;
+	p[1][1] = (p[1][1] - k1 * p_phi1) / forget;
+	// Keep P symmetric, otherwise rounding makes it drift apart and diverge
+	p[1][0] = p[0][1];
+
+	// Bound the covariance to the initial uncertainty
+	const float p00_max = SQ(0.5 * r_conf) * 100.0;
+	const float p11_max = SQ(0.2 * lambda_conf) * 100.0;
+	if (p[0][0] > p00_max || p[1][1] > p11_max) {
+		const float scale = fminf(p00_max / p[0][0], p11_max / p[1][1]);
+		p[0][0] *= scale;
+		p[0][1] *= scale;
+		p[1][0] *= scale;
+		p[1][1] *= scale;
+	}
+
+	// Copper can about double its resistance, magnets lose some flux when hot
+	utils_truncate_number(&r, 0.5 * r_conf, 2.0 * r_conf);
+	utils_truncate_number(&lambda, 0.7 * lambda_conf, 1.2 * lambda_conf);
+
+	m_est_r = r;
+	m_est_lambda = lambda;
+	m_est_temp = m_conf->foc_temp_comp_base_temp + (r / r_conf - 1.0) / 0.00386;
+	m_est_samples++;
+}
+
+/**
+ * Rebuild the configuration derived constants used by the control interrupt.
+ * The inactive buffer is filled and then published with a single pointer
+ * write, so the interrupt never sees a partially updated block. m_const_seq
+ * counts the published blocks, so that users of derived values can tell when
+ * the constants have changed.
+ *
+ * Has to be called from thread context after every change of m_conf.
+ */
+static void update_const(void) {
+	chMtxLock(&m_const_mtx);
+	update_const_locked();
+	chMtxUnlock(&m_const_mtx);
+}
+
+/**
+ * Same as update_const, for callers that already own m_const_mtx or cannot
+ * take it. mcpwm_foc_init uses it while the system is locked, before anything
+ * else can update the constants.
+ */
+static void update_const_locked(void) {
+	foc_const_t *c = (m_const == &m_const_buf[0]) ? &m_const_buf[1] : &m_const_buf[0];
+
+	const float f_sw = m_f_sw_now;
+	c->top = SYSTEM_CORE_CLOCK / (int)f_sw;
+	c->dt = control_period(f_sw);
+
+	c->est_div = m_conf->foc_est_decimation;
+	utils_truncate_number_int(&c->est_div, 1, 16);
+	c->dt_est = c->dt * (float)c->est_div;
+
+	c->mod_comp_fact = m_conf->foc_dt_us * 1e-6 * f_sw;
+	c->l_max_duty = m_conf->l_max_duty;
+	c->current_kp = m_conf->foc_current_kp;
+	c->current_ki = m_conf->foc_current_ki;
+	c->duty_dowmramp_kp = m_conf->foc_duty_dowmramp_kp;
+	c->duty_dowmramp_ki = m_conf->foc_duty_dowmramp_ki;
+	c->pll_kp = m_conf->foc_pll_kp;
+	c->pll_ki = m_conf->foc_pll_ki;
+	// foc_motor_l is (Ld + Lq) / 2. With saliency the observer tracks the active
+	// flux lambda + (Ld - Lq) * id, which is aligned with the rotor like lambda.
+	c->obs_l = (3.0 / 2.0) * (m_conf->foc_motor_l + m_conf->foc_motor_ld_lq_diff / 2.0);
+	c->obs_salient = fabsf(m_conf->foc_motor_ld_lq_diff) > 1e-9;
+	c->obs_lambda = m_conf->foc_motor_flux_linkage;
+	c->obs_lambda_id_fact = -(3.0 / 2.0) * m_conf->foc_motor_ld_lq_diff;
+	c->obs_r = (3.0 / 2.0) * m_conf->foc_motor_r;
+	c->obs_lambda_2 = SQ(m_conf->foc_motor_flux_linkage);
+	c->obs_sat_comp = m_conf->foc_sat_comp / m_conf->l_current_max;
+	c->obs_temp_comp = m_conf->foc_temp_comp;
+	c->obs_temp_comp_base_temp = m_conf->foc_temp_comp_base_temp;
+	c->obs_type = m_conf->foc_observer_type;
+	c->obs_iterations = m_conf->foc_observer_iterations;
+	utils_truncate_number_int(&c->obs_iterations, 1, 20);
+	c->obs_iter_min_speed = m_conf->foc_observer_iter_min_erpm * ((2.0 * M_PI) / 60.0);
+
+	c->fw_current_max = m_conf->foc_fw_current_max;
+	c->fw_duty_start = m_conf->foc_fw_duty_start * m_conf->l_max_duty;
+	if (m_conf->foc_fw_ramp_time > 1e-4) {
+		c->fw_step = m_conf->foc_fw_current_max * c->dt / m_conf->foc_fw_ramp_time;
+	} else {
+		c->fw_step = m_conf->foc_fw_current_max;
+	}
+
+	// MTPA table over the current magnitude range, from
+	// id = (lambda - sqrt(lambda^2 + 8 * (Lq - Ld)^2 * is^2)) / (4 * (Lq - Ld))
+	// with Ld and Lq in the dq model convention used by the observer, where
+	// Lq - Ld = (3 / 2) * foc_motor_ld_lq_diff.
+	const float ld_lq_diff = m_conf->foc_motor_ld_lq_diff;
+	const float ld_lq_diff_dq = (3.0 / 2.0) * ld_lq_diff;
+	const float lambda = m_conf->foc_motor_flux_linkage;
+	const float i_max = fmaxf(fabsf(m_conf->l_current_max), fabsf(m_conf->l_current_min));
+	c->mtpa_enable = m_conf->foc_mtpa_enable && ld_lq_diff > 1e-9 && i_max > 0.0;
+	c->mtpa_idx_scale = c->mtpa_enable ? (float)MTPA_LUT_SIZE / i_max : 0.0;
+	for (int i = 0;i <= MTPA_LUT_SIZE;i++) {
+		const float is = (i_max * (float)i) / (float)MTPA_LUT_SIZE;
+		c->mtpa_lut[i] = c->mtpa_enable ?
+				(lambda - sqrtf(SQ(lambda) + 8.0 * SQ(ld_lq_diff_dq) * SQ(is))) / (4.0 * ld_lq_diff_dq) : 0.0;
+	}
+
+	// HFI. A voltage v on the estimated d axis gives a q axis current change of
+	// v * dt * (1 / Ld - 1 / Lq) / 2 * sin(2 * angle error) over one period.
+	const float ld_obs = (3.0 / 2.0) * (m_conf->foc_motor_l - ld_lq_diff / 2.0);
+	const float lq_obs = (3.0 / 2.0) * (m_conf->foc_motor_l + ld_lq_diff / 2.0);
+	c->hfi_ok = ld_lq_diff > 1e-9 && ld_obs > 1e-9 && m_conf->foc_hfi_voltage > 0.0;
+	c->hfi_voltage = m_conf->foc_hfi_voltage;
+	c->hfi_err_scale = c->hfi_ok ?
+			1.0 / (m_conf->foc_hfi_voltage * c->dt * (1.0 / ld_obs - 1.0 / lq_obs)) : 0.0;
+	c->hfi_kp = 2.0 * m_conf->foc_hfi_bw;
+	c->hfi_ki = SQ(m_conf->foc_hfi_bw);
+	c->hfi_converge_cycles = (int)(0.02 / c->dt);
+	c->hfi_polarity_cycles = (int)(0.02 / c->dt);
+	c->hfi_polarity_current = m_conf->foc_hfi_polarity_current;
+	c->online_est = m_conf->foc_online_est;
+
+	c->dec_cross = m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS ||
+			m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF;
+	c->dec_bemf = m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_BEMF ||
+			m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF;
+	c->dec_ld = ld_obs;
+	c->dec_lq = lq_obs;
+
+	c->pll_adaptive = m_conf->foc_pll_adaptive;
+	c->pll_bw_min = m_conf->foc_pll_bw_min;
+	c->pll_bw_max = fmaxf(m_conf->foc_pll_bw_max, m_conf->foc_pll_bw_min);
+	c->pll_bw_speed_fact = m_conf->foc_pll_bw_erpm > 1.0 ?
+			1.0 / (m_conf->foc_pll_bw_erpm * ((2.0 * M_PI) / 60.0)) : 1.0;
+	c->pll_obs_speed = m_conf->foc_pll_obs_speed &&
+			(m_conf->foc_sensor_mode == FOC_SENSOR_MODE_SENSORLESS ||
+					m_conf->foc_sensor_mode == FOC_SENSOR_MODE_HFI);
+
+	c->overmod_mode = m_conf->foc_overmod_mode;
+	switch (c->overmod_mode) {
+	case FOC_OVERMOD_HEXAGON:
+		c->overmod_max = 1.0;
+		break;
+	case FOC_OVERMOD_SIX_STEP:
+		c->overmod_max = TWO_BY_SQRT3;
+		break;
+	default:
+		c->overmod_max = SQRT3_BY_2;
+		break;
+	}
+	c->overmod_hold_fact = 0.5 / (TWO_BY_SQRT3 - 1.0);
+	c->sample_win = (uint32_t)(MCPWM_FOC_SAMPLE_WINDOW_TIME * (float)SYSTEM_CORE_CLOCK / 2.0);
+
+	// Clamping a phase high leaves no low side time to sample its shunt, which
+	// only works when that phase can be calculated from the other two.
+	c->dpwm_mode = m_conf->foc_dpwm_mode;
+#if !defined(HW_HAS_3_SHUNTS) && !defined(HW_HAS_PHASE_SHUNTS)
+	if (c->dpwm_mode != FOC_DPWM_DISABLED) {
+		c->dpwm_mode = FOC_DPWM_MIN;
+	}
+#endif
+	c->dpwm_mod_on_sq = SQ(m_conf->foc_dpwm_mod_min * SQRT3_BY_2);
+	c->dpwm_mod_off_sq = SQ(fmaxf(m_conf->foc_dpwm_mod_min - 0.05, 0.0) * SQRT3_BY_2);
+
+	m_const = c;
+	m_const_seq++;
+}
+
+/**
+ * Change the switching frequency used by the control loop.
+ *
+ * @param f_sw
+ * The new switching frequency.
+ *
+ * @param write_now
+ * Write the timer top right away. Otherwise the control interrupt writes it
+ * together with the next compare values, so that no PWM period runs with
+ * compare values calculated for another period. It is always written right
+ * away when the output is off, as the current controller does not run then.
+ */
+static void set_switching_frequency(float f_sw, bool write_now) {
+	m_f_sw_now = f_sw;
+	update_const();
+
+	if (write_now || !m_output_on) {
+		TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, m_const->top);
+	}
+}
+
+/**
+ * The control loop period at a switching frequency. The current is sampled
+ * once per switching period with foc_sample_v0_v7, otherwise every other.
+ */
+static float control_period(float f_sw) {
+#ifdef HW_HAS_PHASE_SHUNTS
+	if (m_conf->foc_sample_v0_v7) {
+		return 1.0 / f_sw;
+	}
+#endif
+	return 1.0 / (f_sw / 2.0);
+}
+
+/**
+ * Switching frequency scheduler, called from the timer thread. Below the
+ * configured foc_f_sw the switching frequency goes down linearly with the
+ * speed up to foc_f_sw_sched_erpm, with the FET temperature over the last
+ * foc_f_sw_temp_margin degrees before l_temp_fet_start and with the current
+ * from half to full l_current_max, whichever asks for the largest reduction.
+ * It never goes below foc_f_sw_min or MCPWM_FOC_F_SW_SCHED_MIN_SAMPLES
+ * samples per electrical revolution, and changes by at most
+ * MCPWM_FOC_F_SW_SCHED_STEP every 10 ms.
+ */
+static void sched_switching_frequency(void) {
+	static int div = 0;
+	if (++div < 10) {
+		return;
+	}
+	div = 0;
+
+	// The measurement functions set the switching frequency themselves
+	if (!m_conf->foc_f_sw_sched || m_phase_override) {
+		return;
+	}
+
+	const float f_max = m_conf->foc_f_sw;
+	const float f_min = fminf(m_conf->foc_f_sw_min, f_max);
+	float f_target = f_max;
+
+	if (m_state == MC_STATE_RUNNING) {
+		const float erpm = fabsf(m_pll_speed) * (60.0 / (2.0 * M_PI));
+
+		float reduce_speed = m_conf->foc_f_sw_sched_erpm > 1.0 ?
+				erpm / m_conf->foc_f_sw_sched_erpm : 0.0;
+
+		const float temp_start = m_conf->l_temp_fet_start - m_conf->foc_f_sw_temp_margin;
+		float reduce_temp = m_conf->foc_f_sw_temp_margin > 0.1 ?
+				(mc_interface_temp_fet_filtered() - temp_start) / m_conf->foc_f_sw_temp_margin : 0.0;
+
+		float reduce_current = m_motor_state.i_abs_filter / (0.5 * m_conf->l_current_max) - 1.0;
+
+		utils_truncate_number(&reduce_speed, 0.0, 1.0);
+		utils_truncate_number(&reduce_temp, 0.0, 1.0);
+		utils_truncate_number(&reduce_current, 0.0, 1.0);
+
+		const float reduce = fmaxf(reduce_speed, fmaxf(reduce_temp, reduce_current));
+		f_target = f_max - (f_max - f_min) * reduce;
+
+		// Keep enough samples per electrical revolution for the control loop
+		// and the observer. The sampling frequency is half of f_sw.
+		const float f_samples = 2.0 * MCPWM_FOC_F_SW_SCHED_MIN_SAMPLES * erpm / 60.0;
+		f_target = fminf(fmaxf(f_target, f_samples), f_max);
+	}
+
+	// Move towards the target in small steps. The compare values written
+	// with a new top are loaded at the overflow while the down count still
+	// runs from the old top, so a small step keeps that half period close to
+	// the commanded duty cycle.
+	float diff = f_target - m_f_sw_now;
+	if (fabsf(diff) < MCPWM_FOC_F_SW_SCHED_HYST && f_target != f_max) {
+		return;
+	}
+
+	utils_truncate_number(&diff, -MCPWM_FOC_F_SW_SCHED_STEP, MCPWM_FOC_F_SW_SCHED_STEP);
+	if (fabsf(diff) > 0.5) {
+		set_switching_frequency(m_f_sw_now + diff, false);
+	}
+}
+
 static void do_dc_cal(void) {
 	DCCAL_ON();
 
@@ -2076,25 +2938,36 @@ static void do_dc_cal(void) {
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 		float dt, volatile float *x1, volatile float *x2, volatile float *phase) {
 
-	const float L = (3.0 / 2.0) * m_conf->foc_motor_l;
-	const float lambda = m_conf->foc_motor_flux_linkage;
-	float R = (3.0 / 2.0) * m_conf->foc_motor_r;
+	const foc_const_t *c = m_const;
+	const float L = c->obs_l;
+	float R = c->obs_r;
+	float lambda = c->obs_lambda;
+	float lambda_2 = c->obs_lambda_2;
+
+	// The online estimates already follow the temperature.
+	if (c->online_est) {
+		R = (3.0 / 2.0) * m_est_r;
+		lambda = m_est_lambda;
+		lambda_2 = SQ(lambda);
+	}
 
 	// Saturation compensation
 	const float sign = (m_motor_state.iq * m_motor_state.vq) >= 0.0 ? 1.0 : -1.0;
-	R -= R * sign * m_conf->foc_sat_comp * (m_motor_state.i_abs_filter / m_conf->l_current_max);
+	R -= R * sign * c->obs_sat_comp * m_motor_state.i_abs_filter;
 
 	// Temperature compensation
 	const float t = mc_interface_temp_motor_filtered();
-	if (m_conf->foc_temp_comp && t > -5.0) {
-		R += R * 0.00386 * (t - m_conf->foc_temp_comp_base_temp);
+	if (c->obs_temp_comp && !c->online_est && t > -5.0) {
+		R += R * 0.00386 * (t - c->obs_temp_comp_base_temp);
 	}
 
 	const float L_ia = L * i_alpha;
 	const float L_ib = L * i_beta;
 	const float R_ia = R * i_alpha;
 	const float R_ib = R * i_beta;
-	const float lambda_2 = SQ(lambda);
+	if (c->obs_salient) {
+		lambda_2 = SQ(lambda + c->obs_lambda_id_fact * m_motor_state.id);
+	}
 	const float gamma_half = m_gamma_now * 0.5;
 
 	// Original
@@ -2104,48 +2977,443 @@ void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 //	*x1 += x1_dot * dt;
 //	*x2 += x2_dot * dt;
 
-	// Iterative with some trial and error
-	const int iterations = 6;
-	const float dt_iteration = dt / (float)iterations;
-	for (int i = 0;i < iterations;i++) {
+	switch (c->obs_type) {
+	default:
+	case FOC_OBSERVER_ITERATIVE: {
+		// Iterative with some trial and error
+		int iterations = c->obs_iterations;
+
+		// At low speed the flux hardly moves during one period, so one step is enough.
+		if (fabsf(m_pll_speed) < c->obs_iter_min_speed) {
+			iterations = 1;
+		}
+
+		const float dt_iteration = dt / (float)iterations;
+		for (int i = 0;i < iterations;i++) {
+			float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
+			float gamma_tmp = gamma_half;
+			if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
+				gamma_tmp *= 10.0;
+			}
+			float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
+			float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
+
+			*x1 += x1_dot * dt_iteration;
+			*x2 += x2_dot * dt_iteration;
+		}
+	} break;
+
+	case FOC_OBSERVER_RK2: {
+		// Single midpoint step. Two evaluations instead of six, with second
+		// order accuracy.
 		float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
 		float gamma_tmp = gamma_half;
 		if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
 			gamma_tmp *= 10.0;
 		}
-		float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
-		float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
+		const float x1_mid = *x1 + (-R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err) * (0.5 * dt);
+		const float x2_mid = *x2 + (-R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err) * (0.5 * dt);
 
-		*x1 += x1_dot * dt_iteration;
-		*x2 += x2_dot * dt_iteration;
+		err = lambda_2 - (SQ(x1_mid - L_ia) + SQ(x2_mid - L_ib));
+		gamma_tmp = gamma_half;
+		if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
+			gamma_tmp *= 10.0;
+		}
+		*x1 += (-R_ia + v_alpha + gamma_tmp * (x1_mid - L_ia) * err) * dt;
+		*x2 += (-R_ib + v_beta + gamma_tmp * (x2_mid - L_ib) * err) * dt;
+	} break;
+
+	case FOC_OBSERVER_ANALYTIC: {
+		// Integrate the voltage model with one Euler step, then apply the exact
+		// solution of the correction term over dt. With s = |x - L*i|^2 the
+		// correction is the logistic equation ds/dt = gamma * s * (lambda^2 - s), so
+		// s(dt) = lambda^2 * s0 / (s0 + (lambda^2 - s0) * e^(-gamma * lambda^2 * dt)).
+		*x1 += (v_alpha - R_ia) * dt;
+		*x2 += (v_beta - R_ib) * dt;
+
+		const float x1_flux = *x1 - L_ia;
+		const float x2_flux = *x2 - L_ib;
+		const float s0 = SQ(x1_flux) + SQ(x2_flux);
+
+		if (s0 > 1e-20) {
+			// e^(-a) = 1 / e^(a), with e^(a) from its third order series. Stays in (0 1] for any a >= 0.
+			const float a = 2.0 * gamma_half * lambda_2 * dt;
+			const float decay = 1.0 / (1.0 + a * (1.0 + a * (0.5 + a * (1.0 / 6.0))));
+			const float s = (lambda_2 * s0) / (s0 + (lambda_2 - s0) * decay);
+			const float scale = sqrtf(s / s0);
+
+			*x1 = L_ia + x1_flux * scale;
+			*x2 = L_ib + x2_flux * scale;
+		}
+	} break;
 	}
 
-	// Same as above, but without iterations.
-//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-//	float gamma_tmp = gamma_half;
-//	if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
-//		gamma_tmp *= 10.0;
-//	}
-//	float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
-//	float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
-//	*x1 += x1_dot * dt;
-//	*x2 += x2_dot * dt;
-
 	UTILS_NAN_ZERO(*x1);
 	UTILS_NAN_ZERO(*x2);
 
-	*phase = utils_fast_atan2(*x2 - L_ib, *x1 - L_ia);
+	const float x1_flux = *x1 - L_ia;
+	const float x2_flux = *x2 - L_ib;
+	*phase = utils_fast_atan2(x2_flux, x1_flux);
+
+	if (lambda_2 > 1e-20) {
+		m_obs_flux_err = fabsf(lambda_2 - (SQ(x1_flux) + SQ(x2_flux))) / lambda_2;
+	}
 }
 
+/**
+ * Look up the MTPA D axis current.
+ *
+ * @param c
+ * The constant block to use.
+ *
+ * @param i_abs
+ * The current magnitude.
+ *
+ * @return
+ * The D axis current, zero or negative.
+ */
+static inline float mtpa_id(const foc_const_t *c, float i_abs) {
+	const float idx_f = i_abs * c->mtpa_idx_scale;
+	int idx = (int)idx_f;
+	if (idx >= MTPA_LUT_SIZE) {
+		return c->mtpa_lut[MTPA_LUT_SIZE];
+	}
+
+	return c->mtpa_lut[idx] + (idx_f - (float)idx) * (c->mtpa_lut[idx + 1] - c->mtpa_lut[idx]);
+}
+
+/**
+ * Run the observer on the voltages and currents averaged since its last
+ * update, or extrapolate the observer phase with the PLL speed when it is
+ * not its turn.
+ *
+ * @param est_now
+ * Run the observer this cycle.
+ *
+ * @param dt
+ * The control loop period.
+ */
+static void run_observer(bool est_now, float dt) {
+	static float v_alpha_sum = 0.0;
+	static float v_beta_sum = 0.0;
+	static float i_alpha_sum = 0.0;
+	static float i_beta_sum = 0.0;
+	static int samples = 0;
+	static float phase_last = 0.0;
+
+	v_alpha_sum += m_motor_state.v_alpha;
+	v_beta_sum += m_motor_state.v_beta;
+	i_alpha_sum += m_motor_state.i_alpha;
+	i_beta_sum += m_motor_state.i_beta;
+	samples++;
+
+	if (est_now) {
+		const float samples_inv = 1.0 / (float)samples;
+		const float dt_obs = dt * (float)samples;
+		observer_update(v_alpha_sum * samples_inv, v_beta_sum * samples_inv,
+				i_alpha_sum * samples_inv, i_beta_sum * samples_inv, dt_obs,
+				&m_observer_x1, &m_observer_x2, &m_phase_now_observer);
+
+		// Rotation of the flux vector over the update. Unlike the PLL integrator
+		// this follows acceleration without lag.
+		float phase_diff = m_phase_now_observer - phase_last;
+		utils_norm_angle_rad(&phase_diff);
+		m_obs_speed = phase_diff / dt_obs;
+		phase_last = m_phase_now_observer;
+
+		v_alpha_sum = 0.0;
+		v_beta_sum = 0.0;
+		i_alpha_sum = 0.0;
+		i_beta_sum = 0.0;
+		samples = 0;
+	} else {
+		float phase = m_phase_now_observer + m_pll_speed * dt;
+		utils_norm_angle_rad(&phase);
+		m_phase_now_observer = phase;
+	}
+}
+
+/**
+ * High frequency injection angle estimation for standstill and low speed.
+ *
+ * A square wave voltage is injected on the estimated d axis with the
+ * sequence +v +v -v -v. The current change is only evaluated in the second
+ * period of each sign, so that one period of PWM update delay does not
+ * change the result, and the difference between the positive and negative
+ * response cancels the current change from the current controller. Lq > Ld
+ * makes the q axis response proportional to sin(2 * angle error), which is
+ * tracked with a PI loop. This leaves a 180 degree ambiguity that is
+ * resolved after start from the d axis saturation: with a positive and then
+ * a negative d axis bias current, the response is larger when the current
+ * adds to the magnet flux. The bias windows are repeated until
+ * HFI_POLARITY_VOTES results in a row have the same sign and a difference of
+ * at least HFI_POLARITY_MIN_RATIO of the response, and no torque is given
+ * until then. A motor that does not saturate enough never gets there.
+ *
+ * Above foc_sl_erpm the observer is used and the HFI angle follows it.
+ *
+ * @param c
+ * The constant block to use.
+ *
+ * @param dt
+ * The control loop period.
+ *
+ * @return
+ * True if m_hfi.phase should be used, false if the observer should be used.
+ */
+static bool hfi_update(const foc_const_t *c, float dt) {
+	const float di_alpha = m_motor_state.i_alpha - m_hfi.i_alpha_last;
+	const float di_beta = m_motor_state.i_beta - m_hfi.i_beta_last;
+	m_hfi.i_alpha_last = m_motor_state.i_alpha;
+	m_hfi.i_beta_last = m_motor_state.i_beta;
+
+	// Hysteresis 10 % of the switching speed
+	const float rpm_abs = fabsf(m_pll_speed / ((2.0 * M_PI) / 60.0));
+	const float hyst = m_conf->foc_sl_erpm * 0.1;
+	if (m_hfi.active) {
+		if (rpm_abs > (m_conf->foc_sl_erpm + hyst)) {
+			m_hfi.active = false;
+		}
+	} else {
+		if (rpm_abs < (m_conf->foc_sl_erpm - hyst)) {
+			m_hfi.active = true;
+			m_hfi.cnt = 0;
+
+			// Coming down from the observer the polarity is known.
+			if (m_hfi.ready) {
+				m_hfi.phase = m_phase_now_observer;
+				m_hfi.speed = m_pll_speed;
+			} else {
+				m_hfi.start_cnt = 0;
+				m_hfi.polarity_acc = 0.0;
+				m_hfi.polarity_mag = 0.0;
+				m_hfi.polarity_votes = 0;
+				m_hfi.id_bias = 0.0;
+			}
+		}
+	}
+
+	if (!c->hfi_ok || !m_hfi.active) {
+		m_hfi.phase = m_phase_now_observer;
+		m_hfi.speed = m_pll_speed;
+		m_hfi.ready = m_hfi.ready || rpm_abs > m_conf->foc_sl_erpm;
+		return false;
+	}
+
+	if (m_hfi.cnt == 0 || m_hfi.cnt == 2) {
+		float s, c_ang;
+		utils_fast_sincos_better(m_hfi.phase, &s, &c_ang);
+		const float di_d = c_ang * di_alpha + s * di_beta;
+		const float di_q = c_ang * di_beta - s * di_alpha;
+
+		if (m_hfi.cnt == 2) {
+			// Response to +v
+			m_hfi.di_d_pos = di_d;
+			m_hfi.di_q_pos = di_q;
+		} else {
+			// Response to -v, one injection period done
+			float err = 0.5 * (m_hfi.di_q_pos - di_q) * c->hfi_err_scale;
+			utils_truncate_number_abs(&err, M_PI / 4.0);
+
+			const float dt_inj = 4.0 * dt;
+			m_hfi.phase += c->hfi_kp * err * dt_inj;
+			m_hfi.speed += c->hfi_ki * err * dt_inj;
+
+			if (!m_hfi.ready) {
+				// Converge without bias, then a positive and a negative bias
+				// window. The first quarter of each bias window is skipped so
+				// that the current has settled.
+				m_hfi.start_cnt += 4;
+				const int t = m_hfi.start_cnt - c->hfi_converge_cycles;
+				const int p = c->hfi_polarity_cycles;
+				const float di_d_mag = 0.5 * (m_hfi.di_d_pos - di_d);
+				m_hfi.id_bias = 0.0;
+
+				if (t > 0 && t <= p) {
+					m_hfi.id_bias = c->hfi_polarity_current;
+					if (t > p / 4) {
+						m_hfi.polarity_acc += di_d_mag;
+						m_hfi.polarity_mag += fabsf(di_d_mag);
+					}
+				} else if (t > p && t <= 2 * p) {
+					m_hfi.id_bias = -c->hfi_polarity_current;
+					if ((t - p) > p / 4) {
+						m_hfi.polarity_acc -= di_d_mag;
+						m_hfi.polarity_mag += fabsf(di_d_mag);
+					}
+				} else if (t > 2 * p) {
+					// A result too close to tell, or one that disagrees with
+					// the previous one, starts the count over. The angle
+					// tracker can still be settling during the first windows.
+					const int vote = m_hfi.polarity_acc > 0.0 ? 1 : -1;
+					if (fabsf(m_hfi.polarity_acc) <= HFI_POLARITY_MIN_RATIO * m_hfi.polarity_mag) {
+						m_hfi.polarity_votes = 0;
+					} else if (m_hfi.polarity_votes * vote < 0) {
+						m_hfi.polarity_votes = vote;
+					} else {
+						m_hfi.polarity_votes += vote;
+					}
+
+					if (abs(m_hfi.polarity_votes) >= HFI_POLARITY_VOTES) {
+						if (m_hfi.polarity_votes < 0) {
+							m_hfi.phase += M_PI;
+						}
+						m_hfi.ready = true;
+					} else {
+						m_hfi.start_cnt = c->hfi_converge_cycles;
+						m_hfi.polarity_acc = 0.0;
+						m_hfi.polarity_mag = 0.0;
+						m_hfi.polarity_retries++;
+					}
+				}
+			}
+		}
+	}
+
+	m_hfi.phase += m_hfi.speed * dt;
+	utils_norm_angle_rad(&m_hfi.phase);
+
+	// Voltage for the coming period
+	m_motor_state.v_inj_d = m_hfi.cnt < 2 ? c->hfi_voltage : -c->hfi_voltage;
+	m_hfi.cnt = (m_hfi.cnt + 1) & 3;
+
+	return true;
+}
+
+/**
+ * Track the phase and estimate the speed with a PLL.
+ *
+ * With foc_pll_adaptive the bandwidth rises linearly with the speed from
+ * foc_pll_bw_min to foc_pll_bw_max, so that the speed estimate is quiet at
+ * low speed and follows hard acceleration at high speed. In sensorless and
+ * HFI mode it is also scaled down towards the minimum while the observer flux
+ * magnitude is off, which happens at low speed and after disturbances. The
+ * gains are kp = 2 * bw and ki = bw^2 for critical damping.
+ *
+ * With foc_pll_obs_speed the speed is the filtered rotation of the observer
+ * flux vector and the PLL only tracks the phase.
+ *
+ * @param phase
+ * The measured phase.
+ *
+ * @param dt
+ * The time since the last call.
+ *
+ * @param phase_var
+ * The PLL phase.
+ *
+ * @param speed_var
+ * The PLL speed.
+ */
 static void pll_run(float phase, float dt, volatile float *phase_var,
 		volatile float *speed_var) {
 	UTILS_NAN_ZERO(*phase_var);
 	float delta_theta = phase - *phase_var;
 	utils_norm_angle_rad(&delta_theta);
 	UTILS_NAN_ZERO(*speed_var);
-	*phase_var += (*speed_var + m_conf->foc_pll_kp * delta_theta) * dt;
-	utils_norm_angle_rad((float*)phase_var);
-	*speed_var += m_conf->foc_pll_ki * delta_theta * dt;
+	const foc_const_t *c = m_const;
+
+	float kp = c->pll_kp;
+	float ki = c->pll_ki;
+	float bw = c->pll_bw_max;
+
+	if (c->pll_adaptive || c->pll_obs_speed) {
+		float speed_fact = fabsf(*speed_var) * c->pll_bw_speed_fact;
+		utils_truncate_number(&speed_fact, 0.0, 1.0);
+
+		// Flux magnitude error at which the observer output is not trusted at all,
+		// the observer also switches to its high gain there.
+		float conf = 1.0;
+		if (m_conf->foc_sensor_mode == FOC_SENSOR_MODE_SENSORLESS ||
+				m_conf->foc_sensor_mode == FOC_SENSOR_MODE_HFI) {
+			conf = 1.0 - m_obs_flux_err * (1.0 / 0.2);
+			utils_truncate_number(&conf, 0.0, 1.0);
+		}
+		UTILS_LP_FAST(m_pll_conf, conf, 0.05);
+
+		bw = c->pll_bw_min + (c->pll_bw_max - c->pll_bw_min) * speed_fact * m_pll_conf;
+		m_pll_bw = bw;
+
+		if (c->pll_adaptive) {
+			kp = 2.0 * bw;
+			ki = SQ(bw);
+		}
+	}
+
+	if (c->pll_obs_speed) {
+		float filter = bw * dt;
+		utils_truncate_number(&filter, 0.0, 1.0);
+		UTILS_LP_FAST(*speed_var, m_obs_speed, filter);
+		*phase_var += (*speed_var + kp * delta_theta) * dt;
+		utils_norm_angle_rad((float*)phase_var);
+	} else {
+		*phase_var += (*speed_var + kp * delta_theta) * dt;
+		utils_norm_angle_rad((float*)phase_var);
+		*speed_var += ki * delta_theta * dt;
+	}
+}
+
+/**
+ * Update the bus voltage derived quantities, once at the start of every
+ * control cycle.
+ */
+static inline void isr_cache_update(float v_bus) {
+	m_cache.v_bus_inv = 1.0 / v_bus;
+	m_cache.mod_scale = 1.5 * m_cache.v_bus_inv;
+	m_cache.v_scale = (2.0 / 3.0) * v_bus;
+	m_cache.v_max = m_cache.v_scale * SQRT3_BY_2;
+}
+
+/**
+ * The bus voltage derived quantities for this cycle. Without MCPWM_FOC_ISR_CACHE
+ * they are computed again from v_bus on every call, like before the cache.
+ */
+static inline const isr_cache_t *isr_cache(void) {
+#if !MCPWM_FOC_ISR_CACHE
+	isr_cache_update(m_motor_state.v_bus);
+#endif
+	return &m_cache;
+}
+
+/**
+ * Decoupling feed-forward for the current controller, from the dq voltage equations
+ * vd = R * id + Ld * did/dt - w * Lq * iq
+ * vq = R * iq + Lq * diq/dt + w * (Ld * id + lambda)
+ * With the speed dependent terms fed forward the PI controllers only have to
+ * handle the RL part, so id and iq do not disturb each other during transients
+ * at high speed and the integrators do not have to carry the back EMF.
+ *
+ * @param c
+ * The active constant block.
+ *
+ * @param id
+ * The d axis current of this cycle. The filtered current lags too much
+ * to help during transients.
+ *
+ * @param iq
+ * The q axis current of this cycle.
+ *
+ * @param vd_ff
+ * The d axis feed-forward voltage.
+ *
+ * @param vq_ff
+ * The q axis feed-forward voltage.
+ */
+static inline void decoupling_ff(const foc_const_t *c, float id, float iq,
+		float *vd_ff, float *vq_ff) {
+	const float speed = m_pll_speed;
+
+	*vd_ff = 0.0;
+	*vq_ff = 0.0;
+
+	if (c->dec_cross) {
+		*vd_ff = -speed * c->dec_lq * iq;
+		*vq_ff = speed * c->dec_ld * id;
+	}
+
+	if (c->dec_bemf) {
+		*vq_ff += speed * (c->online_est ? m_est_lambda : c->obs_lambda);
+	}
 }
 
 /**
@@ -2163,6 +3431,8 @@ static void pll_run(float phase, float dt, volatile float *phase_var,
  * i_beta
  * v_bus
  *
+ * m_cache has to be updated from v_bus for this cycle.
+ *
  * Parameters that will be updated in this function:
  * i_bus
  * i_abs
@@ -2184,12 +3454,203 @@ static void pll_run(float phase, float dt, volatile float *phase_var,
  * @param dt
  * The time step in seconds.
  */
+#if MCPWM_FOC_CURRENT_LOOP_Q31
+static void control_current(volatile motor_state_t *state_m, float dt) {
+	// Currents are normalized to Q31_CURRENT_FS and voltages to modulation,
+	// so that 1.0 is (2/3) * v_bus.
+	const float v_scale = isr_cache()->v_scale;
+	const float mod_scale = isr_cache()->mod_scale;
+	const float i_scale = 1.0 / Q31_CURRENT_FS;
+	const uint32_t const_seq = m_const_seq;
+	const foc_const_t *fc = m_const;
+	q31_loop_t *q = &m_q31;
+
+	bool reload = false;
+	if (const_seq != q->const_seq || dt != q->dt ||
+			fabsf(mod_scale - q->mod_scale) > q->mod_scale * Q31_VBUS_TOL) {
+		const float gain_scale = Q31_CURRENT_FS * mod_scale * Q31_GAIN_SCALE;
+		q->const_seq = const_seq;
+		q->dt = dt;
+		q->mod_scale = mod_scale;
+		q->kp = float_to_q31(fc->current_kp * gain_scale);
+		q->ki = float_to_q31(fc->current_ki * dt * gain_scale);
+		q->dec_ld = fc->dec_ld * gain_scale;
+		q->dec_lq = fc->dec_lq * gain_scale;
+		q->mod_comp_alpha = float_to_q31(fc->mod_comp_fact * (1.0 / 3.0));
+		q->mod_comp_beta = float_to_q31(fc->mod_comp_fact * ONE_BY_SQRT3);
+		q->mod_max_overmod = float_to_q31(fc->overmod_max);
+
+		// The integrators hold volts in the float loop, keep that across bus
+		// voltage changes.
+		reload = true;
+	}
+
+	// The integrators are also set from outside, e.g. when tracking the back
+	// emf while coasting. Take them over from the motor state then.
+	if (reload || state_m->vd_int != q->vd_int || state_m->vq_int != q->vq_int) {
+		q->mod_d_int = float_to_q31(state_m->vd_int * mod_scale);
+		q->mod_q_int = float_to_q31(state_m->vq_int * mod_scale);
+	}
+
+	float max_duty = fabsf(state_m->max_duty);
+	utils_truncate_number(&max_duty, 0.0, fc->l_max_duty);
+
+	// With overmodulation the vector can go beyond the circle at the maximum
+	// duty cycle. Q31 only represents up to the hexagon vertex, so the six
+	// step transition is not reached here.
+	const bool overmod = fc->overmod_mode != FOC_OVERMOD_DISABLED && max_duty >= fc->l_max_duty;
+	const int32_t mod_max = overmod ? q->mod_max_overmod : float_to_q31(max_duty * SQRT3_BY_2);
+
+	int32_t c, s;
+	utils_fast_sincos_q31(state_m->phase, &s, &c);
+
+	const int32_t i_alpha = float_to_q31(state_m->i_alpha * i_scale);
+	const int32_t i_beta = float_to_q31(state_m->i_beta * i_scale);
+	const int32_t id_target = float_to_q31(state_m->id_target * i_scale);
+	const int32_t iq_target = float_to_q31(state_m->iq_target * i_scale);
+
+	// Park transform
+	const int32_t id = Q31_ADD(Q31_MUL(c, i_alpha), Q31_MUL(s, i_beta));
+	const int32_t iq = Q31_SUB(Q31_MUL(c, i_beta), Q31_MUL(s, i_alpha));
+
+	const int32_t err_d = Q31_SUB(id_target, id);
+	const int32_t err_q = Q31_SUB(iq_target, iq);
+
+	// Decoupling, same terms as decoupling_ff(). Only the gains follow the
+	// speed, the currents stay in Q31.
+	int32_t mod_d_ff = 0;
+	int32_t mod_q_ff = 0;
+	if (fc->dec_cross || fc->dec_bemf) {
+		const float speed = m_pll_speed;
+
+		if (fc->dec_cross) {
+			mod_d_ff = Q31_SUB(0, q31_mul_gain(iq, float_to_q31(speed * q->dec_lq)));
+			mod_q_ff = q31_mul_gain(id, float_to_q31(speed * q->dec_ld));
+		}
+
+		if (fc->dec_bemf) {
+			const float lambda = fc->online_est ? m_est_lambda : fc->obs_lambda;
+			mod_q_ff = Q31_ADD(mod_q_ff, float_to_q31(speed * lambda * mod_scale));
+		}
+	}
+
+	int32_t mod_d_int = q->mod_d_int;
+	int32_t mod_q_int = q->mod_q_int;
+
+	// The output before saturation can exceed 1.0, so sum it in Q30.
+	const int32_t mod_d_q30 = Q31_ADD((mod_d_int >> 1) + (q31_mul_gain(err_d, q->kp) >> 1), mod_d_ff >> 1);
+	const int32_t mod_q_q30 = Q31_ADD((mod_q_int >> 1) + (q31_mul_gain(err_q, q->kp) >> 1), mod_q_ff >> 1);
+	mod_d_int = Q31_ADD(mod_d_int, q31_mul_gain(err_d, q->ki));
+	mod_q_int = Q31_ADD(mod_q_int, q31_mul_gain(err_q, q->ki));
+
+	// Saturation. Scaling is only needed when the limit is hit, so the
+	// division and square root stay in float.
+	int32_t mod_d, mod_q;
+	const int64_t mod_sq_q30 = (int64_t)mod_d_q30 * mod_d_q30 + (int64_t)mod_q_q30 * mod_q_q30;
+	if (mod_sq_q30 > (int64_t)(mod_max >> 1) * (mod_max >> 1)) {
+		const float d = (float)mod_d_q30;
+		const float q = (float)mod_q_q30;
+		const float scale = (float)mod_max / sqrtf(SQ(d) + SQ(q));
+		mod_d = (int32_t)(d * scale);
+		mod_q = (int32_t)(q * scale);
+	} else {
+		mod_d = mod_d_q30 << 1;
+		mod_q = mod_q_q30 << 1;
+	}
+
+	// Windup protection
+	q->mod_d_int = q31_truncate_abs(mod_d_int, mod_max);
+	q->mod_q_int = q31_truncate_abs(mod_q_int, mod_max);
+
+	// Inverse park transform. The injected voltage is not part of the controller output.
+	const int32_t mod_d_out = Q31_ADD(mod_d, float_to_q31(state_m->v_inj_d * mod_scale));
+	int32_t mod_alpha = Q31_SUB(Q31_MUL(c, mod_d_out), Q31_MUL(s, mod_q));
+	int32_t mod_beta = Q31_ADD(Q31_MUL(c, mod_q), Q31_MUL(s, mod_d_out));
+
+	if (overmod) {
+		overmodulate_q31(&mod_alpha, &mod_beta);
+	}
+
+	// Deadtime compensation. Only the signs of the target phase currents matter.
+	const int32_t i_alpha_filter = Q31_SUB(Q31_MUL(c, id_target), Q31_MUL(s, iq_target));
+	const int32_t i_beta_filter = Q31_ADD(Q31_MUL(c, iq_target), Q31_MUL(s, id_target));
+	const int32_t ib_filter = Q31_SUB(Q31_MUL(Q31_SQRT3_BY_2, i_beta_filter), i_alpha_filter >> 1);
+	const int32_t ic_filter = Q31_SUB(-Q31_MUL(Q31_SQRT3_BY_2, i_beta_filter), i_alpha_filter >> 1);
+	const int sgn_a = SIGN(i_alpha_filter);
+	const int sgn_b = SIGN(ib_filter);
+	const int sgn_c = SIGN(ic_filter);
+	const int32_t mod_alpha_comp = (2 * sgn_a - sgn_b - sgn_c) * q->mod_comp_alpha;
+	const int32_t mod_beta_comp = (sgn_b - sgn_c) * q->mod_comp_beta;
+
+	// Set output (HW Dependent). Min/max injection SVM in integer math. The
+	// timer top is updated together with the compare values.
+	const int32_t top = fc->top;
+	const uint32_t prof_sec = ISR_PROF_NOW();
+	const int32_t svm_alpha = -mod_alpha;
+	const int32_t svm_beta = -mod_beta;
+	const int32_t va = svm_alpha;
+	const int32_t vb = Q31_SUB(Q31_MUL(Q31_SQRT3_BY_2, svm_beta), svm_alpha >> 1);
+	const int32_t vc = Q31_SUB(-Q31_MUL(Q31_SQRT3_BY_2, svm_beta), svm_alpha >> 1);
+	const int32_t v_max = va > vb ? (va > vc ? va : vc) : (vb > vc ? vb : vc);
+	const int32_t v_min = va < vb ? (va < vc ? va : vc) : (vb < vc ? vb : vc);
+	const int32_t v_mid = (v_max >> 1) + (v_min >> 1);
+	const int64_t k_svm = (2 * (int64_t)top) / 3;
+	uint32_t duty1 = top / 2 - (int32_t)((k_svm * (va - v_mid)) >> 31);
+	uint32_t duty2 = top / 2 - (int32_t)((k_svm * (vb - v_mid)) >> 31);
+	uint32_t duty3 = top / 2 - (int32_t)((k_svm * (vc - v_mid)) >> 31);
+	ISR_PROF_ADD(ISR_PROF_FOC_SVM, prof_sec);
+	const float mod_sq = SQ(q31_to_float(mod_alpha)) + SQ(q31_to_float(mod_beta));
+	const bool dpwm = dpwm_apply(fc, mod_sq, top, &duty1, &duty2, &duty3);
+	if (overmod || dpwm) {
+		sample_window_guard(fc, top, &duty1, &duty2, &duty3);
+	}
+	TIMER_UPDATE_DUTY_TOP(duty1, duty2, duty3, top);
+
+	// Same sector numbering as svm()
+	static const uint8_t sector_table[8] = {1, 2, 6, 1, 4, 3, 5, 1};
+	state_m->svm_sector = sector_table[
+			(svm_beta > 0) |
+			((Q31_SUB(Q31_MUL(Q31_SQRT3_BY_2, svm_alpha), svm_beta >> 1) > 0) << 1) |
+			((Q31_SUB(-Q31_MUL(Q31_SQRT3_BY_2, svm_alpha), svm_beta >> 1) > 0) << 2)];
+
+	if (!m_output_on) {
+		start_pwm_hw();
+	}
+
+	// Write back the float state for the rest of the firmware
+	const float id_f = q31_to_float(id) * Q31_CURRENT_FS;
+	const float iq_f = q31_to_float(iq) * Q31_CURRENT_FS;
+	state_m->id = id_f;
+	state_m->iq = iq_f;
+	UTILS_LP_FAST(state_m->id_filter, id_f, MCPWM_FOC_I_FILTER_CONST);
+	UTILS_LP_FAST(state_m->iq_filter, iq_f, MCPWM_FOC_I_FILTER_CONST);
+
+	state_m->mod_d = q31_to_float(mod_d);
+	state_m->mod_q = q31_to_float(mod_q);
+	state_m->vd = state_m->mod_d * v_scale;
+	state_m->vq = state_m->mod_q * v_scale;
+	q->vd_int = q31_to_float(q->mod_d_int) * v_scale;
+	q->vq_int = q31_to_float(q->mod_q_int) * v_scale;
+	state_m->vd_int = q->vd_int;
+	state_m->vq_int = q->vq_int;
+
+	// TODO: Have a look at this?
+	state_m->i_bus = state_m->mod_d * id_f + state_m->mod_q * iq_f;
+	state_m->i_abs = sqrtf(SQ(id_f) + SQ(iq_f));
+	state_m->i_abs_filter = sqrtf(SQ(state_m->id_filter) + SQ(state_m->iq_filter));
+
+	// Apply compensation here so that 0 duty cycle has no glitches.
+	state_m->v_alpha = q31_to_float(Q31_SUB(mod_alpha, mod_alpha_comp)) * v_scale;
+	state_m->v_beta = q31_to_float(Q31_SUB(mod_beta, mod_beta_comp)) * v_scale;
+}
+#else
 static void control_current(volatile motor_state_t *state_m, float dt) {
+	const foc_const_t *fc = m_const;
 	float c,s;
 	utils_fast_sincos_better(state_m->phase, &s, &c);
 
 	float max_duty = fabsf(state_m->max_duty);
-	utils_truncate_number(&max_duty, 0.0, m_conf->l_max_duty);
+	utils_truncate_number(&max_duty, 0.0, fc->l_max_duty);
 
 	state_m->id = c * state_m->i_alpha + s * state_m->i_beta;
 	state_m->iq = c * state_m->i_beta  - s * state_m->i_alpha;
@@ -2199,31 +3660,43 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	float Ierr_d = state_m->id_target - state_m->id;
 	float Ierr_q = state_m->iq_target - state_m->iq;
 
-	state_m->vd = state_m->vd_int + Ierr_d * m_conf->foc_current_kp;
-	state_m->vq = state_m->vq_int + Ierr_q * m_conf->foc_current_kp;
-	state_m->vd_int += Ierr_d * (m_conf->foc_current_ki * dt);
-	state_m->vq_int += Ierr_q * (m_conf->foc_current_ki * dt);
+	float vd_ff, vq_ff;
+	decoupling_ff(fc, state_m->id, state_m->iq, &vd_ff, &vq_ff);
 
-	// Saturation
-	utils_saturate_vector_2d((float*)&state_m->vd, (float*)&state_m->vq,
-			(2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
+	state_m->vd = state_m->vd_int + Ierr_d * fc->current_kp + vd_ff;
+	state_m->vq = state_m->vq_int + Ierr_q * fc->current_kp + vq_ff;
+	state_m->vd_int += Ierr_d * (fc->current_ki * dt);
+	state_m->vq_int += Ierr_q * (fc->current_ki * dt);
 
-	state_m->mod_d = state_m->vd / ((2.0 / 3.0) * state_m->v_bus);
-	state_m->mod_q = state_m->vq / ((2.0 / 3.0) * state_m->v_bus);
+	// Saturation. With overmodulation the vector can go beyond the circle
+	// when the duty cycle limit is the configured maximum.
+	float v_max = max_duty * isr_cache()->v_max;
+	if (fc->overmod_mode != FOC_OVERMOD_DISABLED && max_duty >= fc->l_max_duty) {
+		v_max = fc->overmod_max * isr_cache()->v_scale;
+	}
+	utils_saturate_vector_2d((float*)&state_m->vd, (float*)&state_m->vq, v_max);
+
+	state_m->mod_d = state_m->vd * isr_cache()->mod_scale;
+	state_m->mod_q = state_m->vq * isr_cache()->mod_scale;
 
 	// Windup protection
-//	utils_saturate_vector_2d((float*)&state_m->vd_int, (float*)&state_m->vq_int,
-//			(2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
-	utils_truncate_number_abs((float*)&state_m->vd_int, (2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
-	utils_truncate_number_abs((float*)&state_m->vq_int, (2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
+//	utils_saturate_vector_2d((float*)&state_m->vd_int, (float*)&state_m->vq_int, v_max);
+	utils_truncate_number_abs((float*)&state_m->vd_int, v_max);
+	utils_truncate_number_abs((float*)&state_m->vq_int, v_max);
 
 	// TODO: Have a look at this?
 	state_m->i_bus = state_m->mod_d * state_m->id + state_m->mod_q * state_m->iq;
 	state_m->i_abs = sqrtf(SQ(state_m->id) + SQ(state_m->iq));
 	state_m->i_abs_filter = sqrtf(SQ(state_m->id_filter) + SQ(state_m->iq_filter));
 
-	float mod_alpha = c * state_m->mod_d - s * state_m->mod_q;
-	float mod_beta  = c * state_m->mod_q + s * state_m->mod_d;
+	// The injected voltage is not part of the controller output
+	const float mod_d_out = state_m->mod_d + state_m->v_inj_d * isr_cache()->mod_scale;
+	float mod_alpha = c * mod_d_out - s * state_m->mod_q;
+	float mod_beta  = c * state_m->mod_q + s * mod_d_out;
+
+	if (fc->overmod_mode != FOC_OVERMOD_DISABLED) {
+		overmodulate(fc, &mod_alpha, &mod_beta);
+	}
 
 	// Deadtime compensation
 	const float i_alpha_filter = c * state_m->id_target - s * state_m->iq_target;
@@ -2233,28 +3706,336 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	const float ic_filter = -0.5 * i_alpha_filter - SQRT3_BY_2 * i_beta_filter;
 	const float mod_alpha_filter_sgn = (2.0 / 3.0) * SIGN(ia_filter) - (1.0 / 3.0) * SIGN(ib_filter) - (1.0 / 3.0) * SIGN(ic_filter);
 	const float mod_beta_filter_sgn = ONE_BY_SQRT3 * SIGN(ib_filter) - ONE_BY_SQRT3 * SIGN(ic_filter);
-	const float mod_comp_fact = m_conf->foc_dt_us * 1e-6 * m_conf->foc_f_sw;
+	const float mod_comp_fact = fc->mod_comp_fact;
 	const float mod_alpha_comp = mod_alpha_filter_sgn * mod_comp_fact;
 	const float mod_beta_comp = mod_beta_filter_sgn * mod_comp_fact;
 
 	// Apply compensation here so that 0 duty cycle has no glitches.
-	state_m->v_alpha = (mod_alpha - mod_alpha_comp) * (2.0 / 3.0) * state_m->v_bus;
-	state_m->v_beta = (mod_beta - mod_beta_comp) * (2.0 / 3.0) * state_m->v_bus;
+	state_m->v_alpha = (mod_alpha - mod_alpha_comp) * isr_cache()->v_scale;
+	state_m->v_beta = (mod_beta - mod_beta_comp) * isr_cache()->v_scale;
 
-	// Set output (HW Dependent)
+	// Set output (HW Dependent). The timer top is updated together with the
+	// compare values, so that a new switching frequency starts cleanly.
 	uint32_t duty1, duty2, duty3, top;
-	top = TIM1->ARR;
+	top = fc->top;
+	const uint32_t prof_sec = ISR_PROF_NOW();
 	svm(-mod_alpha, -mod_beta, top, &duty1, &duty2, &duty3, (uint32_t*)&state_m->svm_sector);
-	TIMER_UPDATE_DUTY(duty1, duty2, duty3);
+	ISR_PROF_ADD(ISR_PROF_FOC_SVM, prof_sec);
+	const bool dpwm = dpwm_apply(fc, SQ(mod_alpha) + SQ(mod_beta), top, &duty1, &duty2, &duty3);
+	if (fc->overmod_mode != FOC_OVERMOD_DISABLED || dpwm) {
+		sample_window_guard(fc, top, &duty1, &duty2, &duty3);
+	}
+	TIMER_UPDATE_DUTY_TOP(duty1, duty2, duty3, top);
 
 	if (!m_output_on) {
 		start_pwm_hw();
 	}
 }
+#endif
+
+#if !MCPWM_FOC_CURRENT_LOOP_Q31
+/**
+ * Overmodulation. Vectors up to sqrt(3)/2 are left alone. Larger vectors are
+ * first limited to the hexagon of the inverter along their direction, which
+ * adds up to 5 % of fundamental voltage at a magnitude of 1.0 (the hexagon
+ * vertex). In six step mode the output is then held at the nearest vertex for
+ * a growing part of each sector, which continues to six step operation with
+ * 10 % more fundamental voltage than the circle at 2 / sqrt(3). The fundamental
+ * voltage grows steadily with the magnitude all the way, so that the current
+ * controller can use the whole range.
+ *
+ * @param c
+ * The constant block to use.
+ *
+ * @param alpha
+ * The alpha modulation, updated to the vector to apply.
+ *
+ * @param beta
+ * The beta modulation, updated to the vector to apply.
+ */
+static void overmodulate(const foc_const_t *c, float *alpha, float *beta) {
+	const float mag_sq = SQ(*alpha) + SQ(*beta);
+	if (mag_sq <= (SQRT3_BY_2 * SQRT3_BY_2)) {
+		return;
+	}
+
+	// Hexagon vertices, vertex k - 1 starts sector k
+	static const float vertex[7][2] = {
+			{1.0, 0.0},
+			{0.5, SQRT3_BY_2},
+			{-0.5, SQRT3_BY_2},
+			{-1.0, 0.0},
+			{-0.5, -SQRT3_BY_2},
+			{0.5, -SQRT3_BY_2},
+			{1.0, 0.0}
+	};
+
+	// Same sector numbering as svm()
+	static const uint8_t sector_table[8] = {1, 2, 6, 1, 4, 3, 5, 1};
+	const int sector = sector_table[
+			(*beta > 0.0) |
+			((SQRT3_BY_2 * *alpha - 0.5 * *beta > 0.0) << 1) |
+			((-SQRT3_BY_2 * *alpha - 0.5 * *beta > 0.0) << 2)];
+
+	const float *v1 = vertex[sector - 1];
+	const float *v2 = vertex[sector];
+
+	// Relative on-times of the two vertices of the sector
+	float t1 = (*alpha * v2[1] - *beta * v2[0]) * TWO_BY_SQRT3;
+	float t2 = (v1[0] * *beta - v1[1] * *alpha) * TWO_BY_SQRT3;
+	utils_truncate_number(&t1, 0.0, 2.0);
+	utils_truncate_number(&t2, 0.0, 2.0);
+
+	const float t_sum = t1 + t2;
+	if (t_sum <= 1.0) {
+		return;
+	}
+
+	t1 /= t_sum;
+	t2 /= t_sum;
+
+	if (c->overmod_mode == FOC_OVERMOD_SIX_STEP) {
+		float hold = (sqrtf(mag_sq) - 1.0) * c->overmod_hold_fact;
+		utils_truncate_number(&hold, 0.0, 0.5);
+
+		if (hold > 0.0) {
+			if (t2 < hold) {
+				t2 = 0.0;
+			} else if (t1 < hold) {
+				t2 = 1.0;
+			} else {
+				t2 = (t2 - hold) / (1.0 - 2.0 * hold);
+			}
+			t1 = 1.0 - t2;
+		}
+	}
+
+	// Stay a little inside the hexagon so that rounding in svm() cannot make
+	// the zero vector time negative.
+	const float edge = 0.9999;
+	*alpha = (t1 * v1[0] + t2 * v2[0]) * edge;
+	*beta = (t1 * v1[1] + t2 * v2[1]) * edge;
+}
+#else
+/**
+ * Fixed point version of overmodulate() for the Q31 current loop. Q31 ends at
+ * the hexagon vertex, so the magnitude never gets high enough for the six step
+ * hold and only the projection onto the hexagon is done.
+ *
+ * @param alpha
+ * The alpha modulation in Q31, updated to the vector to apply.
+ *
+ * @param beta
+ * The beta modulation in Q31, updated to the vector to apply.
+ */
+static void overmodulate_q31(int32_t *alpha, int32_t *beta) {
+	const int32_t a = *alpha;
+	const int32_t b = *beta;
+
+	// Magnitude squared in Q61 against (sqrt(3) / 2)^2
+	const int64_t mag_sq = (((int64_t)a * a) >> 1) + (((int64_t)b * b) >> 1);
+	if (mag_sq <= (3LL << 59)) {
+		return;
+	}
+
+	// Hexagon vertices in Q31, vertex k - 1 starts sector k
+	static const int32_t vertex[7][2] = {
+			{INT32_MAX, 0},
+			{1 << 30, Q31_SQRT3_BY_2},
+			{-(1 << 30), Q31_SQRT3_BY_2},
+			{-INT32_MAX, 0},
+			{-(1 << 30), -Q31_SQRT3_BY_2},
+			{1 << 30, -Q31_SQRT3_BY_2},
+			{INT32_MAX, 0}
+	};
+
+	// Same sector numbering as svm()
+	static const uint8_t sector_table[8] = {1, 2, 6, 1, 4, 3, 5, 1};
+	const int sector = sector_table[
+			(b > 0) |
+			((Q31_SUB(Q31_MUL(Q31_SQRT3_BY_2, a), b >> 1) > 0) << 1) |
+			((Q31_SUB(-Q31_MUL(Q31_SQRT3_BY_2, a), b >> 1) > 0) << 2)];
+
+	const int32_t *v1 = vertex[sector - 1];
+	const int32_t *v2 = vertex[sector];
+
+	// Relative on-times of the two vertices of the sector in Q30. 1239850262
+	// is TWO_BY_SQRT3 in Q30.
+	int64_t t1 = (((int64_t)a * v2[1] - (int64_t)b * v2[0]) >> 32) * 1239850262 >> 30;
+	int64_t t2 = (((int64_t)v1[0] * b - (int64_t)v1[1] * a) >> 32) * 1239850262 >> 30;
+	if (t1 < 0) {
+		t1 = 0;
+	}
+	if (t2 < 0) {
+		t2 = 0;
+	}
+
+	const int64_t t_sum = t1 + t2;
+	if (t_sum <= (1 << 30)) {
+		return;
+	}
+
+	t2 = (t2 << 30) / t_sum;
+	t1 = (1 << 30) - t2;
+
+	// Stay a little inside the hexagon, as in overmodulate()
+	*alpha = Q31_MUL(q31_sat((t1 * v1[0] + t2 * v2[0]) >> 30), Q31_OVERMOD_EDGE);
+	*beta = Q31_MUL(q31_sat((t1 * v1[1] + t2 * v2[1]) >> 30), Q31_OVERMOD_EDGE);
+}
+#endif
+
+/**
+ * Keep the low side on long enough around the current sample when the zero
+ * vector gets short during overmodulation or is moved away by DPWM. With three shunts the phase with
+ * the highest duty cycle is calculated from the other two, so only those two
+ * are limited, unless foc_sample_high_current picks the phases by current.
+ * Inline phase shunts measure all the time and need no window.
+ *
+ * @param c
+ * The constant block to use.
+ *
+ * @param top
+ * The timer top value.
+ *
+ * @param duty1
+ * Timer compare value of phase 1.
+ *
+ * @param duty2
+ * Timer compare value of phase 2.
+ *
+ * @param duty3
+ * Timer compare value of phase 3.
+ */
+static void sample_window_guard(const foc_const_t *c, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3) {
+#ifdef HW_HAS_PHASE_SHUNTS
+	(void)c;
+	(void)top;
+	(void)duty1;
+	(void)duty2;
+	(void)duty3;
+#else
+	const uint32_t duty_max = top > c->sample_win ? top - c->sample_win : 0;
+
+#ifdef HW_HAS_3_SHUNTS
+	uint32_t *highest = duty1;
+	if (*duty2 > *highest) {
+		highest = duty2;
+	}
+	if (*duty3 > *highest) {
+		highest = duty3;
+	}
+	if (m_conf->foc_sample_high_current) {
+		highest = 0;
+	}
+
+	if (duty1 != highest && *duty1 > duty_max) {
+		*duty1 = duty_max;
+	}
+	if (duty2 != highest && *duty2 > duty_max) {
+		*duty2 = duty_max;
+	}
+	if (duty3 != highest && *duty3 > duty_max) {
+		*duty3 = duty_max;
+	}
+#else
+	if (*duty1 > duty_max) {
+		*duty1 = duty_max;
+	}
+	if (*duty2 > duty_max) {
+		*duty2 = duty_max;
+	}
+	if (*duty3 > duty_max) {
+		*duty3 = duty_max;
+	}
+#endif
+#endif
+}
+
+/**
+ * Discontinuous PWM. Moves all of the zero vector time to one of the two zero
+ * vectors, so that one phase stays clamped to a rail for the whole period and
+ * does not switch. The line voltages do not change.
+ *
+ * FOC_DPWM_MIN clamps the lowest phase low, which also keeps the low side
+ * shunts sampled. FOC_DPWM_MAX clamps the highest phase high and FOC_DPWM_1
+ * clamps the phase that is furthest from the middle, which spreads the
+ * conduction losses over the high and low side. Below foc_dpwm_mod_min the
+ * zero vectors stay centered, as the current ripple of DPWM is larger there.
+ *
+ * @param c
+ * The constant block to use.
+ *
+ * @param mod_sq
+ * The squared magnitude of the applied modulation vector.
+ *
+ * @param top
+ * The timer top value.
+ *
+ * @param duty1
+ * Timer compare value of phase 1.
+ *
+ * @param duty2
+ * Timer compare value of phase 2.
+ *
+ * @param duty3
+ * Timer compare value of phase 3.
+ *
+ * @return
+ * True if a phase was clamped.
+ */
+static bool dpwm_apply(const foc_const_t *c, float mod_sq, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3) {
+	if (c->dpwm_mode == FOC_DPWM_DISABLED) {
+		m_dpwm_on = false;
+		return false;
+	}
+
+	if (mod_sq > c->dpwm_mod_on_sq) {
+		m_dpwm_on = true;
+	} else if (mod_sq < c->dpwm_mod_off_sq) {
+		m_dpwm_on = false;
+	}
+
+	if (!m_dpwm_on) {
+		return false;
+	}
+
+	const uint32_t d_max = *duty1 > *duty2 ? (*duty1 > *duty3 ? *duty1 : *duty3) : (*duty2 > *duty3 ? *duty2 : *duty3);
+	const uint32_t d_min = *duty1 < *duty2 ? (*duty1 < *duty3 ? *duty1 : *duty3) : (*duty2 < *duty3 ? *duty2 : *duty3);
+
+	bool clamp_high;
+	switch (c->dpwm_mode) {
+	case FOC_DPWM_MAX:
+		clamp_high = true;
+		break;
+	case FOC_DPWM_1:
+		clamp_high = (int32_t)(d_max - top / 2) > (int32_t)(top / 2 - d_min);
+		break;
+	default:
+		clamp_high = false;
+		break;
+	}
+
+	if (clamp_high) {
+		const uint32_t shift = top - d_max;
+		*duty1 += shift;
+		*duty2 += shift;
+		*duty3 += shift;
+	} else {
+		*duty1 -= d_min;
+		*duty2 -= d_min;
+		*duty3 -= d_min;
+	}
+
+	return true;
+}
 
-// Magnitude must not be larger than sqrt(3)/2, or 0.866
+// Must be inside the hexagon, which vectors up to sqrt(3)/2, or 0.866, always
+// are. overmodulate() maps larger vectors onto it.
 static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
 		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector) {
+#if MCPWM_FOC_SVM_IMPL == MCPWM_FOC_SVM_IFTREE
 	uint32_t sector;
 
 	if (beta >= 0.0f) {
@@ -2381,6 +4162,71 @@ static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
 	}
 	}
 
+#else
+	// The signs of beta, sqrt(3) * alpha - beta and -sqrt(3) * alpha - beta
+	// identify the sector without branches.
+	static const uint8_t sector_table[8] = {1, 2, 6, 1, 4, 3, 5, 1};
+	const uint32_t sector = sector_table[
+			(beta > 0.0) |
+			((SQRT3_BY_2 * alpha - 0.5 * beta > 0.0) << 1) |
+			((-SQRT3_BY_2 * alpha - 0.5 * beta > 0.0) << 2)];
+
+#if MCPWM_FOC_SVM_IMPL == MCPWM_FOC_SVM_TABLE
+	// Per sector: the coefficients of the first and second active vector on-time
+	// and the phases in order of increasing compare value.
+	typedef struct {
+		float first_alpha;
+		float first_beta;
+		float second_alpha;
+		float second_beta;
+		uint8_t order[3];
+	} svm_sector_coeffs_t;
+
+	static const svm_sector_coeffs_t coeffs[7] = {
+			{0.0, 0.0, 0.0, 0.0, {0, 1, 2}},
+			{1.0, -ONE_BY_SQRT3, 0.0, TWO_BY_SQRT3, {0, 1, 2}},
+			{-1.0, ONE_BY_SQRT3, 1.0, ONE_BY_SQRT3, {1, 0, 2}},
+			{0.0, TWO_BY_SQRT3, -1.0, -ONE_BY_SQRT3, {1, 2, 0}},
+			{0.0, -TWO_BY_SQRT3, -1.0, ONE_BY_SQRT3, {2, 1, 0}},
+			{-1.0, -ONE_BY_SQRT3, 1.0, -ONE_BY_SQRT3, {2, 0, 1}},
+			{1.0, ONE_BY_SQRT3, 0.0, -TWO_BY_SQRT3, {0, 2, 1}}
+	};
+
+	const svm_sector_coeffs_t *c = &coeffs[sector];
+
+	// Vector on-times
+	const uint32_t t_first = (c->first_alpha * alpha + c->first_beta * beta) * PWMHalfPeriod;
+	const uint32_t t_second = (c->second_alpha * alpha + c->second_beta * beta) * PWMHalfPeriod;
+
+	// PWM timings
+	uint32_t t[3];
+	t[c->order[0]] = (PWMHalfPeriod - t_first - t_second) / 2;
+	t[c->order[1]] = t[c->order[0]] + t_first;
+	t[c->order[2]] = t[c->order[1]] + t_second;
+
+	const uint32_t tA = t[0];
+	const uint32_t tB = t[1];
+	const uint32_t tC = t[2];
+#else
+	// Min/max zero sequence injection. Centering the largest and the smallest
+	// phase voltage gives the same timings as the sector based calculation.
+	const float va = alpha;
+	const float vb = -0.5 * alpha + SQRT3_BY_2 * beta;
+	const float vc = -0.5 * alpha - SQRT3_BY_2 * beta;
+
+	const float v_max = va > vb ? (va > vc ? va : vc) : (vb > vc ? vb : vc);
+	const float v_min = va < vb ? (va < vc ? va : vc) : (vb < vc ? vb : vc);
+	const float v_mid = 0.5 * (v_max + v_min);
+	const float half_period = 0.5 * (float)PWMHalfPeriod;
+	const float scale = (2.0 / 3.0) * (float)PWMHalfPeriod;
+
+	// PWM timings
+	const uint32_t tA = half_period - (va - v_mid) * scale;
+	const uint32_t tB = half_period - (vb - v_mid) * scale;
+	const uint32_t tC = half_period - (vc - v_mid) * scale;
+#endif
+#endif
+
 	*tAout = tA;
 	*tBout = tB;
 	*tCout = tC;
@@ -2544,6 +4390,10 @@ static void start_pwm_hw(void) {
 }
 
 static int read_hall(void) {
+	if (encoder_hall_capture_active()) {
+		return encoder_hall_read();
+	}
+
 	int h1_1 = READ_HALL1();
 	int h2_1 = READ_HALL2();
 	int h3_1 = READ_HALL3();
@@ -2603,6 +4453,7 @@ static float correct_hall(float angle, float speed, float dt) {
 		// Only override the observer if the hall sensor value is valid.
 		if (ang_hall_int < 201) {
 			static float ang_hall = 0.0;
+			bool edge_timed = false;
 			float ang_hall_now = (((float)ang_hall_int / 200.0) * 360.0) * M_PI / 180.0;
 
 			if (ang_hall_int_prev < 0) {
@@ -2626,6 +4477,16 @@ static float correct_hall(float angle, float speed, float dt) {
 				}
 				ang_avg %= 200;
 				ang_hall = (((float)ang_avg / 200.0) * 360.0) * M_PI / 180.0;
+
+				// With captured edges the time since the transition is known, so
+				// the angle can be moved from the edge directly.
+				if (encoder_hall_capture_active()) {
+					float age = encoder_hall_edge_age();
+					if (age >= 0.0) {
+						ang_hall += speed * age;
+						edge_timed = true;
+					}
+				}
 			}
 
 			ang_hall_int_prev = ang_hall_int;
@@ -2633,7 +4494,7 @@ static float correct_hall(float angle, float speed, float dt) {
 			if (rpm_abs < 100) {
 				// Don't interpolate on very low speed, just use the closest hall sensor
 				ang_hall = ang_hall_now;
-			} else {
+			} else if (!edge_timed) {
 				// Interpolate
 				float diff = utils_angle_difference_rad(ang_hall, ang_hall_now);
 				if (fabsf(diff) < ((2.0 * M_PI) / 12.0)) {
@@ -65,10 +65,17 @@ float mcpwm_foc_get_phase_observer(void);
 float mcpwm_foc_get_phase_encoder(void);
 float mcpwm_foc_get_vd(void);
 float mcpwm_foc_get_vq(void);
+float mcpwm_foc_get_est_res(void);
+float mcpwm_foc_get_est_flux_linkage(void);
+float mcpwm_foc_get_est_temp(void);
+uint32_t mcpwm_foc_get_est_samples(void);
 void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *ratio, bool *inverted);
 float mcpwm_foc_measure_resistance(float current, int samples);
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr);
-bool mcpwm_foc_measure_res_ind(float *res, float *ind);
+float mcpwm_foc_measure_inductance_dq(float duty, int samples, float *curr, float *ld, float *lq);
+bool mcpwm_foc_measure_res_ind(float *res, float *ind, float *ld_lq_diff);
+bool mcpwm_foc_calc_current_gains(float bw, float res, float ind,
+		float *kp, float *ki, float *phase_margin);
 bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table);
 void mcpwm_foc_print_state(void);
 float mcpwm_foc_get_last_inj_adc_isr_duration(void);
@@ -82,5 +89,30 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
 #define MCPWM_FOC_INDUCTANCE_SAMPLE_RISE_COMP		50 // Current rise time compensation
 #define MCPWM_FOC_I_FILTER_CONST					0.1 // Filter constant for the current filters
 #define MCPWM_FOC_CURRENT_SAMP_OFFSET				(2) // Offset from timer top for injected ADC samples
+#define MCPWM_FOC_CC_MIN_PHASE_MARGIN				45.0 // Minimum phase margin in degrees for calculated current controller gains
+#define MCPWM_FOC_SAMPLE_WINDOW_TIME				2e-6 // Minimum low side on time for current sampling with overmodulation or DPWM
+#define MCPWM_FOC_F_SW_SCHED_STEP					500.0 // Largest switching frequency change per scheduler step (10 ms)
+#define MCPWM_FOC_F_SW_SCHED_HYST					250.0 // Smallest switching frequency change of the scheduler
+#define MCPWM_FOC_F_SW_SCHED_MIN_SAMPLES			12 // Minimum current samples per electrical revolution with the scheduler
+
+// SVM implementation
+#define MCPWM_FOC_SVM_IFTREE						0 // Sector from nested comparisons, timings from a switch
+#define MCPWM_FOC_SVM_TABLE							1 // Sector from sign bits, timings from a per sector coefficient table
+#define MCPWM_FOC_SVM_MINMAX						2 // Min/max zero sequence injection
+#ifndef MCPWM_FOC_SVM_IMPL
+#define MCPWM_FOC_SVM_IMPL							MCPWM_FOC_SVM_TABLE
+#endif
+
+// Compute the bus voltage derived quantities once per control cycle. With 0 they are
+// computed again on every use, to measure what the cache saves.
+#ifndef MCPWM_FOC_ISR_CACHE
+#define MCPWM_FOC_ISR_CACHE							1
+#endif
+
+// Run the current loop (Park transform, PI, saturation, deadtime compensation and
+// SVM) in Q31 fixed point instead of float
+#ifndef MCPWM_FOC_CURRENT_LOOP_Q31
+#define MCPWM_FOC_CURRENT_LOOP_Q31					0
+#endif
 
 #endif /* MCPWM_FOC_H_ */
@@ -0,0 +1,75 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Host simulator replacement for the ChibiOS kernel API used by the motor
+ * control code. Threads are pthreads that sleep in simulated time, and the
+ * system lock masks the simulated interrupts. See sim/sim_os.c.
+ */
+
+#ifndef CH_H_
+#define CH_H_
+
+#include "chtypes.h"
+#include "chsystypes.h"
+
+// Configuration
+#define CH_CFG_ST_FREQUENCY		10000
+#define NORMALPRIO				128
+#define LOWPRIO					2
+#define HIGHPRIO				255
+
+// Time conversion
+#define S2ST(sec)				((systime_t)((uint32_t)(sec) * (uint32_t)CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)				((systime_t)((((uint32_t)(msec)) * ((uint32_t)CH_CFG_ST_FREQUENCY) - 1UL) / 1000UL + 1UL))
+#define US2ST(usec)				((systime_t)((((uint32_t)(usec)) * ((uint32_t)CH_CFG_ST_FREQUENCY) - 1UL) / 1000000UL + 1UL))
+#define ST2MS(n)				(((n) * 1000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+#define ST2US(n)				(((n) * 1000000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+
+// Threads
+#define THD_WORKING_AREA(s, n)	stkalign_t s[((n) + sizeof(stkalign_t) - 1) / sizeof(stkalign_t)]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+#define CH_IRQ_HANDLER(id)		void id(void)
+#define CH_IRQ_PROLOGUE()
+#define CH_IRQ_EPILOGUE()
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+void chThdSleep(systime_t time);
+void chThdSleepMilliseconds(uint32_t msec);
+void chThdSleepMicroseconds(uint32_t usec);
+#define chRegSetThreadName(name)	(void)(name)
+
+// System lock
+void chSysLock(void);
+void chSysUnlock(void);
+#define chSysLockFromISR()		chSysLock()
+#define chSysUnlockFromISR()	chSysUnlock()
+
+// Mutexes
+void chMtxObjectInit(mutex_t *mp);
+void chMtxLock(mutex_t *mp);
+void chMtxUnlock(mutex_t *mp);
+
+// System time
+systime_t chVTGetSystemTime(void);
+#define chVTGetSystemTimeX()	chVTGetSystemTime()
+#define chVTTimeElapsedSinceX(start)	(chVTGetSystemTime() - (start))
+
+#endif /* CH_H_ */
@@ -0,0 +1,38 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Host simulator replacement for the ChibiOS system types.
+ */
+
+#ifndef CHSYSTYPES_H_
+#define CHSYSTYPES_H_
+
+#include "chtypes.h"
+#include <stdbool.h>
+
+typedef struct sim_thread thread_t;
+typedef void (*tfunc_t)(void *p);
+
+typedef struct {
+	void *impl; // pthread mutex, created by chMtxObjectInit
+	volatile bool locked; // For checks from the interrupt
+} mutex_t;
+
+#endif /* CHSYSTYPES_H_ */
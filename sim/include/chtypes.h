@@ -0,0 +1,38 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Host simulator replacement for the ChibiOS port types.
+ */
+
+#ifndef CHTYPES_H_
+#define CHTYPES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef bool			bool_t;
+typedef uint32_t		systime_t;
+typedef int32_t			msg_t;
+typedef uint32_t		tprio_t;
+typedef uint32_t		eventmask_t;
+typedef uint64_t		stkalign_t;
+
+#endif /* CHTYPES_H_ */
@@ -0,0 +1,69 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Host simulator replacement for the ChibiOS HAL. The pads are routed to the
+ * simulator so that the gate, the DC calibration switch and the hall sensors
+ * work, the DMA and NVIC calls only register the interrupt handlers.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include "ch.h"
+#include "stm32f4xx.h"
+
+// PAL
+#define PAL_MODE_INPUT				0
+#define PAL_MODE_INPUT_PULLUP		0
+#define PAL_MODE_OUTPUT_PUSHPULL	0
+#define PAL_MODE_INPUT_ANALOG		0
+#define PAL_MODE_ALTERNATE(n)		0
+
+void sim_pal_write(GPIO_TypeDef *port, int pad, int value);
+int sim_pal_read(GPIO_TypeDef *port, int pad);
+
+#define palSetPad(port, pad)		sim_pal_write((port), (pad), 1)
+#define palClearPad(port, pad)		sim_pal_write((port), (pad), 0)
+#define palWritePad(port, pad, v)	sim_pal_write((port), (pad), (v))
+#define palTogglePad(port, pad)		sim_pal_write((port), (pad), !sim_pal_read((port), (pad)))
+#define palReadPad(port, pad)		sim_pal_read((port), (pad))
+#define palSetPadMode(port, pad, mode)	(void)(mode)
+
+// DMA
+typedef void (*stm32_dmaisr_t)(void *p, uint32_t flags);
+typedef struct {
+	int id;
+} stm32_dma_stream_t;
+
+extern const stm32_dma_stream_t _stm32_dma_streams[16];
+
+#define STM32_DMA_STREAM_ID(dma, stream)	((((dma) - 1) * 8) + (stream))
+#define STM32_DMA_STREAM(id)				(&_stm32_dma_streams[id])
+
+bool dmaStreamAllocate(const stm32_dma_stream_t *dmastp, uint32_t priority,
+		stm32_dmaisr_t func, void *param);
+void dmaStreamRelease(const stm32_dma_stream_t *dmastp);
+
+// NVIC
+void nvicEnableVector(IRQn_Type n, uint32_t prio);
+void nvicDisableVector(IRQn_Type n);
+
+#endif /* HAL_H_ */
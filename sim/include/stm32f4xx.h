@@ -0,0 +1,56 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Device header for the host simulator. The CMSIS definitions are used as
+ * they are, except that the peripherals the control interrupt accesses
+ * directly are moved to host memory owned by sim/sim_os.c. The DWT cycle
+ * counter that isr_prof uses counts host nanoseconds.
+ */
+
+#ifndef SIM_STM32F4XX_H_
+#define SIM_STM32F4XX_H_
+
+#include "../../ChibiOS_3.0.2/os/ext/CMSIS/ST/stm32f4xx.h"
+
+extern TIM_TypeDef sim_tim1;
+extern TIM_TypeDef sim_tim2;
+extern TIM_TypeDef sim_tim8;
+extern TIM_TypeDef sim_tim12;
+extern ADC_Common_TypeDef sim_adc_common;
+extern CoreDebug_Type sim_core_debug;
+DWT_Type *sim_dwt(void);
+
+#undef TIM1
+#undef TIM2
+#undef TIM8
+#undef TIM12
+#undef ADC
+#undef DWT
+#undef CoreDebug
+#define TIM1		(&sim_tim1)
+#define TIM2		(&sim_tim2)
+#define TIM8		(&sim_tim8)
+#define TIM12		(&sim_tim12)
+#define ADC			(&sim_adc_common)
+#define DWT			(sim_dwt())
+#define CoreDebug	(&sim_core_debug)
+
+#endif /* SIM_STM32F4XX_H_ */
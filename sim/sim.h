@@ -0,0 +1,143 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Motor and inverter model. The motor is a PMSM in the rotor (dq) frame with
+ * the amplitude invariant transform, which is what the observer and the
+ * current controller assume. The parameters relate to mc_configuration as
+ *
+ * r = (3 / 2) * foc_motor_r
+ * ld = (3 / 2) * (foc_motor_l - foc_motor_ld_lq_diff / 2)
+ * lq = (3 / 2) * (foc_motor_l + foc_motor_ld_lq_diff / 2)
+ * lambda = foc_motor_flux_linkage
+ *
+ * With ld_sat the iron saturates along the magnet flux: the incremental d axis
+ * inductance falls by the fraction ld_sat per ampere of d axis current, so
+ * that positive id, which adds to the magnet flux, gives a faster current
+ * change. The flux and the torque keep the unsaturated ld, which is enough for
+ * the small signal response that HFI uses.
+ *
+ * sim_plant_run drives the motor from the bridge legs instead, for six-step
+ * commutation, where one phase floats and its current decays through the
+ * body diodes after a commutation. It integrates the phase currents with the
+ * mean of ld and lq and without saturation, and leaves the floating phase
+ * at its back EMF in v_term, which is what the zero crossing detection sees.
+ */
+typedef struct {
+	// Motor
+	float r;
+	float ld;
+	float lq;
+	float lambda;
+	float ld_sat; // Incremental ld change per ampere of id, 1 / A
+	float pole_pairs;
+	float j; // Rotor and load inertia, kg m^2
+	float b; // Viscous friction, Nm / (rad / s)
+	float load; // Load torque opposing the rotation, Nm
+	bool speed_fixed; // Hold the speed, like a dyno would
+	float w_accel; // Speed ramp of the dyno, electrical rad / s^2
+	// Inverter and sensing
+	float v_bus;
+	float dead_time; // s
+	float i_noise; // Current sample noise, ADC counts rms
+	int curr_offset[2]; // Current sense amplifier offsets, ADC counts
+	bool avg; // Average the voltages over each half period instead of switching
+	// State
+	float id;
+	float iq;
+	float w; // Electrical speed, rad / s
+	float th; // Electrical angle, rad
+	float v_term[3]; // Average terminal voltages over the last half period, or at the end of sim_plant_run
+	float iq_min; // Range of iq since the last reset, for the ripple
+	float iq_max;
+} sim_plant_t;
+
+typedef enum {
+	SIM_LEG_OFF = 0,
+	SIM_LEG_LOW,
+	SIM_LEG_HIGH
+} sim_leg_t;
+
+void sim_plant_half(sim_plant_t *p, const float on[3], bool on_at_end,
+		float t_half, bool driven);
+void sim_plant_run(sim_plant_t *p, const sim_leg_t leg[3], float t);
+void sim_plant_phase_currents(const sim_plant_t *p, float *ia, float *ib, float *ic);
+float sim_plant_torque(const sim_plant_t *p);
+
+// Firmware interrupt handlers, set next to the firmware that is simulated
+typedef struct {
+	void (*tim8_cc1)(void);
+	void (*adc_inj)(void);
+	void (*tim2_cc1)(void);
+} sim_vectors_t;
+
+extern const sim_vectors_t sim_vectors;
+
+// Simulated hardware (sim_os.c)
+extern sim_plant_t sim_plant;
+void sim_os_start(void);
+void sim_os_stop(void);
+double sim_time(void);
+uint64_t sim_isr_calls(void);
+uint64_t sim_isr_preempt_calls(void);
+double sim_isr_ns(void);
+void sim_set_hall_angle_offset(float offset);
+int sim_hall_code(float th);
+extern void (*sim_isr_hook)(void);
+extern void (*sim_com_hook)(void);
+
+// Checks of the private mcpwm_foc.c state (sim_foc.c)
+void sim_foc_const_save(int ref);
+int sim_foc_const_match(void);
+bool sim_foc_const_updating(void);
+void sim_foc_const_write_in_place(int ref);
+
+// Private mcpwm.c state (sim_bldc.c)
+int32_t sim_bldc_speed_pid_ticks(void);
+
+// Arguments of the simulator programs (sim_param.c)
+typedef enum {
+	PARAM_FLOAT = 0,
+	PARAM_INT,
+	PARAM_BOOL
+} param_type;
+
+typedef struct {
+	const char *name;
+	param_type type;
+	size_t offset;
+} param_t;
+
+bool sim_set_param(const param_t *params, int len, void *base,
+		const char *name, const char *value);
+void sim_print_params(const param_t *params, int len, const void *base);
+
+// Firmware stubs (sim_fw.c)
+extern bool sim_fw_print;
+extern float sim_temp_fet;
+
+#endif /* SIM_H_ */
@@ -0,0 +1,42 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * mcpwm.c for the simulator, built unmodified, the interrupt handlers of it
+ * that sim_os.c runs and accessors for its private state.
+ */
+
+#include "../mcpwm.c"
+#include "sim.h"
+
+// Interrupt handlers
+const sim_vectors_t sim_vectors = {
+		0, mcpwm_adc_inj_int_handler, mcpwm_comm_int_handler
+};
+
+/**
+ * @return
+ * RPM timer ticks of speed samples that the speed controller has not used
+ * yet. Zero right after the controller ran from the commutation path and
+ * negative after it ran from the timer thread.
+ */
+int32_t sim_bldc_speed_pid_ticks(void) {
+	return speed_pid_ticks;
+}
@@ -0,0 +1,551 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Closed loop test of the BLDC control path of mcpwm.c on the host, the
+ * counterpart of sim_main.c for mcpwm_foc.c. The plant is driven from the
+ * TIM1 outputs, with the floating phase and the body diodes modeled, and
+ * the back EMF is sampled on the phase voltage channels like on the MCU.
+ *
+ * Every commutation is checked against the rotor angle where it should
+ * happen, which is 30 degrees before the rotor reaches the center of the
+ * step. The spread of that error and of the time between commutations at a
+ * constant speed is the commutation jitter of the sensorless modes.
+ *
+ * The speed controller runs when the commutations have brought a new speed.
+ * Its latency is the time from the commutation that completed the speed
+ * sample to the run of the controller. For comparison, the time until the
+ * next millisecond, when a 1 kHz thread polling the speed would see the same
+ * commutation, is printed too. With step_time in speed mode the settling
+ * time of the speed is printed as well.
+ *
+ * The torque of the plant is sampled once per control interrupt after the
+ * settling time, and its ripple is printed as the standard deviation relative
+ * to the mean. That compares the six-step drive with the hall interpolated
+ * sine drive, pwm_mode 3, at low speed with hall sensors.
+ *
+ * The delay modes only commutate on time once they know the speed, so they
+ * can not pick up a spinning rotor. With comm_mode_run the motor starts in
+ * comm_mode and switches to comm_mode_run before the statistics start.
+ *
+ * Arguments are name=value pairs like for foc_sim. The plant uses the FOC
+ * motor parameters of the configuration unless told otherwise, and the hall
+ * sensors are placed so that the transitions are at the ideal commutation
+ * angles when hall_offset is 30 degrees.
+ *
+ * Example:
+ * ./build/bldc_sim mode=2 set=0.6 start_erpm=60000 dyno=1 v_bus=48 comm_mode_run=2
+ */
+
+#include "ch.h"
+#include "conf_general.h"
+#include "hw.h"
+#include "mcpwm.h"
+#include "utils.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+
+// Settling band of the speed step response, relative to the step
+#define STEP_SETTLE_BAND		0.1
+// Period of a thread that would poll the speed instead, s
+#define PID_POLL_PERIOD			1e-3
+
+typedef enum {
+	SCENARIO_CURRENT = 0,
+	SCENARIO_SPEED,
+	SCENARIO_DUTY
+} scenario_mode;
+
+typedef struct {
+	// Scenario
+	int mode;
+	float set; // A, ERPM or duty cycle
+	float time; // Simulated time after the command, s
+	float settle; // Time after the command before the statistics start, s
+	float step_time; // Time after the command when set changes to step_set, s. 0 to disable.
+	float step_set;
+	float start_erpm; // In the forward direction
+	float trace; // Print interval, s. 0 to disable.
+	bool print;
+	int comm_mode_run; // Commutation mode to switch to halfway through settle. -1 to disable.
+	// Plant, in the units of mc_configuration
+	float motor_r;
+	float motor_l;
+	float motor_flux_linkage;
+	float poles;
+	float j;
+	float b;
+	float load;
+	bool dyno;
+	float v_bus;
+	float noise;
+	float hall_offset; // Degrees
+} sim_args_t;
+
+#define CONF_PARAM(name, type)	{#name, type, offsetof(mc_configuration, name)}
+#define SIM_PARAM(name, type)	{#name, type, offsetof(sim_args_t, name)}
+
+static const param_t conf_params[] = {
+		CONF_PARAM(pwm_mode, PARAM_INT),
+		CONF_PARAM(comm_mode, PARAM_INT),
+		CONF_PARAM(sensor_mode, PARAM_INT),
+		CONF_PARAM(l_current_max, PARAM_FLOAT),
+		CONF_PARAM(l_current_min, PARAM_FLOAT),
+		CONF_PARAM(l_min_duty, PARAM_FLOAT),
+		CONF_PARAM(l_max_duty, PARAM_FLOAT),
+		CONF_PARAM(l_max_erpm_fbrake, PARAM_FLOAT),
+		CONF_PARAM(sl_min_erpm, PARAM_FLOAT),
+		CONF_PARAM(sl_min_erpm_cycle_int_limit, PARAM_FLOAT),
+		CONF_PARAM(sl_cycle_int_limit, PARAM_FLOAT),
+		CONF_PARAM(sl_phase_advance_at_br, PARAM_FLOAT),
+		CONF_PARAM(sl_cycle_int_rpm_br, PARAM_FLOAT),
+		CONF_PARAM(sl_bemf_coupling_k, PARAM_FLOAT),
+		CONF_PARAM(hall_sl_erpm, PARAM_FLOAT),
+		CONF_PARAM(cc_gain, PARAM_FLOAT),
+		CONF_PARAM(cc_min_current, PARAM_FLOAT),
+		CONF_PARAM(m_duty_ramp_step, PARAM_FLOAT),
+		CONF_PARAM(m_bldc_f_sw_min, PARAM_FLOAT),
+		CONF_PARAM(m_bldc_f_sw_max, PARAM_FLOAT),
+		CONF_PARAM(s_pid_kp, PARAM_FLOAT),
+		CONF_PARAM(s_pid_ki, PARAM_FLOAT),
+		CONF_PARAM(s_pid_kd, PARAM_FLOAT),
+		CONF_PARAM(s_pid_min_erpm, PARAM_FLOAT),
+		CONF_PARAM(s_pid_allow_braking, PARAM_BOOL),
+};
+
+static const param_t sim_params[] = {
+		SIM_PARAM(mode, PARAM_INT),
+		SIM_PARAM(set, PARAM_FLOAT),
+		SIM_PARAM(time, PARAM_FLOAT),
+		SIM_PARAM(settle, PARAM_FLOAT),
+		SIM_PARAM(step_time, PARAM_FLOAT),
+		SIM_PARAM(step_set, PARAM_FLOAT),
+		SIM_PARAM(start_erpm, PARAM_FLOAT),
+		SIM_PARAM(trace, PARAM_FLOAT),
+		SIM_PARAM(print, PARAM_BOOL),
+		SIM_PARAM(comm_mode_run, PARAM_INT),
+		SIM_PARAM(motor_r, PARAM_FLOAT),
+		SIM_PARAM(motor_l, PARAM_FLOAT),
+		SIM_PARAM(motor_flux_linkage, PARAM_FLOAT),
+		SIM_PARAM(poles, PARAM_FLOAT),
+		SIM_PARAM(j, PARAM_FLOAT),
+		SIM_PARAM(b, PARAM_FLOAT),
+		SIM_PARAM(load, PARAM_FLOAT),
+		SIM_PARAM(dyno, PARAM_BOOL),
+		SIM_PARAM(v_bus, PARAM_FLOAT),
+		SIM_PARAM(noise, PARAM_FLOAT),
+		SIM_PARAM(hall_offset, PARAM_FLOAT),
+};
+
+static const char *mode_names[] = {"current", "speed", "duty"};
+
+// Commutation steps forwards, as the bridge channels that are high and low
+static const int step_channels[6][2] = {{2, 3}, {1, 3}, {1, 2}, {3, 2}, {3, 1}, {2, 1}};
+
+// Private variables
+static mc_configuration m_conf;
+static sim_args_t m_args;
+static double m_stat_start;
+static double m_step_start;
+static volatile float m_set; // The command in effect, set or step_set
+static float m_step_angle[6]; // Angle of the voltage vector of every step, rad
+static float m_dir; // Sign of the plant speed in the forward direction
+
+// Statistics, updated from the interrupt thread
+static int m_comm_step_last;
+static double m_comm_t_last;
+static uint64_t m_comm_n;
+static uint64_t m_comm_irregular;
+static double m_comm_dt_sum;
+static double m_comm_dt_sq_sum;
+static double m_comm_err_sum;
+static double m_comm_err_sq_sum;
+static double m_comm_err_max;
+static int32_t m_pid_ticks_last;
+static double m_pid_comm_t; // Commutation that completed the last speed sample
+static uint64_t m_pid_n;
+static uint64_t m_pid_idle_n;
+static double m_pid_latency_sum;
+static double m_pid_latency_max;
+static double m_pid_poll_sum;
+static double m_step_settle;
+static uint64_t m_torque_n;
+static double m_torque_sum;
+static double m_torque_sq_sum;
+
+static void usage(const char *name) {
+	printf("Usage: %s [name=value]...\n\n", name);
+	printf("Scenario and plant (mode: 0 current, 1 speed, 2 duty):\n");
+	sim_print_params(sim_params, sizeof(sim_params) / sizeof(sim_params[0]), &m_args);
+	printf("mc_configuration:\n");
+	sim_print_params(conf_params, sizeof(conf_params) / sizeof(conf_params[0]), &m_conf);
+}
+
+/*
+ * Angle of the voltage vector of every commutation step in the plant frame,
+ * with the bridge channels mapped to the plant phases like in sim_os.c, and
+ * the direction of the plant that the forward steps turn it in.
+ */
+static void make_step_angles(void) {
+#ifdef HW_HAS_3_SHUNTS
+	const int ch_phase[3] = {0, 1, 2};
+#else
+	const int ch_phase[3] = {0, 2, 1};
+#endif
+
+	for (int k = 0;k < 6;k++) {
+		const int pos = ch_phase[step_channels[k][0] - 1];
+		const int neg = ch_phase[step_channels[k][1] - 1];
+		const float x = cosf((float)pos * (2.0 * M_PI / 3.0)) - cosf((float)neg * (2.0 * M_PI / 3.0));
+		const float y = sinf((float)pos * (2.0 * M_PI / 3.0)) - sinf((float)neg * (2.0 * M_PI / 3.0));
+		m_step_angle[k] = atan2f(y, x);
+	}
+
+	float diff = m_step_angle[1] - m_step_angle[0];
+	utils_norm_angle_rad(&diff);
+	m_dir = diff > 0.0 ? 1.0 : -1.0;
+}
+
+/*
+ * Difference between the rotor angle and the ideal commutation angle of a
+ * step, in degrees and positive when the commutation is late.
+ */
+static float comm_angle_error(int step, float th) {
+	float err = th - (m_step_angle[step - 1] - m_dir * (2.0 * M_PI / 3.0));
+	utils_norm_angle_rad(&err);
+	return m_dir * err * (180.0 / M_PI);
+}
+
+/*
+ * Hall table for the sensors of the simulator: every code gets the step
+ * whose voltage vector is closest to 90 degrees ahead of the center of the
+ * code.
+ */
+static void make_hall_table(int8_t *table) {
+	float s[8] = {0.0}, c[8] = {0.0};
+
+	for (int i = 0;i < 720;i++) {
+		const float th = (float)i * (M_PI / 360.0);
+		const int code = sim_hall_code(th);
+		s[code] += sinf(th);
+		c[code] += cosf(th);
+	}
+
+	for (int i = 0;i < 8;i++) {
+		table[i] = -1;
+		if (s[i] == 0.0 && c[i] == 0.0) {
+			continue;
+		}
+
+		const float target = atan2f(s[i], c[i]) + m_dir * (M_PI / 2.0);
+		float err_best = 2.0 * M_PI;
+		for (int k = 0;k < 6;k++) {
+			float err = m_step_angle[k] - target;
+			utils_norm_angle_rad(&err);
+			if (fabsf(err) < err_best) {
+				err_best = fabsf(err);
+				table[i] = k + 1;
+			}
+		}
+	}
+}
+
+static void com_hook(void) {
+	const int step = mcpwm_get_comm_step();
+	const double t = sim_time();
+
+	// New speed samples for the speed controller
+	const int32_t pid_ticks = sim_bldc_speed_pid_ticks();
+	if (pid_ticks > m_pid_ticks_last) {
+		m_pid_comm_t = t;
+	}
+	m_pid_ticks_last = pid_ticks;
+
+	if (step == m_comm_step_last) {
+		return;
+	}
+
+	const int step_last = m_comm_step_last;
+	const double dt = t - m_comm_t_last;
+	m_comm_step_last = step;
+	m_comm_t_last = t;
+
+	if (t < m_stat_start || step_last == 0 || mcpwm_get_state() != MC_STATE_RUNNING) {
+		return;
+	}
+
+	if (step != step_last % 6 + 1) {
+		m_comm_irregular++;
+		return;
+	}
+
+	m_comm_n++;
+	m_comm_dt_sum += dt;
+	m_comm_dt_sq_sum += SQ(dt);
+
+	const float err = comm_angle_error(step, sim_plant.th);
+	m_comm_err_sum += err;
+	m_comm_err_sq_sum += SQ(err);
+	if (fabsf(err) > m_comm_err_max) {
+		m_comm_err_max = fabsf(err);
+	}
+}
+
+/*
+ * Torque of the plant, and runs of the speed controller, seen from the
+ * samples it used up. In the control interrupt they go to zero, in the timer
+ * thread negative.
+ */
+static void isr_hook(void) {
+	const double t = sim_time();
+	const int32_t pid_ticks = sim_bldc_speed_pid_ticks();
+	const int32_t pid_ticks_last = m_pid_ticks_last;
+	m_pid_ticks_last = pid_ticks;
+
+	if (m_args.step_time > 0.0 && m_args.mode == SCENARIO_SPEED && t >= m_step_start) {
+		const float step = m_args.step_set - m_args.set;
+		const float rpm_plant = m_dir * sim_plant.w / ((2.0 * M_PI) / 60.0);
+		if (fabsf(rpm_plant - m_args.step_set) > STEP_SETTLE_BAND * fabsf(step)) {
+			m_step_settle = t - m_step_start;
+		}
+	}
+
+	if (t < m_stat_start) {
+		return;
+	}
+
+	const double torque = sim_plant_torque(&sim_plant);
+	m_torque_n++;
+	m_torque_sum += torque;
+	m_torque_sq_sum += SQ(torque);
+
+	if (m_args.mode != SCENARIO_SPEED) {
+		return;
+	}
+
+	if (pid_ticks == 0 && pid_ticks_last > 0) {
+		const double latency = t - m_pid_comm_t;
+		m_pid_n++;
+		m_pid_latency_sum += latency;
+		if (latency > m_pid_latency_max) {
+			m_pid_latency_max = latency;
+		}
+		m_pid_poll_sum += ceil(m_pid_comm_t / PID_POLL_PERIOD) * PID_POLL_PERIOD - m_pid_comm_t;
+	} else if (pid_ticks < 0 && pid_ticks_last >= 0) {
+		m_pid_idle_n++;
+	}
+}
+
+static void command(void) {
+	if (m_args.step_time > 0.0 && sim_time() >= m_step_start) {
+		m_set = m_args.step_set;
+	}
+
+	switch (m_args.mode) {
+	case SCENARIO_CURRENT: mcpwm_set_current(m_set); break;
+	case SCENARIO_SPEED: mcpwm_set_pid_speed(m_set); break;
+	case SCENARIO_DUTY: mcpwm_set_duty(m_set); break;
+	default: break;
+	}
+}
+
+int main(int argc, char **argv) {
+	conf_general_get_default_mc_configuration(&m_conf);
+	m_conf.motor_type = MOTOR_TYPE_BLDC;
+
+	m_args.mode = SCENARIO_DUTY;
+	m_args.set = 0.3;
+	m_args.time = 0.5;
+	m_args.settle = 0.1;
+	m_args.poles = 14.0;
+	m_args.j = 1e-4;
+	m_args.b = 1e-5;
+	m_args.v_bus = 24.0;
+	m_args.noise = 1.0;
+	m_args.hall_offset = 30.0;
+	m_args.comm_mode_run = -1;
+	m_args.motor_r = -1.0;
+	m_args.motor_l = -1.0;
+	m_args.motor_flux_linkage = -1.0;
+
+	for (int i = 1;i < argc;i++) {
+		char name[64];
+		const char *eq = strchr(argv[i], '=');
+		if (!eq || (size_t)(eq - argv[i]) >= sizeof(name)) {
+			usage(argv[0]);
+			return strcmp(argv[i], "help") == 0 ? 0 : 1;
+		}
+
+		memcpy(name, argv[i], eq - argv[i]);
+		name[eq - argv[i]] = '\0';
+
+		if (!sim_set_param(conf_params, sizeof(conf_params) / sizeof(conf_params[0]), &m_conf, name, eq + 1) &&
+				!sim_set_param(sim_params, sizeof(sim_params) / sizeof(sim_params[0]), &m_args, name, eq + 1)) {
+			fprintf(stderr, "Unknown parameter: %s\n", name);
+			return 1;
+		}
+	}
+
+	// The plant uses the configured motor unless told otherwise
+	if (m_args.motor_r < 0.0) {
+		m_args.motor_r = m_conf.foc_motor_r;
+	}
+	if (m_args.motor_l < 0.0) {
+		m_args.motor_l = m_conf.foc_motor_l;
+	}
+	if (m_args.motor_flux_linkage < 0.0) {
+		m_args.motor_flux_linkage = m_conf.foc_motor_flux_linkage;
+	}
+
+	// mc_interface keeps these up to date on the MCU
+	m_conf.lo_current_max = m_conf.l_current_max;
+	m_conf.lo_current_min = m_conf.l_current_min;
+	m_conf.lo_in_current_max = m_conf.l_in_current_max;
+	m_conf.lo_in_current_min = m_conf.l_in_current_min;
+	m_conf.lo_current_motor_max_now = m_conf.l_current_max;
+	m_conf.lo_current_motor_min_now = m_conf.l_current_min;
+
+	sim_plant_t *p = &sim_plant;
+	memset(p, 0, sizeof(sim_plant_t));
+	p->r = (3.0 / 2.0) * m_args.motor_r;
+	p->ld = (3.0 / 2.0) * m_args.motor_l;
+	p->lq = p->ld;
+	p->lambda = m_args.motor_flux_linkage;
+	p->pole_pairs = m_args.poles / 2.0;
+	p->j = m_args.j;
+	p->b = m_args.b;
+	p->load = m_args.load;
+	p->speed_fixed = m_args.dyno;
+	p->v_bus = m_args.v_bus;
+	p->i_noise = m_args.noise;
+
+	make_step_angles();
+	sim_set_hall_angle_offset(m_args.hall_offset * (M_PI / 180.0));
+	make_hall_table(m_conf.hall_table);
+	sim_fw_print = m_args.print;
+
+	utils_trig_init();
+	sim_os_start();
+	mcpwm_init(&m_conf);
+
+	// Spin up the rotor with the interrupt masked, as the plant runs there, and
+	// let the firmware follow it with the bridge off, so that the speed
+	// estimate has settled when the command comes
+	chSysLock();
+	p->w = m_dir * m_args.start_erpm * ((2.0 * M_PI) / 60.0);
+	chSysUnlock();
+	chThdSleepMilliseconds(50);
+
+	const double t_cmd = sim_time();
+	m_stat_start = t_cmd + m_args.settle;
+	m_step_start = t_cmd + m_args.step_time;
+	m_set = m_args.set;
+	sim_com_hook = com_hook;
+	sim_isr_hook = isr_hook;
+
+	struct timespec ts0, ts1;
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	const uint64_t isr_calls_start = sim_isr_calls();
+
+	double t_trace = t_cmd;
+	bool comm_mode_switched = false;
+	while (sim_time() < t_cmd + m_args.time) {
+		// The commands time out, so keep sending them like a remote would
+		command();
+		chThdSleepMilliseconds(1);
+
+		if (m_args.comm_mode_run >= 0 && !comm_mode_switched &&
+				sim_time() >= t_cmd + m_args.settle / 2.0) {
+			mcpwm_switch_comm_mode(m_args.comm_mode_run);
+			comm_mode_switched = true;
+		}
+
+		if (m_args.trace > 0.0 && sim_time() >= t_trace) {
+			t_trace += m_args.trace;
+			printf("t=%.4f erpm=%.0f erpm_plant=%.0f duty=%.3f current=%.2f step=%d\n",
+					sim_time() - t_cmd, (double)mcpwm_get_rpm(),
+					(double)(m_dir * p->w / ((2.0 * M_PI) / 60.0)),
+					(double)mcpwm_get_duty_cycle_now(),
+					(double)mcpwm_get_tot_current_filtered(), mcpwm_get_comm_step());
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	const double host_s = (double)(ts1.tv_sec - ts0.tv_sec) + (double)(ts1.tv_nsec - ts0.tv_nsec) * 1e-9;
+	const uint64_t isr_calls = sim_isr_calls() - isr_calls_start;
+
+	chSysLock();
+	sim_com_hook = 0;
+	sim_isr_hook = 0;
+	const sim_plant_t p_end = *p;
+	const float rpm_end = mcpwm_get_rpm();
+	const float duty_end = mcpwm_get_duty_cycle_now();
+	const float current_end = mcpwm_get_tot_current_filtered();
+	chSysUnlock();
+
+	mcpwm_stop_pwm();
+	sim_os_stop();
+
+	const double n_comm = m_comm_n > 0 ? (double)m_comm_n : 1.0;
+	const double dt_mean = m_comm_dt_sum / n_comm;
+	const double err_mean = m_comm_err_sum / n_comm;
+	const double n_pid = m_pid_n > 0 ? (double)m_pid_n : 1.0;
+	const double n_torque = m_torque_n > 0 ? (double)m_torque_n : 1.0;
+	const double torque_mean = m_torque_sum / n_torque;
+	const double torque_std = sqrt(fmax(m_torque_sq_sum / n_torque - SQ(torque_mean), 0.0));
+
+	printf("mode=%s\n", m_args.mode >= 0 && m_args.mode <= SCENARIO_DUTY ?
+			mode_names[m_args.mode] : "none");
+	printf("set=%g\n", (double)m_args.set);
+	printf("comm_count=%llu\n", (unsigned long long)m_comm_n);
+	printf("comm_irregular=%llu\n", (unsigned long long)m_comm_irregular);
+	printf("comm_interval_mean_us=%.3f\n", dt_mean * 1e6);
+	printf("comm_interval_std_us=%.3f\n", sqrt(fmax(m_comm_dt_sq_sum / n_comm - SQ(dt_mean), 0.0)) * 1e6);
+	printf("comm_angle_err_mean=%.3f\n", err_mean);
+	printf("comm_angle_err_std=%.3f\n", sqrt(fmax(m_comm_err_sq_sum / n_comm - SQ(err_mean), 0.0)));
+	printf("comm_angle_err_max=%.3f\n", m_comm_err_max);
+	if (m_args.mode == SCENARIO_SPEED) {
+		printf("pid_runs=%llu\n", (unsigned long long)m_pid_n);
+		printf("pid_idle_runs=%llu\n", (unsigned long long)m_pid_idle_n);
+		printf("pid_latency_mean_us=%.3f\n", m_pid_latency_sum / n_pid * 1e6);
+		printf("pid_latency_max_us=%.3f\n", m_pid_latency_max * 1e6);
+		printf("pid_latency_poll_mean_us=%.3f\n", m_pid_poll_sum / n_pid * 1e6);
+		if (m_args.step_time > 0.0) {
+			printf("step_settle_ms=%.3f\n", m_step_settle * 1e3);
+		}
+	}
+	printf("torque_mean=%.4f\n", m_dir * torque_mean);
+	printf("torque_ripple=%.4f\n", torque_mean != 0.0 ? torque_std / fabs(torque_mean) : 0.0);
+	printf("erpm=%.0f\n", (double)rpm_end);
+	printf("erpm_end=%.0f\n", (double)(m_dir * p_end.w / ((2.0 * M_PI) / 60.0)));
+	printf("duty_end=%.4f\n", (double)duty_end);
+	printf("current_end=%.3f\n", (double)current_end);
+	printf("isr_ns=%.1f\n", sim_isr_ns());
+	printf("isr_per_host_s=%.0f\n", (double)isr_calls / host_s);
+	printf("realtime_factor=%.2f\n", m_args.time / host_s);
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * mcpwm_foc.c for the simulator, built unmodified together with checks that
+ * need its private state.
+ */
+
+#include "../mcpwm_foc.c"
+#include "sim.h"
+
+// Settings
+#define SIM_FOC_CONST_REFS		2
+
+// Interrupt handlers
+const sim_vectors_t sim_vectors = {
+		mcpwm_foc_tim_sample_int_handler, 0, 0
+};
+
+// Private variables
+static foc_const_t m_const_ref[SIM_FOC_CONST_REFS];
+
+/**
+ * Save the published constant block as a reference for sim_foc_const_match.
+ *
+ * @param ref
+ * Reference slot, 0 to SIM_FOC_CONST_REFS - 1.
+ */
+void sim_foc_const_save(int ref) {
+	m_const_ref[ref] = *m_const;
+}
+
+/**
+ * Compare the published constant block with the saved references. Call it
+ * with the system locked, like the interrupt sees the block.
+ *
+ * @return
+ * The reference the block is equal to, or -1 for a block that is equal to
+ * none of them.
+ */
+int sim_foc_const_match(void) {
+	for (int i = 0;i < SIM_FOC_CONST_REFS;i++) {
+		if (memcmp(m_const, &m_const_ref[i], sizeof(foc_const_t)) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @return
+ * True while a thread rebuilds the constant block.
+ */
+bool sim_foc_const_updating(void) {
+	return m_const_mtx.locked;
+}
+
+/**
+ * Overwrite the published constant block with a reference one word at a
+ * time, without the double buffer. The interrupt can see a mix of the two
+ * blocks then, which the checks have to detect.
+ *
+ * @param ref
+ * Reference slot to copy.
+ */
+void sim_foc_const_write_in_place(int ref) {
+	volatile uint32_t *dst = (volatile uint32_t*)m_const;
+	const uint32_t *src = (const uint32_t*)&m_const_ref[ref];
+
+	chMtxLock(&m_const_mtx);
+	for (unsigned int i = 0;i < sizeof(foc_const_t) / sizeof(uint32_t);i++) {
+		dst[i] = src[i];
+	}
+	chMtxUnlock(&m_const_mtx);
+}
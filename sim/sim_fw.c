@@ -0,0 +1,122 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * The parts of the firmware around mcpwm_foc.c and mcpwm.c for the host
+ * simulator. The motor interface has no limits of its own, there is no
+ * encoder and no hall capture, and commands_printf goes to stdout when
+ * enabled.
+ */
+
+#include "mc_interface.h"
+#include "encoder.h"
+#include "timeout.h"
+#include "commands.h"
+#include "hw.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+
+// Settings
+bool sim_fw_print = false;
+float sim_temp_fet = 25.0; // Filtered FET temperature, degrees C
+
+// mc_interface
+void mc_interface_lock(void) {
+}
+
+void mc_interface_unlock(void) {
+}
+
+void mc_interface_mc_timer_isr(void) {
+}
+
+int mc_interface_try_input(void) {
+	return 0;
+}
+
+float mc_interface_temp_fet_filtered(void) {
+	return sim_temp_fet;
+}
+
+float mc_interface_temp_motor_filtered(void) {
+	return 25.0;
+}
+
+// encoder
+bool encoder_is_configured(void) {
+	return false;
+}
+
+bool encoder_index_found(void) {
+	return false;
+}
+
+float encoder_read_deg(void) {
+	return 0.0;
+}
+
+bool encoder_hall_capture_active(void) {
+	return false;
+}
+
+int encoder_hall_read(void) {
+	return 0;
+}
+
+float encoder_hall_edge_age(void) {
+	return -1.0;
+}
+
+// timeout
+void timeout_configure(systime_t timeout, float brake_current) {
+	(void)timeout;
+	(void)brake_current;
+}
+
+void timeout_reset(void) {
+}
+
+systime_t timeout_get_timeout_msec(void) {
+	return 1000;
+}
+
+float timeout_get_brake_current(void) {
+	return 0.0;
+}
+
+// commands
+void commands_printf(const char* format, ...) {
+	if (!sim_fw_print) {
+		return;
+	}
+
+	va_list arg;
+	va_start(arg, format);
+	printf("fw: ");
+	vprintf(format, arg);
+	printf("\n");
+	va_end(arg);
+}
+
+// hwconf
+void hw_setup_adc_channels(void) {
+}
@@ -0,0 +1,672 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Closed loop test of the FOC control path on the host. The firmware is
+ * initialized like on the MCU, including the current offset calibration,
+ * then one command is given and the motor is simulated for a while. With
+ * step_time the command changes to step_set after that time, and in current
+ * mode the step response is printed as well.
+ *
+ * Arguments are name=value pairs. mc_configuration fields listed in
+ * conf_params use their own names, the scenario and the plant are set with
+ * the names in sim_params. At the end the tracking error, the current
+ * ripple, the observer angle error, the torque per amp of the plant, the host
+ * time per control interrupt and the isr_prof statistics of every section are
+ * printed as name=value lines, so that runs can be swept and compared
+ * with scripts.
+ *
+ * Example:
+ * ./build/foc_sim mode=current set=20 start_erpm=5000 foc_observer_gain=5e7
+ */
+
+#include "ch.h"
+#include "conf_general.h"
+#include "mcpwm_foc.h"
+#include "utils.h"
+#include "isr_prof.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+
+// Settling band of the step response, relative to the step, and the time
+// after the step that the absolute error is integrated over
+#define STEP_SETTLE_BAND		0.1
+#define STEP_IAE_TIME			0.02
+
+typedef enum {
+	SCENARIO_CURRENT = 0,
+	SCENARIO_SPEED,
+	SCENARIO_DUTY,
+	SCENARIO_BRAKE,
+	SCENARIO_OPENLOOP
+} scenario_mode;
+
+typedef struct {
+	// Scenario
+	int mode;
+	float set; // A, ERPM or duty cycle
+	float time; // Simulated time after the command, s
+	float settle; // Time after the command before the statistics start, s
+	float step_time; // Time after the command when set changes to step_set, s. 0 to disable.
+	float step_set;
+	float start_erpm;
+	float start_angle; // Electrical rotor angle at start, degrees
+	float trace; // Print interval, s. 0 to disable.
+	bool print;
+	// Plant, in the units of mc_configuration
+	float motor_r;
+	float motor_l;
+	float motor_ld_lq_diff;
+	float motor_flux_linkage;
+	float ld_sat; // Incremental ld change per ampere of id, 1 / A
+	float poles;
+	float j;
+	float b;
+	float load;
+	bool dyno;
+	float dyno_accel; // Speed ramp of the dyno, ERPM / s
+	float v_bus;
+	float dead_time_us;
+	float noise;
+	int curr_offset_1;
+	int curr_offset_2;
+	bool avg;
+	float hall_offset; // Degrees
+	float temp_fet; // Degrees C
+	// Configuration swaps instead of commands. 1: mcpwm_foc_set_configuration
+	// with two configurations in turn, 2: overwrite the constant block in place.
+	int conf_swap;
+} sim_args_t;
+
+#define CONF_PARAM(name, type)	{#name, type, offsetof(mc_configuration, name)}
+#define SIM_PARAM(name, type)	{#name, type, offsetof(sim_args_t, name)}
+
+static const param_t conf_params[] = {
+		CONF_PARAM(l_current_max, PARAM_FLOAT),
+		CONF_PARAM(l_current_min, PARAM_FLOAT),
+		CONF_PARAM(l_max_erpm, PARAM_FLOAT),
+		CONF_PARAM(l_min_erpm, PARAM_FLOAT),
+		CONF_PARAM(l_min_duty, PARAM_FLOAT),
+		CONF_PARAM(l_max_duty, PARAM_FLOAT),
+		CONF_PARAM(foc_current_kp, PARAM_FLOAT),
+		CONF_PARAM(foc_current_ki, PARAM_FLOAT),
+		CONF_PARAM(foc_f_sw, PARAM_FLOAT),
+		CONF_PARAM(foc_dt_us, PARAM_FLOAT),
+		CONF_PARAM(foc_motor_l, PARAM_FLOAT),
+		CONF_PARAM(foc_motor_r, PARAM_FLOAT),
+		CONF_PARAM(foc_motor_flux_linkage, PARAM_FLOAT),
+		CONF_PARAM(foc_observer_gain, PARAM_FLOAT),
+		CONF_PARAM(foc_observer_gain_slow, PARAM_FLOAT),
+		CONF_PARAM(foc_pll_kp, PARAM_FLOAT),
+		CONF_PARAM(foc_pll_ki, PARAM_FLOAT),
+		CONF_PARAM(foc_duty_dowmramp_kp, PARAM_FLOAT),
+		CONF_PARAM(foc_duty_dowmramp_ki, PARAM_FLOAT),
+		CONF_PARAM(foc_openloop_rpm, PARAM_FLOAT),
+		CONF_PARAM(foc_sl_openloop_hyst, PARAM_FLOAT),
+		CONF_PARAM(foc_sl_openloop_time, PARAM_FLOAT),
+		CONF_PARAM(foc_sl_d_current_duty, PARAM_FLOAT),
+		CONF_PARAM(foc_sl_d_current_factor, PARAM_FLOAT),
+		CONF_PARAM(foc_sensor_mode, PARAM_INT),
+		CONF_PARAM(foc_sl_erpm, PARAM_FLOAT),
+		CONF_PARAM(foc_sample_v0_v7, PARAM_BOOL),
+		CONF_PARAM(foc_sample_high_current, PARAM_BOOL),
+		CONF_PARAM(foc_sat_comp, PARAM_FLOAT),
+		CONF_PARAM(foc_temp_comp, PARAM_BOOL),
+		CONF_PARAM(foc_observer_type, PARAM_INT),
+		CONF_PARAM(foc_observer_iterations, PARAM_INT),
+		CONF_PARAM(foc_observer_iter_min_erpm, PARAM_FLOAT),
+		CONF_PARAM(foc_est_decimation, PARAM_INT),
+		CONF_PARAM(foc_fw_current_max, PARAM_FLOAT),
+		CONF_PARAM(foc_fw_duty_start, PARAM_FLOAT),
+		CONF_PARAM(foc_fw_ramp_time, PARAM_FLOAT),
+		CONF_PARAM(foc_motor_ld_lq_diff, PARAM_FLOAT),
+		CONF_PARAM(foc_mtpa_enable, PARAM_BOOL),
+		CONF_PARAM(foc_hfi_voltage, PARAM_FLOAT),
+		CONF_PARAM(foc_hfi_bw, PARAM_FLOAT),
+		CONF_PARAM(foc_hfi_polarity_current, PARAM_FLOAT),
+		CONF_PARAM(foc_online_est, PARAM_BOOL),
+		CONF_PARAM(foc_cc_decoupling, PARAM_INT),
+		CONF_PARAM(foc_pll_adaptive, PARAM_BOOL),
+		CONF_PARAM(foc_pll_bw_min, PARAM_FLOAT),
+		CONF_PARAM(foc_pll_bw_max, PARAM_FLOAT),
+		CONF_PARAM(foc_pll_bw_erpm, PARAM_FLOAT),
+		CONF_PARAM(foc_pll_obs_speed, PARAM_BOOL),
+		CONF_PARAM(foc_overmod_mode, PARAM_INT),
+		CONF_PARAM(foc_dpwm_mode, PARAM_INT),
+		CONF_PARAM(foc_dpwm_mod_min, PARAM_FLOAT),
+		CONF_PARAM(foc_f_sw_sched, PARAM_BOOL),
+		CONF_PARAM(foc_f_sw_min, PARAM_FLOAT),
+		CONF_PARAM(foc_f_sw_sched_erpm, PARAM_FLOAT),
+		CONF_PARAM(foc_f_sw_temp_margin, PARAM_FLOAT),
+		CONF_PARAM(s_pid_kp, PARAM_FLOAT),
+		CONF_PARAM(s_pid_ki, PARAM_FLOAT),
+		CONF_PARAM(s_pid_kd, PARAM_FLOAT),
+		CONF_PARAM(s_pid_min_erpm, PARAM_FLOAT),
+		CONF_PARAM(s_pid_allow_braking, PARAM_BOOL),
+};
+
+static const param_t sim_params[] = {
+		SIM_PARAM(mode, PARAM_INT),
+		SIM_PARAM(set, PARAM_FLOAT),
+		SIM_PARAM(time, PARAM_FLOAT),
+		SIM_PARAM(settle, PARAM_FLOAT),
+		SIM_PARAM(step_time, PARAM_FLOAT),
+		SIM_PARAM(step_set, PARAM_FLOAT),
+		SIM_PARAM(start_erpm, PARAM_FLOAT),
+		SIM_PARAM(start_angle, PARAM_FLOAT),
+		SIM_PARAM(trace, PARAM_FLOAT),
+		SIM_PARAM(print, PARAM_BOOL),
+		SIM_PARAM(motor_r, PARAM_FLOAT),
+		SIM_PARAM(motor_l, PARAM_FLOAT),
+		SIM_PARAM(motor_ld_lq_diff, PARAM_FLOAT),
+		SIM_PARAM(motor_flux_linkage, PARAM_FLOAT),
+		SIM_PARAM(ld_sat, PARAM_FLOAT),
+		SIM_PARAM(poles, PARAM_FLOAT),
+		SIM_PARAM(j, PARAM_FLOAT),
+		SIM_PARAM(b, PARAM_FLOAT),
+		SIM_PARAM(load, PARAM_FLOAT),
+		SIM_PARAM(dyno, PARAM_BOOL),
+		SIM_PARAM(dyno_accel, PARAM_FLOAT),
+		SIM_PARAM(v_bus, PARAM_FLOAT),
+		SIM_PARAM(dead_time_us, PARAM_FLOAT),
+		SIM_PARAM(noise, PARAM_FLOAT),
+		SIM_PARAM(curr_offset_1, PARAM_INT),
+		SIM_PARAM(curr_offset_2, PARAM_INT),
+		SIM_PARAM(avg, PARAM_BOOL),
+		SIM_PARAM(hall_offset, PARAM_FLOAT),
+		SIM_PARAM(temp_fet, PARAM_FLOAT),
+		SIM_PARAM(conf_swap, PARAM_INT),
+};
+
+static const char *mode_names[] = {"current", "speed", "duty", "brake", "openloop"};
+
+// Private variables
+static mc_configuration m_conf;
+static mc_configuration m_conf_swap;
+static sim_args_t m_args;
+static double m_stat_start;
+static double m_step_start;
+static volatile float m_set; // The command in effect, set or step_set
+
+// Statistics, updated from the interrupt thread
+static uint64_t m_n;
+static double m_iq_err_sum;
+static double m_iq_err_sq_sum;
+static double m_iq_err_max;
+static float m_f_sw_min;
+static float m_f_sw_max;
+static double m_ripple_sum;
+static uint64_t m_ang_n;
+static double m_ang_err_sq_sum;
+static double m_ang_err_max;
+static double m_obs_err_sum;
+static double m_obs_err_sq_sum;
+static double m_rpm_err_sum;
+static double m_rpm_err_sq_sum;
+static double m_speed_err_sum;
+static double m_torque_sum;
+static double m_is_sum;
+static double m_step_settle;
+static double m_step_iae;
+static double m_step_t_last;
+static double m_step_overshoot;
+static double m_step_id_dev_max;
+static uint64_t m_const_checks;
+static uint64_t m_const_checks_updating;
+static uint64_t m_const_torn;
+
+static void usage(const char *name) {
+	printf("Usage: %s [name=value]...\n\n", name);
+	printf("Scenario and plant (mode: 0 current, 1 speed, 2 duty, 3 brake, 4 openloop):\n");
+	sim_print_params(sim_params, sizeof(sim_params) / sizeof(sim_params[0]), &m_args);
+	printf("mc_configuration:\n");
+	sim_print_params(conf_params, sizeof(conf_params) / sizeof(conf_params[0]), &m_conf);
+}
+
+/*
+ * Hall table for the sensors of the simulator, with the center angle of
+ * every code in the 0 - 200 scale of foc_hall_table.
+ */
+static void make_hall_table(uint8_t *table) {
+	float s[8] = {0.0}, c[8] = {0.0};
+
+	for (int i = 0;i < 720;i++) {
+		const float th = (float)i * (M_PI / 360.0);
+		const int code = sim_hall_code(th);
+		s[code] += sinf(th);
+		c[code] += cosf(th);
+	}
+
+	for (int i = 0;i < 8;i++) {
+		if (s[i] == 0.0 && c[i] == 0.0) {
+			table[i] = 255;
+		} else {
+			float ang = atan2f(s[i], c[i]) * (180.0 / M_PI);
+			utils_norm_angle(&ang);
+			table[i] = (uint8_t)(lrintf(ang * (200.0 / 360.0)) % 200);
+		}
+	}
+}
+
+/*
+ * Response to the current step: the time until iq stays within
+ * STEP_SETTLE_BAND of the step from the new command, the integrated absolute
+ * error over STEP_IAE_TIME, the overshoot relative to the step and the
+ * largest D axis current, which is commanded to zero, so
+ * that it shows the coupling from the Q axis.
+ */
+static void step_stats(const sim_plant_t *p) {
+	float ref_old = m_args.set;
+	float ref_new = m_args.step_set;
+	utils_truncate_number(&ref_old, m_conf.l_current_min, m_conf.l_current_max);
+	utils_truncate_number(&ref_new, m_conf.l_current_min, m_conf.l_current_max);
+	const float step = ref_new - ref_old;
+	if (step == 0.0) {
+		return;
+	}
+
+	const double t = sim_time() - m_step_start;
+	const float err = (p->iq - ref_new) / step;
+	if (fabsf(err) > STEP_SETTLE_BAND) {
+		m_step_settle = t;
+	}
+	if (t < STEP_IAE_TIME) {
+		m_step_iae += fabsf(p->iq - ref_new) * (t - m_step_t_last);
+	}
+	m_step_t_last = t;
+	if (err > m_step_overshoot) {
+		m_step_overshoot = err;
+	}
+	if (fabsf(p->id) > m_step_id_dev_max) {
+		m_step_id_dev_max = fabsf(p->id);
+	}
+}
+
+static void isr_hook(void) {
+	sim_plant_t *p = &sim_plant;
+	const float ripple = p->iq_max - p->iq_min;
+	p->iq_min = p->iq;
+	p->iq_max = p->iq;
+
+	if (m_args.step_time > 0.0 && m_args.mode == SCENARIO_CURRENT &&
+			sim_time() >= m_step_start) {
+		step_stats(p);
+	}
+
+	if (sim_time() < m_stat_start) {
+		return;
+	}
+
+	const float rpm_plant = p->w / ((2.0 * M_PI) / 60.0);
+
+	m_n++;
+	m_ripple_sum += ripple;
+	const float rpm_err = mcpwm_foc_get_rpm() - rpm_plant;
+	m_rpm_err_sum += rpm_err;
+	m_rpm_err_sq_sum += SQ(rpm_err);
+	m_torque_sum += sim_plant_torque(p);
+
+	const float f_sw = mcpwm_foc_get_switching_frequency_now();
+	if (m_n == 1 || f_sw < m_f_sw_min) {
+		m_f_sw_min = f_sw;
+	}
+	if (m_n == 1 || f_sw > m_f_sw_max) {
+		m_f_sw_max = f_sw;
+	}
+	m_is_sum += sqrtf(SQ(p->id) + SQ(p->iq));
+
+	if (m_args.conf_swap) {
+		m_const_checks++;
+		if (sim_foc_const_updating()) {
+			m_const_checks_updating++;
+		}
+		if (sim_foc_const_match() < 0) {
+			m_const_torn++;
+		}
+	}
+
+	if (m_args.mode == SCENARIO_CURRENT) {
+		float iq_ref = m_set;
+		utils_truncate_number(&iq_ref, m_conf.l_current_min, m_conf.l_current_max);
+		m_iq_err_sum += p->iq - iq_ref;
+		m_iq_err_sq_sum += SQ(p->iq - iq_ref);
+		if (fabsf(p->iq - iq_ref) > m_iq_err_max) {
+			m_iq_err_max = fabsf(p->iq - iq_ref);
+		}
+	} else if (m_args.mode == SCENARIO_SPEED) {
+		m_speed_err_sum += rpm_plant - m_set;
+	}
+
+	if (mcpwm_foc_get_state() == MC_STATE_RUNNING) {
+		const float err = fabsf(utils_angle_difference(mcpwm_foc_get_phase(),
+				p->th * (180.0 / M_PI)));
+		m_ang_n++;
+		m_ang_err_sq_sum += SQ(err);
+		if (err > m_ang_err_max) {
+			m_ang_err_max = err;
+		}
+
+		// The observer angle alone, without the corrections of the sensor modes
+		const float obs_err = utils_angle_difference(mcpwm_foc_get_phase_observer(),
+				p->th * (180.0 / M_PI));
+		m_obs_err_sum += obs_err;
+		m_obs_err_sq_sum += SQ(obs_err);
+	}
+}
+
+/*
+ * isr_prof statistics of the sections that ran, in host nanoseconds. The
+ * names are the section names in lower case with underscores.
+ */
+static void print_isr_prof(void) {
+	for (int i = 0;i < ISR_PROF_SECTION_NUM;i++) {
+		isr_prof_stats st;
+		isr_prof_get_stats(i, &st);
+		if (st.samples == 0) {
+			continue;
+		}
+
+		char name[32];
+		const char *src = isr_prof_section_name(i);
+		size_t len = 0;
+		for (;src[len] && len < sizeof(name) - 1;len++) {
+			name[len] = src[len] == ' ' ? '_' : tolower((unsigned char)src[len]);
+		}
+		name[len] = '\0';
+
+		printf("prof_%s_samples=%u\n", name, (unsigned int)st.samples);
+		printf("prof_%s_mean_ns=%.1f\n", name, (double)st.mean);
+		printf("prof_%s_min_ns=%u\n", name, (unsigned int)st.min);
+		printf("prof_%s_p99_ns=%u\n", name, (unsigned int)st.p99);
+		printf("prof_%s_max_ns=%u\n", name, (unsigned int)st.max);
+	}
+}
+
+static void command(void) {
+	if (m_args.step_time > 0.0 && sim_time() >= m_step_start) {
+		m_set = m_args.step_set;
+	}
+
+	switch (m_args.mode) {
+	case SCENARIO_CURRENT: mcpwm_foc_set_current(m_set); break;
+	case SCENARIO_SPEED: mcpwm_foc_set_pid_speed(m_set); break;
+	case SCENARIO_DUTY: mcpwm_foc_set_duty(m_set); break;
+	case SCENARIO_BRAKE: mcpwm_foc_set_brake_current(m_set); break;
+	case SCENARIO_OPENLOOP: mcpwm_foc_set_openloop(m_conf.l_current_max / 2.0, m_set); break;
+	default: break;
+	}
+}
+
+/*
+ * A second configuration for the swap test, which changes most of the
+ * constant block, including the MTPA table.
+ */
+static void make_swap_conf(void) {
+	m_conf_swap = m_conf;
+	m_conf_swap.foc_current_kp *= 1.5;
+	m_conf_swap.foc_current_ki *= 1.5;
+	m_conf_swap.foc_pll_kp *= 1.5;
+	m_conf_swap.foc_pll_ki *= 1.5;
+	m_conf_swap.foc_motor_r *= 1.1;
+	m_conf_swap.foc_motor_l *= 1.1;
+	m_conf_swap.foc_motor_flux_linkage *= 1.1;
+	m_conf_swap.foc_motor_ld_lq_diff += 0.2 * m_conf.foc_motor_l;
+	m_conf_swap.foc_mtpa_enable = !m_conf.foc_mtpa_enable;
+	m_conf_swap.foc_fw_current_max += 10.0;
+	m_conf_swap.foc_observer_iterations += 1;
+}
+
+/*
+ * Swap the configuration for one millisecond without sleeping, so that the
+ * control interrupt preempts the updates.
+ */
+static void conf_swap(void) {
+	static bool swap = false;
+	const double t_end = sim_time() + 1e-3;
+
+	while (sim_time() < t_end) {
+		swap = !swap;
+		if (m_args.conf_swap == 2) {
+			sim_foc_const_write_in_place(swap ? 1 : 0);
+		} else {
+			mcpwm_foc_set_configuration(swap ? &m_conf_swap : &m_conf);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	conf_general_get_default_mc_configuration(&m_conf);
+
+	m_args.mode = SCENARIO_CURRENT;
+	m_args.set = 10.0;
+	m_args.time = 0.5;
+	m_args.settle = 0.1;
+	m_args.start_erpm = 0.0;
+	m_args.poles = 14.0;
+	m_args.j = 1e-4;
+	m_args.b = 1e-5;
+	m_args.v_bus = 24.0;
+	m_args.dead_time_us = m_conf.foc_dt_us;
+	m_args.noise = 1.0;
+	m_args.temp_fet = 25.0;
+	m_args.motor_r = -1.0;
+	m_args.motor_l = -1.0;
+	m_args.motor_ld_lq_diff = -1.0;
+	m_args.motor_flux_linkage = -1.0;
+
+	for (int i = 1;i < argc;i++) {
+		char name[64];
+		const char *eq = strchr(argv[i], '=');
+		if (!eq || (size_t)(eq - argv[i]) >= sizeof(name)) {
+			usage(argv[0]);
+			return strcmp(argv[i], "help") == 0 ? 0 : 1;
+		}
+
+		memcpy(name, argv[i], eq - argv[i]);
+		name[eq - argv[i]] = '\0';
+
+		if (!sim_set_param(conf_params, sizeof(conf_params) / sizeof(conf_params[0]), &m_conf, name, eq + 1) &&
+				!sim_set_param(sim_params, sizeof(sim_params) / sizeof(sim_params[0]), &m_args, name, eq + 1)) {
+			fprintf(stderr, "Unknown parameter: %s\n", name);
+			return 1;
+		}
+	}
+
+	// The plant uses the configured motor unless told otherwise
+	if (m_args.motor_r < 0.0) {
+		m_args.motor_r = m_conf.foc_motor_r;
+	}
+	if (m_args.motor_l < 0.0) {
+		m_args.motor_l = m_conf.foc_motor_l;
+	}
+	if (m_args.motor_ld_lq_diff < 0.0) {
+		m_args.motor_ld_lq_diff = m_conf.foc_motor_ld_lq_diff;
+	}
+	if (m_args.motor_flux_linkage < 0.0) {
+		m_args.motor_flux_linkage = m_conf.foc_motor_flux_linkage;
+	}
+
+	// mc_interface keeps these up to date on the MCU
+	m_conf.lo_current_max = m_conf.l_current_max;
+	m_conf.lo_current_min = m_conf.l_current_min;
+	m_conf.lo_in_current_max = m_conf.l_in_current_max;
+	m_conf.lo_in_current_min = m_conf.l_in_current_min;
+	m_conf.lo_current_motor_max_now = m_conf.l_current_max;
+	m_conf.lo_current_motor_min_now = m_conf.l_current_min;
+
+	sim_plant_t *p = &sim_plant;
+	memset(p, 0, sizeof(sim_plant_t));
+	p->r = (3.0 / 2.0) * m_args.motor_r;
+	p->ld = (3.0 / 2.0) * (m_args.motor_l - m_args.motor_ld_lq_diff / 2.0);
+	p->lq = (3.0 / 2.0) * (m_args.motor_l + m_args.motor_ld_lq_diff / 2.0);
+	p->lambda = m_args.motor_flux_linkage;
+	p->ld_sat = m_args.ld_sat;
+	p->pole_pairs = m_args.poles / 2.0;
+	p->j = m_args.j;
+	p->b = m_args.b;
+	p->load = m_args.load;
+	p->speed_fixed = m_args.dyno;
+	p->w_accel = m_args.dyno_accel * ((2.0 * M_PI) / 60.0);
+	p->v_bus = m_args.v_bus;
+	p->dead_time = m_args.dead_time_us * 1e-6;
+	p->i_noise = m_args.noise;
+	p->curr_offset[0] = m_args.curr_offset_1;
+	p->curr_offset[1] = m_args.curr_offset_2;
+	p->avg = m_args.avg;
+
+	sim_set_hall_angle_offset(m_args.hall_offset * (M_PI / 180.0));
+	make_hall_table(m_conf.foc_hall_table);
+	sim_fw_print = m_args.print;
+	sim_temp_fet = m_args.temp_fet;
+
+	utils_trig_init();
+	isr_prof_init();
+	sim_os_start();
+	mcpwm_foc_init(&m_conf);
+
+	if (m_args.conf_swap) {
+		make_swap_conf();
+		mcpwm_foc_set_configuration(&m_conf_swap);
+		sim_foc_const_save(1);
+		mcpwm_foc_set_configuration(&m_conf);
+		sim_foc_const_save(0);
+	}
+
+	// Spin up the rotor with the interrupt masked, as the plant runs there
+	chSysLock();
+	p->w = m_args.start_erpm * ((2.0 * M_PI) / 60.0);
+	p->th = m_args.start_angle * (M_PI / 180.0);
+	chSysUnlock();
+	chThdSleepMilliseconds(10);
+
+	const double t_cmd = sim_time();
+	m_stat_start = t_cmd + m_args.settle;
+	m_step_start = t_cmd + m_args.step_time;
+	m_set = m_args.set;
+	sim_isr_hook = isr_hook;
+
+	struct timespec ts0, ts1;
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	const uint64_t isr_calls_start = sim_isr_calls();
+
+	double t_trace = t_cmd;
+	bool prof_reset = false;
+	while (sim_time() < t_cmd + m_args.time) {
+		if (m_args.conf_swap) {
+			conf_swap();
+		} else {
+			// The commands time out, so keep sending them like a remote would
+			command();
+			chThdSleepMilliseconds(1);
+		}
+
+		// Profile the same part of the run as the other statistics
+		if (!prof_reset && sim_time() >= m_stat_start) {
+			isr_prof_reset();
+			prof_reset = true;
+		}
+
+		if (m_args.trace > 0.0 && sim_time() >= t_trace) {
+			t_trace += m_args.trace;
+			printf("t=%.4f iq=%.2f iq_plant=%.2f erpm=%.0f erpm_plant=%.0f "
+					"phase=%.1f phase_plant=%.1f duty=%.3f\n",
+					sim_time() - t_cmd, (double)mcpwm_foc_get_iq(), (double)p->iq,
+					(double)mcpwm_foc_get_rpm(), (double)(p->w / ((2.0 * M_PI) / 60.0)),
+					(double)mcpwm_foc_get_phase(), (double)(p->th * (180.0 / M_PI)),
+					(double)mcpwm_foc_get_duty_cycle_now());
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	const double host_s = (double)(ts1.tv_sec - ts0.tv_sec) + (double)(ts1.tv_nsec - ts0.tv_nsec) * 1e-9;
+	const uint64_t isr_calls = sim_isr_calls() - isr_calls_start;
+
+	chSysLock();
+	sim_isr_hook = 0;
+	const sim_plant_t p_end = *p;
+	const float f_sw_end = mcpwm_foc_get_switching_frequency_now();
+	chSysUnlock();
+
+	mcpwm_foc_stop_pwm();
+	sim_os_stop();
+
+	const double n = m_n > 0 ? (double)m_n : 1.0;
+	const double n_ang = m_ang_n > 0 ? (double)m_ang_n : 1.0;
+
+	printf("mode=%s\n", m_args.mode >= 0 && m_args.mode <= SCENARIO_OPENLOOP ?
+			mode_names[m_args.mode] : "none");
+	printf("set=%g\n", (double)m_args.set);
+	printf("samples=%llu\n", (unsigned long long)m_n);
+	if (m_args.mode == SCENARIO_CURRENT) {
+		printf("iq_err_mean=%.4f\n", m_iq_err_sum / n);
+		printf("iq_err_rms=%.4f\n", sqrt(m_iq_err_sq_sum / n));
+		printf("iq_err_max=%.4f\n", m_iq_err_max);
+	} else if (m_args.mode == SCENARIO_SPEED) {
+		printf("speed_err_mean=%.1f\n", m_speed_err_sum / n);
+	}
+	printf("iq_ripple_pp=%.4f\n", m_ripple_sum / n);
+	printf("angle_err_rms=%.3f\n", sqrt(m_ang_err_sq_sum / n_ang));
+	printf("angle_err_max=%.3f\n", m_ang_err_max);
+	const double obs_err_mean = m_obs_err_sum / n_ang;
+	printf("obs_angle_err_mean=%.3f\n", obs_err_mean);
+	printf("obs_angle_err_std=%.3f\n", sqrt(fmax(m_obs_err_sq_sum / n_ang - SQ(obs_err_mean), 0.0)));
+	printf("erpm_err_rms=%.1f\n", sqrt(m_rpm_err_sq_sum / n));
+	const double rpm_err_mean = m_rpm_err_sum / n;
+	printf("erpm_err_mean=%.1f\n", rpm_err_mean);
+	printf("erpm_err_std=%.1f\n", sqrt(fmax(m_rpm_err_sq_sum / n - SQ(rpm_err_mean), 0.0)));
+	if (m_args.dyno && m_args.dyno_accel != 0.0) {
+		// How far behind the ramp the speed estimate is
+		printf("speed_lag_ms=%.3f\n", -rpm_err_mean / m_args.dyno_accel * 1e3);
+	}
+	printf("erpm_end=%.0f\n", (double)(p_end.w / ((2.0 * M_PI) / 60.0)));
+	printf("iq_end=%.3f\n", (double)p_end.iq);
+	printf("id_end=%.3f\n", (double)p_end.id);
+	printf("torque_mean=%.4f\n", m_torque_sum / n);
+	printf("is_mean=%.3f\n", m_is_sum / n);
+	printf("torque_per_amp=%.5f\n", m_is_sum > 0.0 ? m_torque_sum / m_is_sum : 0.0);
+	if (m_args.step_time > 0.0 && m_args.mode == SCENARIO_CURRENT) {
+		printf("step_settle_ms=%.3f\n", m_step_settle * 1e3);
+		printf("step_iae=%.4f\n", m_step_iae * 1e3);
+		printf("step_overshoot=%.4f\n", m_step_overshoot);
+		printf("step_id_dev_max=%.3f\n", m_step_id_dev_max);
+	}
+	if (m_args.conf_swap) {
+		printf("const_checks=%llu\n", (unsigned long long)m_const_checks);
+		printf("const_checks_updating=%llu\n", (unsigned long long)m_const_checks_updating);
+		printf("const_torn=%llu\n", (unsigned long long)m_const_torn);
+		printf("isr_preempt=%llu\n", (unsigned long long)sim_isr_preempt_calls());
+	}
+	printf("f_sw_min=%.0f\n", (double)m_f_sw_min);
+	printf("f_sw_max=%.0f\n", (double)m_f_sw_max);
+	printf("f_sw_end=%.0f\n", (double)f_sw_end);
+	printf("isr_ns=%.1f\n", sim_isr_ns());
+	printf("isr_per_host_s=%.0f\n", (double)isr_calls / host_s);
+	printf("realtime_factor=%.2f\n", m_args.time / host_s);
+	print_isr_prof();
+
+	return 0;
+}
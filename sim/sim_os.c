@@ -0,0 +1,1197 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Simulated MCU for the host build: the ChibiOS kernel and HAL calls, the
+ * StdPeriph calls made by mcpwm_foc.c and mcpwm.c and the TIM1/TIM8/ADC/DMA
+ * chain that runs the control interrupt. The firmware interrupt handlers
+ * come from sim_vectors.
+ *
+ * With TIM1 center aligned, like mcpwm_foc.c runs it, the plant sees the
+ * average voltages of every half period. With TIM1 counting up, like mcpwm.c
+ * runs it, a PWM period is simulated event by event instead: the PWM edges,
+ * the regular and injected ADC triggers, the end of the conversions and the
+ * TIM2 compare each move the plant to their time, and the bridge legs follow
+ * the output modes of the channels in between. The ADC conversion times are
+ * modeled, the dead time is not.
+ *
+ * Time only moves in the interrupt thread, one (half) PWM period at a time.
+ * Firmware threads are pthreads that sleep in simulated time. When a thread
+ * wakes up, the interrupt thread waits until it sleeps again, so thread code
+ * runs between two interrupts like it would on the MCU. A thread that keeps
+ * running for longer than SIM_BUSY_WAIT_TIMEOUT of host time is assumed to
+ * busy wait for the interrupt. From then on the interrupts preempt it: they
+ * are sent to it as SIM_IRQ_SIGNAL and run in the signal handler, so that the
+ * thread stops wherever it is until the interrupt has returned, like on the
+ * MCU.
+ *
+ * The system lock is a recursive mutex that the interrupt handlers also take.
+ * An interrupt that arrives while the thread has the system locked runs when
+ * it unlocks. Taking a ChibiOS mutex or sleeping with the system locked, or
+ * from an interrupt, aborts the simulation, like the ChibiOS state checker
+ * would halt the MCU.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "stm32f4xx_conf.h"
+#include "conf_general.h"
+#include "hw.h"
+#include "mc_interface.h"
+#include "sim.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Settings
+#define SIM_THREADS_MAX			16
+#define SIM_BUSY_WAIT_TIMEOUT	2e-3 // Host time, s
+#define SIM_IRQ_TIMEOUT			10 // Host time an interrupt can be masked before the simulation aborts, s
+#define SIM_IRQ_SIGNAL			SIGUSR1
+#define SIM_TICKS_PER_ST		(SYSTEM_CORE_CLOCK / CH_CFG_ST_FREQUENCY)
+#define SIM_IDLE_HALF_PERIOD	(SYSTEM_CORE_CLOCK / 20000) // Used while TIM1 is stopped
+#define SIM_ADC_CONV_TICKS		108 // 15 sampling and 12 conversion cycles of the 42 MHz ADC clock
+
+// Threads
+struct sim_thread {
+	pthread_t th;
+	pthread_cond_t cond;
+	tfunc_t func;
+	void *arg;
+	bool used;
+	bool started;
+	bool sleeping;
+	uint64_t wake;
+};
+
+typedef struct {
+	uint16_t ocm;
+	bool cce;
+	bool ccne;
+} sim_channel_t;
+
+// Peripherals
+TIM_TypeDef sim_tim1;
+TIM_TypeDef sim_tim2;
+TIM_TypeDef sim_tim8;
+TIM_TypeDef sim_tim12;
+ADC_Common_TypeDef sim_adc_common;
+CoreDebug_Type sim_core_debug;
+const stm32_dma_stream_t _stm32_dma_streams[16] = {
+		{0}, {1}, {2}, {3}, {4}, {5}, {6}, {7},
+		{8}, {9}, {10}, {11}, {12}, {13}, {14}, {15}
+};
+
+// The ADC buffer and the current samples, defined in mc_interface.c on the MCU
+volatile uint16_t ADC_Value[HW_ADC_CHANNELS];
+volatile int ADC_curr_norm_value[3];
+
+// The plant
+sim_plant_t sim_plant;
+
+// Called after every control interrupt
+void (*sim_isr_hook)(void) = 0;
+
+// Called after every TIM1 commutation event
+void (*sim_com_hook)(void) = 0;
+
+// Private variables
+static struct sim_thread m_threads[SIM_THREADS_MAX];
+static __thread struct sim_thread *m_self;
+static __thread int m_lock_depth;
+static __thread bool m_in_isr;
+static __thread volatile bool m_irq_pending;
+static pthread_mutex_t m_sched_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t m_irq_mtx;
+static pthread_t m_isr_th;
+static sem_t m_irq_done;
+static volatile bool m_stop;
+static int m_running;
+static uint64_t m_ticks;
+static uint64_t m_next_wake = UINT64_MAX;
+
+static bool m_tim1_on;
+static bool m_tim1_up;
+static bool m_tim1_moe;
+static bool m_tim1_ccpc;
+static sim_channel_t m_ch_pre[3];
+static sim_channel_t m_ch[3];
+static bool m_tim8_cc1_irq;
+static bool m_adc_on;
+static bool m_dma_it;
+static stm32_dmaisr_t m_dma_func;
+static void *m_dma_param;
+static bool m_count_down;
+static uint32_t m_arr;
+static uint32_t m_ccr[3];
+static uint32_t m_ccr4;
+static uint32_t m_tim8_ccr[3];
+static bool m_tim2_on;
+static uint64_t m_tim2_frac;
+static bool m_adc_jeoc_it;
+static uint16_t m_adc_inj[3][2];
+static uint64_t m_dma_at = UINT64_MAX;
+static uint64_t m_inj_at = UINT64_MAX;
+static float m_hall_offset;
+static unsigned int m_seed = 1;
+
+static uint64_t m_isr_calls;
+static uint64_t m_isr_preempt;
+static double m_isr_time;
+static DWT_Type m_dwt;
+
+static double host_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * The DWT registers, with CYCCNT updated to the host time in nanoseconds on
+ * every access. isr_prof reads CYCCNT at the start and at the end of the
+ * sections, so the statistics are in host nanoseconds instead of core clock
+ * cycles, including the roughly 20 ns that clock_gettime takes.
+ */
+DWT_Type *sim_dwt(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	m_dwt.CYCCNT = (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+	return &m_dwt;
+}
+
+static void sim_fatal(const char *what) {
+	fprintf(stderr, "sim: %s at t = %.6f s\n", what, sim_time());
+	abort();
+}
+
+static void check_thread_context(const char *what) {
+	if (m_in_isr) {
+		sim_fatal(what);
+	}
+
+	if (m_lock_depth > 0) {
+		sim_fatal(what);
+	}
+}
+
+static struct sim_thread *thread_alloc(void) {
+	for (int i = 0;i < SIM_THREADS_MAX;i++) {
+		if (!m_threads[i].used) {
+			memset(&m_threads[i], 0, sizeof(m_threads[i]));
+			m_threads[i].used = true;
+			pthread_cond_init(&m_threads[i].cond, NULL);
+			return &m_threads[i];
+		}
+	}
+
+	sim_fatal("out of threads");
+	return NULL;
+}
+
+static void *thread_entry(void *arg) {
+	struct sim_thread *t = arg;
+	m_self = t;
+
+	pthread_mutex_lock(&m_sched_mtx);
+	t->th = pthread_self();
+	t->started = true;
+	pthread_mutex_unlock(&m_sched_mtx);
+
+	t->func(t->arg);
+
+	pthread_mutex_lock(&m_sched_mtx);
+	m_running--;
+	t->used = false;
+	pthread_mutex_unlock(&m_sched_mtx);
+	return NULL;
+}
+
+static void wake_threads(void) {
+	if (__atomic_load_n(&m_next_wake, __ATOMIC_ACQUIRE) > m_ticks) {
+		return;
+	}
+
+	pthread_mutex_lock(&m_sched_mtx);
+	uint64_t next = UINT64_MAX;
+	for (int i = 0;i < SIM_THREADS_MAX;i++) {
+		struct sim_thread *t = &m_threads[i];
+		if (!t->used || !t->sleeping) {
+			continue;
+		}
+
+		if (t->wake <= m_ticks) {
+			t->sleeping = false;
+			m_running++;
+			pthread_cond_signal(&t->cond);
+		} else if (t->wake < next) {
+			next = t->wake;
+		}
+	}
+	__atomic_store_n(&m_next_wake, next, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m_sched_mtx);
+}
+
+static uint16_t adc_counts(float counts) {
+	if (counts < 0.0) {
+		return 0;
+	} else if (counts > 4095.0) {
+		return 4095;
+	}
+	return (uint16_t)lrintf(counts);
+}
+
+static float noise(void) {
+	// Box-Muller with a fixed seed, so that runs are repeatable
+	const float u1 = ((float)rand_r(&m_seed) + 1.0) / ((float)RAND_MAX + 2.0);
+	const float u2 = (float)rand_r(&m_seed) / (float)RAND_MAX;
+	return sqrtf(-2.0 * logf(u1)) * cosf(2.0 * M_PI * u2);
+}
+
+static uint16_t volts_to_adc(float v) {
+	return adc_counts(v / ((VIN_R1 + VIN_R2) / VIN_R2) / V_REG * 4095.0);
+}
+
+static uint16_t current_to_adc(float i, int offset) {
+	return adc_counts(2048.0 + offset + i / FAC_CURRENT + sim_plant.i_noise * noise());
+}
+
+static void sample_adc(void) {
+	const sim_plant_t *p = &sim_plant;
+
+	float i_ph[3];
+	sim_plant_phase_currents(p, &i_ph[0], &i_ph[1], &i_ph[2]);
+
+	ADC_Value[ADC_IND_CURR1] = current_to_adc(i_ph[0], p->curr_offset[0]);
+	ADC_Value[ADC_IND_CURR2] = current_to_adc(i_ph[1], p->curr_offset[1]);
+#ifdef HW_HAS_3_SHUNTS
+	ADC_Value[ADC_IND_CURR3] = current_to_adc(i_ph[2], 0);
+	ADC_Value[ADC_IND_SENS1] = volts_to_adc(p->v_term[0]);
+	ADC_Value[ADC_IND_SENS2] = volts_to_adc(p->v_term[1]);
+	ADC_Value[ADC_IND_SENS3] = volts_to_adc(p->v_term[2]);
+#else
+	ADC_Value[ADC_IND_SENS1] = volts_to_adc(p->v_term[0]);
+	ADC_Value[ADC_IND_SENS3] = volts_to_adc(p->v_term[1]);
+	ADC_Value[ADC_IND_SENS2] = volts_to_adc(p->v_term[2]);
+#endif
+	ADC_Value[ADC_IND_VIN_SENS] = volts_to_adc(p->v_bus);
+	ADC_Value[ADC_IND_TEMP_MOS] = 2048;
+	ADC_Value[ADC_IND_TEMP_MOTOR] = 2048;
+}
+
+/*
+ * Injected conversions of one ADC, with the channels hw_setup_adc_channels
+ * gives them: ADC1 converts current 1 and 2, ADC2 current 2 and 1 and ADC3
+ * current 3.
+ */
+static void sample_adc_injected(int adc) {
+	const sim_plant_t *p = &sim_plant;
+
+	float i_ph[3];
+	sim_plant_phase_currents(p, &i_ph[0], &i_ph[1], &i_ph[2]);
+
+	switch (adc) {
+	case 0:
+		m_adc_inj[0][0] = current_to_adc(i_ph[0], p->curr_offset[0]);
+		m_adc_inj[0][1] = current_to_adc(i_ph[1], p->curr_offset[1]);
+		break;
+	case 1:
+		m_adc_inj[1][0] = current_to_adc(i_ph[1], p->curr_offset[1]);
+		m_adc_inj[1][1] = current_to_adc(i_ph[0], p->curr_offset[0]);
+		break;
+	default:
+		m_adc_inj[2][0] = current_to_adc(i_ph[2], 0);
+		m_adc_inj[2][1] = m_adc_inj[2][0];
+		break;
+	}
+}
+
+// The DMA interrupt that runs the control loop, timed and followed by the hook
+static void control_isr(void) {
+	const double t0 = host_time();
+	m_dma_func(m_dma_param, 0);
+	m_isr_time += host_time() - t0;
+	m_isr_calls++;
+
+	if (sim_isr_hook) {
+		sim_isr_hook();
+	}
+}
+
+static uint64_t tim2_tick(void) {
+	return ((uint64_t)sim_tim2.PSC + 1) * 2;
+}
+
+/*
+ * Advance the time, with TIM2 counting from the APB1 timer clock at half the
+ * core clock. The compare flag is set when the counter reaches CCR1.
+ */
+static void advance(uint64_t ticks) {
+	m_ticks += ticks;
+
+	if (!m_tim2_on) {
+		return;
+	}
+
+	m_tim2_frac += ticks;
+	const uint64_t counts = m_tim2_frac / tim2_tick();
+	m_tim2_frac -= counts * tim2_tick();
+
+	const uint32_t cnt = sim_tim2.CNT;
+	sim_tim2.CNT = cnt + (uint32_t)counts;
+	if (counts > 0 && (uint64_t)(uint32_t)(sim_tim2.CCR1 - cnt - 1) < counts) {
+		sim_tim2.SR |= TIM_SR_CC1IF;
+	}
+}
+
+// Core clock ticks until the TIM2 compare interrupt
+static uint64_t tim2_cc1_ticks(void) {
+	if (!m_tim2_on || !(sim_tim2.DIER & TIM_DIER_CC1IE) ||
+			(int32_t)(sim_tim2.CCR1 - sim_tim2.CNT) <= 0) {
+		return UINT64_MAX;
+	}
+
+	return (uint64_t)(sim_tim2.CCR1 - sim_tim2.CNT) * tim2_tick() - m_tim2_frac;
+}
+
+/*
+ * Bridge leg of every plant phase at a TIM1 count. The high side follows
+ * OCxREF when CCxE is set. The low side is the complement of it when CCxE is
+ * set too and follows OCxREF when only CCxNE is set.
+ */
+static void tim1_legs(uint32_t cnt, sim_leg_t leg[3]) {
+#ifdef HW_HAS_3_SHUNTS
+	const int ch_phase[3] = {0, 1, 2};
+#else
+	const int ch_phase[3] = {0, 2, 1};
+#endif
+
+	for (int i = 0;i < 3;i++) {
+		const int ch = ch_phase[i];
+		const sim_channel_t *c = &m_ch[ch];
+
+		bool ref;
+		switch (c->ocm) {
+		case TIM_OCMode_PWM1: ref = cnt < m_ccr[ch]; break;
+		case TIM_OCMode_PWM2: ref = cnt >= m_ccr[ch]; break;
+		case TIM_OCMode_Active:
+		case TIM_ForcedAction_Active: ref = true; break;
+		default: ref = false; break;
+		}
+
+		const bool high = m_tim1_moe && c->cce && ref;
+		const bool low = m_tim1_moe && c->ccne && (c->cce ? !ref : ref);
+		leg[i] = high ? SIM_LEG_HIGH : (low ? SIM_LEG_LOW : SIM_LEG_OFF);
+	}
+}
+
+// Time of a PWM1 falling edge trigger in a period, or none
+static uint64_t trigger_time(uint64_t t_start, uint32_t ccr) {
+	return (ccr > 0 && ccr <= m_arr) ? t_start + ccr : UINT64_MAX;
+}
+
+/*
+ * One up-counting PWM period, event by event. The update event at its start
+ * latches the timer top and the compare values of TIM1 and of TIM8, which
+ * it resets. Interrupts that are due after the end of the period run in the
+ * next one.
+ */
+static void edge_period(void) {
+	const sim_leg_t legs_off[3] = {SIM_LEG_OFF, SIM_LEG_OFF, SIM_LEG_OFF};
+
+	if (!m_tim1_on) {
+		sim_plant_run(&sim_plant, legs_off,
+				(float)SIM_IDLE_HALF_PERIOD / (float)SYSTEM_CORE_CLOCK);
+		advance(SIM_IDLE_HALF_PERIOD);
+		return;
+	}
+
+	if (!(sim_tim1.CR1 & TIM_CR1_UDIS)) {
+		m_arr = sim_tim1.ARR;
+		m_ccr[0] = sim_tim1.CCR1;
+		m_ccr[1] = sim_tim1.CCR2;
+		m_ccr[2] = sim_tim1.CCR3;
+		m_ccr4 = sim_tim1.CCR4;
+	}
+
+	if (!(sim_tim8.CR1 & TIM_CR1_UDIS)) {
+		m_tim8_ccr[0] = sim_tim8.CCR1;
+		m_tim8_ccr[1] = sim_tim8.CCR2;
+		m_tim8_ccr[2] = sim_tim8.CCR3;
+	}
+
+	if (m_arr == 0) {
+		m_arr = SIM_IDLE_HALF_PERIOD;
+	}
+
+	const uint64_t t_start = m_ticks;
+	const uint64_t t_end = t_start + m_arr;
+	uint64_t reg_at = m_adc_on ? trigger_time(t_start, m_tim8_ccr[0]) : UINT64_MAX;
+	uint64_t inj_trig_at[3] = {UINT64_MAX, UINT64_MAX, UINT64_MAX};
+	if (m_adc_on) {
+		inj_trig_at[0] = trigger_time(t_start, m_ccr4);
+		inj_trig_at[1] = trigger_time(t_start, m_tim8_ccr[1]);
+#ifdef HW_HAS_3_SHUNTS
+		inj_trig_at[2] = trigger_time(t_start, m_tim8_ccr[2]);
+#endif
+	}
+
+	for (;;) {
+		const uint32_t cnt = (uint32_t)(m_ticks - t_start);
+		sim_tim1.CNT = cnt;
+		m_in_isr = true;
+
+		if (reg_at == m_ticks) {
+			sample_adc();
+			reg_at = UINT64_MAX;
+			m_dma_at = m_ticks + HW_ADC_NBR_CONV * SIM_ADC_CONV_TICKS;
+		}
+
+		for (int i = 0;i < 3;i++) {
+			if (inj_trig_at[i] == m_ticks) {
+				sample_adc_injected(i);
+				inj_trig_at[i] = UINT64_MAX;
+				if (i == 0) {
+					m_inj_at = m_ticks + HW_ADC_INJ_CHANNELS * SIM_ADC_CONV_TICKS;
+				}
+			}
+		}
+
+		if (m_inj_at == m_ticks) {
+			m_inj_at = UINT64_MAX;
+			if (m_adc_jeoc_it && sim_vectors.adc_inj) {
+				sim_vectors.adc_inj();
+			}
+		}
+
+		if (m_dma_at == m_ticks) {
+			m_dma_at = UINT64_MAX;
+			if (m_dma_func && m_dma_it) {
+				control_isr();
+			}
+		}
+
+		if ((sim_tim2.SR & TIM_SR_CC1IF) && (sim_tim2.DIER & TIM_DIER_CC1IE)) {
+			// The TIM2 interrupt clears the flag before the handler
+			sim_tim2.SR &= ~TIM_SR_CC1IF;
+			if (sim_vectors.tim2_cc1) {
+				sim_vectors.tim2_cc1();
+			}
+		}
+
+		m_in_isr = false;
+
+		if (m_ticks >= t_end) {
+			break;
+		}
+
+		// The next event, PWM edges included
+		uint64_t next = t_end;
+		const uint64_t events[5] = {reg_at, inj_trig_at[0], inj_trig_at[1],
+				inj_trig_at[2], m_inj_at};
+		for (int i = 0;i < 5;i++) {
+			if (events[i] < next) {
+				next = events[i];
+			}
+		}
+		if (m_dma_at < next) {
+			next = m_dma_at;
+		}
+		for (int i = 0;i < 3;i++) {
+			if (m_ccr[i] > cnt && t_start + m_ccr[i] < next) {
+				next = t_start + m_ccr[i];
+			}
+		}
+		const uint64_t tim2_ticks = tim2_cc1_ticks();
+		if (tim2_ticks < next - m_ticks) {
+			next = m_ticks + tim2_ticks;
+		}
+
+		sim_leg_t leg[3];
+		tim1_legs(cnt, leg);
+		sim_plant_run(&sim_plant, leg, (float)(next - m_ticks) / (float)SYSTEM_CORE_CLOCK);
+		advance(next - m_ticks);
+	}
+}
+
+/*
+ * One half PWM period. The update event at its start latches the timer top
+ * and the compare values, TIM8 CC1 fires right after it, and the ADC samples
+ * the currents before the DMA interrupt runs the control loop. The compare
+ * values written by the control loop are latched at the next update event.
+ */
+static void half_period(void) {
+	if (m_tim1_up) {
+		edge_period();
+		return;
+	}
+
+	if (!m_tim1_on) {
+		sim_plant_half(&sim_plant, (float[3]){0.0, 0.0, 0.0}, false,
+				(float)SIM_IDLE_HALF_PERIOD / (float)SYSTEM_CORE_CLOCK, false);
+		m_ticks += SIM_IDLE_HALF_PERIOD;
+		return;
+	}
+
+	m_count_down = !m_count_down;
+	if (!(sim_tim1.CR1 & TIM_CR1_UDIS)) {
+		m_arr = sim_tim1.ARR;
+		m_ccr[0] = sim_tim1.CCR1;
+		m_ccr[1] = sim_tim1.CCR2;
+		m_ccr[2] = sim_tim1.CCR3;
+	}
+
+	if (m_count_down) {
+		sim_tim1.CR1 |= TIM_CR1_DIR;
+	} else {
+		sim_tim1.CR1 &= ~TIM_CR1_DIR;
+	}
+
+	if (m_tim8_cc1_irq && sim_vectors.tim8_cc1) {
+		m_in_isr = true;
+		sim_vectors.tim8_cc1();
+		m_in_isr = false;
+	}
+
+	sample_adc();
+
+	if (m_dma_func && m_dma_it && m_adc_on) {
+		m_in_isr = true;
+		if (m_count_down) {
+			control_isr();
+		} else {
+			m_dma_func(m_dma_param, 0);
+		}
+		m_in_isr = false;
+	}
+
+	if (m_arr == 0) {
+		m_arr = SIM_IDLE_HALF_PERIOD;
+	}
+
+	bool driven = m_tim1_moe;
+	for (int i = 0;i < 3;i++) {
+		if (m_ch[i].ocm != TIM_OCMode_PWM1 || !m_ch[i].cce || !m_ch[i].ccne) {
+			driven = false;
+		}
+	}
+
+	// TIM1 channel 2 and 3 drive phase 3 and 2 unless there are three shunts
+#ifdef HW_HAS_3_SHUNTS
+	const uint32_t ccr[3] = {m_ccr[0], m_ccr[1], m_ccr[2]};
+#else
+	const uint32_t ccr[3] = {m_ccr[0], m_ccr[2], m_ccr[1]};
+#endif
+
+	const float t_half = (float)m_arr / (float)SYSTEM_CORE_CLOCK;
+	float on[3];
+	for (int i = 0;i < 3;i++) {
+		const uint32_t cnt = ccr[i] > m_arr ? m_arr : ccr[i];
+		on[i] = (float)cnt / (float)SYSTEM_CORE_CLOCK;
+	}
+
+	sim_plant_half(&sim_plant, on, m_count_down, t_half, driven);
+	m_ticks += m_arr;
+}
+
+/*
+ * One (half) period with the system locked. The lock depth goes up before the
+ * mutex is taken and down after it is released, so that an interrupt signal
+ * that arrives anywhere in chSysLock or chSysUnlock waits for the unlock.
+ */
+static void run_irq(void) {
+	m_lock_depth++;
+	pthread_mutex_lock(&m_irq_mtx);
+	half_period();
+	pthread_mutex_unlock(&m_irq_mtx);
+	m_lock_depth--;
+}
+
+static void irq_signal_handler(int sig) {
+	(void)sig;
+
+	if (m_lock_depth > 0) {
+		m_irq_pending = true;
+		return;
+	}
+
+	const int errno_saved = errno;
+	run_irq();
+	sem_post(&m_irq_done);
+	errno = errno_saved;
+}
+
+/*
+ * Run the next half period on a thread that does not sleep, as an interrupt
+ * of that thread. Returns false if all threads sleep by now.
+ */
+static bool preempt_thread(void) {
+	pthread_mutex_lock(&m_sched_mtx);
+	struct sim_thread *t = 0;
+	for (int i = 0;i < SIM_THREADS_MAX;i++) {
+		if (m_threads[i].used && m_threads[i].started && !m_threads[i].sleeping) {
+			t = &m_threads[i];
+			break;
+		}
+	}
+
+	// The thread cannot exit before it has the scheduler mutex
+	if (t) {
+		pthread_kill(t->th, SIM_IRQ_SIGNAL);
+	}
+	pthread_mutex_unlock(&m_sched_mtx);
+
+	if (!t) {
+		return false;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += SIM_IRQ_TIMEOUT;
+	while (sem_timedwait(&m_irq_done, &ts) != 0) {
+		if (errno == ETIMEDOUT) {
+			sim_fatal("interrupts masked for too long");
+		}
+	}
+
+	m_isr_preempt++;
+	return true;
+}
+
+static void *isr_thread(void *arg) {
+	(void)arg;
+	bool busy = false;
+
+	while (!m_stop) {
+		// Let the threads that just woke up finish before the time moves on
+		if (__atomic_load_n(&m_running, __ATOMIC_ACQUIRE) > 0) {
+			if (!busy) {
+				const double t0 = host_time();
+				while (__atomic_load_n(&m_running, __ATOMIC_ACQUIRE) > 0 &&
+						(host_time() - t0) < SIM_BUSY_WAIT_TIMEOUT) {
+					sched_yield();
+				}
+				busy = __atomic_load_n(&m_running, __ATOMIC_ACQUIRE) > 0;
+			}
+		} else {
+			busy = false;
+		}
+
+		if (!busy || !preempt_thread()) {
+			run_irq();
+		}
+
+		wake_threads();
+	}
+
+	return NULL;
+}
+
+void sim_os_start(void) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m_irq_mtx, &attr);
+
+	sem_init(&m_irq_done, 0, 0);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = irq_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIM_IRQ_SIGNAL, &sa, NULL);
+
+	m_self = thread_alloc();
+	m_self->th = pthread_self();
+	m_self->started = true;
+	m_running = 1;
+
+	pthread_create(&m_isr_th, NULL, isr_thread, NULL);
+}
+
+void sim_os_stop(void) {
+	m_stop = true;
+
+	// The interrupt thread may wait for this thread
+	pthread_mutex_lock(&m_sched_mtx);
+	m_running--;
+	pthread_mutex_unlock(&m_sched_mtx);
+
+	pthread_join(m_isr_th, NULL);
+}
+
+double sim_time(void) {
+	return (double)__atomic_load_n(&m_ticks, __ATOMIC_RELAXED) / (double)SYSTEM_CORE_CLOCK;
+}
+
+uint64_t sim_isr_calls(void) {
+	return m_isr_calls;
+}
+
+/**
+ * The number of half periods that ran as an interrupt of a busy thread.
+ */
+uint64_t sim_isr_preempt_calls(void) {
+	return m_isr_preempt;
+}
+
+double sim_isr_ns(void) {
+	return m_isr_calls ? m_isr_time * 1e9 / (double)m_isr_calls : 0.0;
+}
+
+void sim_set_hall_angle_offset(float offset) {
+	m_hall_offset = offset;
+}
+
+/**
+ * The hall sensor code at an electrical angle. The sensors are 120 degrees
+ * apart, with sensor 1 high from 0 to 180 degrees plus the offset.
+ */
+int sim_hall_code(float th) {
+	int code = 0;
+	for (int i = 0;i < 3;i++) {
+		if (sinf(th + m_hall_offset - (float)i * (2.0 * M_PI / 3.0)) > 0.0) {
+			code |= 1 << i;
+		}
+	}
+	return code;
+}
+
+// Kernel
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg) {
+	(void)wsp;
+	(void)size;
+	(void)prio;
+
+	pthread_mutex_lock(&m_sched_mtx);
+	struct sim_thread *t = thread_alloc();
+	t->func = pf;
+	t->arg = arg;
+	m_running++;
+	pthread_mutex_unlock(&m_sched_mtx);
+
+	pthread_create(&t->th, NULL, thread_entry, t);
+	return t;
+}
+
+void chThdSleep(systime_t time) {
+	check_thread_context("chThdSleep with the system locked or in an interrupt");
+
+	struct sim_thread *t = m_self;
+	pthread_mutex_lock(&m_sched_mtx);
+	t->wake = __atomic_load_n(&m_ticks, __ATOMIC_RELAXED) + (uint64_t)time * SIM_TICKS_PER_ST;
+	t->sleeping = true;
+	if (t->wake < m_next_wake) {
+		__atomic_store_n(&m_next_wake, t->wake, __ATOMIC_RELEASE);
+	}
+	m_running--;
+	while (t->sleeping && !m_stop) {
+		pthread_cond_wait(&t->cond, &m_sched_mtx);
+	}
+	pthread_mutex_unlock(&m_sched_mtx);
+}
+
+void chThdSleepMilliseconds(uint32_t msec) {
+	chThdSleep(MS2ST(msec));
+}
+
+void chThdSleepMicroseconds(uint32_t usec) {
+	chThdSleep(US2ST(usec));
+}
+
+void chSysLock(void) {
+	m_lock_depth++;
+	pthread_mutex_lock(&m_irq_mtx);
+}
+
+void chSysUnlock(void) {
+	pthread_mutex_unlock(&m_irq_mtx);
+	m_lock_depth--;
+
+	// An interrupt that arrived while the system was locked
+	if (m_lock_depth == 0 && m_irq_pending) {
+		m_irq_pending = false;
+		run_irq();
+		sem_post(&m_irq_done);
+	}
+}
+
+void chMtxObjectInit(mutex_t *mp) {
+	pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(m, NULL);
+	mp->impl = m;
+}
+
+void chMtxLock(mutex_t *mp) {
+	check_thread_context("chMtxLock with the system locked or in an interrupt");
+	pthread_mutex_lock((pthread_mutex_t*)mp->impl);
+	mp->locked = true;
+}
+
+void chMtxUnlock(mutex_t *mp) {
+	mp->locked = false;
+	pthread_mutex_unlock((pthread_mutex_t*)mp->impl);
+}
+
+systime_t chVTGetSystemTime(void) {
+	return (systime_t)(__atomic_load_n(&m_ticks, __ATOMIC_RELAXED) / SIM_TICKS_PER_ST);
+}
+
+// HAL
+void sim_pal_write(GPIO_TypeDef *port, int pad, int value) {
+	(void)port;
+	(void)pad;
+	(void)value;
+}
+
+int sim_pal_read(GPIO_TypeDef *port, int pad) {
+	const GPIO_TypeDef *hall_port[3] = {HW_HALL_ENC_GPIO1, HW_HALL_ENC_GPIO2, HW_HALL_ENC_GPIO3};
+	const int hall_pin[3] = {HW_HALL_ENC_PIN1, HW_HALL_ENC_PIN2, HW_HALL_ENC_PIN3};
+
+	for (int i = 0;i < 3;i++) {
+		if (port == hall_port[i] && pad == hall_pin[i]) {
+			return (sim_hall_code(sim_plant.th) >> i) & 1;
+		}
+	}
+
+	// Inputs such as the gate driver fault are inactive high
+	return 1;
+}
+
+bool dmaStreamAllocate(const stm32_dma_stream_t *dmastp, uint32_t priority,
+		stm32_dmaisr_t func, void *param) {
+	(void)dmastp;
+	(void)priority;
+	m_dma_func = func;
+	m_dma_param = param;
+	return false;
+}
+
+void dmaStreamRelease(const stm32_dma_stream_t *dmastp) {
+	(void)dmastp;
+	m_dma_func = 0;
+}
+
+void nvicEnableVector(IRQn_Type n, uint32_t prio) {
+	(void)n;
+	(void)prio;
+}
+
+void nvicDisableVector(IRQn_Type n) {
+	(void)n;
+}
+
+// StdPeriph
+static int tim_channel_index(uint16_t channel) {
+	return channel / TIM_Channel_2;
+}
+
+void TIM_DeInit(TIM_TypeDef* TIMx) {
+	memset(TIMx, 0, sizeof(TIM_TypeDef));
+	if (TIMx == TIM1) {
+		m_tim1_on = false;
+		m_tim1_moe = false;
+		m_tim1_ccpc = false;
+		memset(m_ch_pre, 0, sizeof(m_ch_pre));
+		memset(m_ch, 0, sizeof(m_ch));
+	} else if (TIMx == TIM2) {
+		m_tim2_on = false;
+		m_tim2_frac = 0;
+	} else if (TIMx == TIM8) {
+		m_tim8_cc1_irq = false;
+	}
+}
+
+void TIM_TimeBaseInit(TIM_TypeDef* TIMx, TIM_TimeBaseInitTypeDef* TIM_TimeBaseInitStruct) {
+	TIMx->ARR = TIM_TimeBaseInitStruct->TIM_Period;
+	TIMx->PSC = TIM_TimeBaseInitStruct->TIM_Prescaler;
+	if (TIMx == TIM1) {
+		m_tim1_up = TIM_TimeBaseInitStruct->TIM_CounterMode == TIM_CounterMode_Up;
+	}
+}
+
+static void tim_oc_init(TIM_TypeDef* TIMx, int ch, TIM_OCInitTypeDef* oc) {
+	if (TIMx == TIM1 && ch < 3) {
+		m_ch_pre[ch].ocm = oc->TIM_OCMode;
+		m_ch_pre[ch].cce = oc->TIM_OutputState == TIM_OutputState_Enable;
+		m_ch_pre[ch].ccne = oc->TIM_OutputNState == TIM_OutputNState_Enable;
+		m_ch[ch] = m_ch_pre[ch];
+	}
+
+	switch (ch) {
+	case 0: TIMx->CCR1 = oc->TIM_Pulse; break;
+	case 1: TIMx->CCR2 = oc->TIM_Pulse; break;
+	case 2: TIMx->CCR3 = oc->TIM_Pulse; break;
+	default: TIMx->CCR4 = oc->TIM_Pulse; break;
+	}
+}
+
+void TIM_OC1Init(TIM_TypeDef* TIMx, TIM_OCInitTypeDef* TIM_OCInitStruct) {
+	tim_oc_init(TIMx, 0, TIM_OCInitStruct);
+}
+
+void TIM_OC2Init(TIM_TypeDef* TIMx, TIM_OCInitTypeDef* TIM_OCInitStruct) {
+	tim_oc_init(TIMx, 1, TIM_OCInitStruct);
+}
+
+void TIM_OC3Init(TIM_TypeDef* TIMx, TIM_OCInitTypeDef* TIM_OCInitStruct) {
+	tim_oc_init(TIMx, 2, TIM_OCInitStruct);
+}
+
+void TIM_OC4Init(TIM_TypeDef* TIMx, TIM_OCInitTypeDef* TIM_OCInitStruct) {
+	tim_oc_init(TIMx, 3, TIM_OCInitStruct);
+}
+
+void TIM_OC1PreloadConfig(TIM_TypeDef* TIMx, uint16_t TIM_OCPreload) {
+	(void)TIMx;
+	(void)TIM_OCPreload;
+}
+
+void TIM_OC2PreloadConfig(TIM_TypeDef* TIMx, uint16_t TIM_OCPreload) {
+	(void)TIMx;
+	(void)TIM_OCPreload;
+}
+
+void TIM_OC3PreloadConfig(TIM_TypeDef* TIMx, uint16_t TIM_OCPreload) {
+	(void)TIMx;
+	(void)TIM_OCPreload;
+}
+
+void TIM_OC4PreloadConfig(TIM_TypeDef* TIMx, uint16_t TIM_OCPreload) {
+	(void)TIMx;
+	(void)TIM_OCPreload;
+}
+
+void TIM_BDTRConfig(TIM_TypeDef* TIMx, TIM_BDTRInitTypeDef *TIM_BDTRInitStruct) {
+	(void)TIMx;
+	(void)TIM_BDTRInitStruct;
+}
+
+void TIM_CCPreloadControl(TIM_TypeDef* TIMx, FunctionalState NewState) {
+	if (TIMx == TIM1) {
+		m_tim1_ccpc = NewState == ENABLE;
+	}
+}
+
+void TIM_ARRPreloadConfig(TIM_TypeDef* TIMx, FunctionalState NewState) {
+	(void)TIMx;
+	(void)NewState;
+}
+
+void TIM_CtrlPWMOutputs(TIM_TypeDef* TIMx, FunctionalState NewState) {
+	if (TIMx == TIM1) {
+		m_tim1_moe = NewState == ENABLE;
+	}
+}
+
+void TIM_SelectOutputTrigger(TIM_TypeDef* TIMx, uint16_t TIM_TRGOSource) {
+	(void)TIMx;
+	(void)TIM_TRGOSource;
+}
+
+void TIM_SelectMasterSlaveMode(TIM_TypeDef* TIMx, uint16_t TIM_MasterSlaveMode) {
+	(void)TIMx;
+	(void)TIM_MasterSlaveMode;
+}
+
+void TIM_SelectInputTrigger(TIM_TypeDef* TIMx, uint16_t TIM_InputTriggerSource) {
+	(void)TIMx;
+	(void)TIM_InputTriggerSource;
+}
+
+void TIM_SelectSlaveMode(TIM_TypeDef* TIMx, uint16_t TIM_SlaveMode) {
+	(void)TIMx;
+	(void)TIM_SlaveMode;
+}
+
+void TIM_Cmd(TIM_TypeDef* TIMx, FunctionalState NewState) {
+	if (TIMx == TIM1) {
+		m_tim1_on = NewState == ENABLE;
+	} else if (TIMx == TIM2) {
+		m_tim2_on = NewState == ENABLE;
+	}
+}
+
+void TIM_ITConfig(TIM_TypeDef* TIMx, uint16_t TIM_IT, FunctionalState NewState) {
+	if (TIMx == TIM8 && (TIM_IT & TIM_IT_CC1)) {
+		m_tim8_cc1_irq = NewState == ENABLE;
+	}
+}
+
+void TIM_ClearITPendingBit(TIM_TypeDef* TIMx, uint16_t TIM_IT) {
+	TIMx->SR = ~(uint32_t)TIM_IT;
+}
+
+void TIM_SelectOCxM(TIM_TypeDef* TIMx, uint16_t TIM_Channel, uint16_t TIM_OCMode) {
+	if (TIMx == TIM1) {
+		const int ch = tim_channel_index(TIM_Channel);
+		m_ch_pre[ch].ocm = TIM_OCMode;
+		if (!m_tim1_ccpc) {
+			m_ch[ch] = m_ch_pre[ch];
+		}
+	}
+}
+
+void TIM_CCxCmd(TIM_TypeDef* TIMx, uint16_t TIM_Channel, uint16_t TIM_CCx) {
+	if (TIMx == TIM1) {
+		const int ch = tim_channel_index(TIM_Channel);
+		m_ch_pre[ch].cce = TIM_CCx == TIM_CCx_Enable;
+		if (!m_tim1_ccpc) {
+			m_ch[ch] = m_ch_pre[ch];
+		}
+	}
+}
+
+void TIM_CCxNCmd(TIM_TypeDef* TIMx, uint16_t TIM_Channel, uint16_t TIM_CCxN) {
+	if (TIMx == TIM1) {
+		const int ch = tim_channel_index(TIM_Channel);
+		m_ch_pre[ch].ccne = TIM_CCxN == TIM_CCxN_Enable;
+		if (!m_tim1_ccpc) {
+			m_ch[ch] = m_ch_pre[ch];
+		}
+	}
+}
+
+void TIM_GenerateEvent(TIM_TypeDef* TIMx, uint16_t TIM_EventSource) {
+	if (TIMx == TIM1 && (TIM_EventSource & TIM_EventSource_COM)) {
+		memcpy(m_ch, m_ch_pre, sizeof(m_ch));
+		if (sim_com_hook) {
+			sim_com_hook();
+		}
+	}
+}
+
+void ADC_DeInit(void) {
+	m_adc_on = false;
+}
+
+void ADC_Init(ADC_TypeDef* ADCx, ADC_InitTypeDef* ADC_InitStruct) {
+	(void)ADCx;
+	(void)ADC_InitStruct;
+}
+
+void ADC_CommonInit(ADC_CommonInitTypeDef* ADC_CommonInitStruct) {
+	(void)ADC_CommonInitStruct;
+}
+
+void ADC_Cmd(ADC_TypeDef* ADCx, FunctionalState NewState) {
+	if (ADCx == ADC1) {
+		m_adc_on = NewState == ENABLE;
+	}
+}
+
+void ADC_ITConfig(ADC_TypeDef* ADCx, uint16_t ADC_IT, FunctionalState NewState) {
+	if (ADCx == ADC1 && ADC_IT == ADC_IT_JEOC) {
+		m_adc_jeoc_it = NewState == ENABLE;
+	}
+}
+
+void ADC_ExternalTrigInjectedConvConfig(ADC_TypeDef* ADCx, uint32_t ADC_ExternalTrigInjecConv) {
+	(void)ADCx;
+	(void)ADC_ExternalTrigInjecConv;
+}
+
+void ADC_ExternalTrigInjectedConvEdgeConfig(ADC_TypeDef* ADCx, uint32_t ADC_ExternalTrigInjecConvEdge) {
+	(void)ADCx;
+	(void)ADC_ExternalTrigInjecConvEdge;
+}
+
+void ADC_InjectedSequencerLengthConfig(ADC_TypeDef* ADCx, uint8_t Length) {
+	(void)ADCx;
+	(void)Length;
+}
+
+uint16_t ADC_GetInjectedConversionValue(ADC_TypeDef* ADCx, uint8_t ADC_InjectedChannel) {
+	const int adc = ADCx == ADC1 ? 0 : (ADCx == ADC2 ? 1 : 2);
+	const int ch = (ADC_InjectedChannel - ADC_InjectedChannel_1) / 4;
+	return ch < 2 ? m_adc_inj[adc][ch] : 0;
+}
+
+void ADC_TempSensorVrefintCmd(FunctionalState NewState) {
+	(void)NewState;
+}
+
+void ADC_MultiModeDMARequestAfterLastTransferCmd(FunctionalState NewState) {
+	(void)NewState;
+}
+
+void DMA_DeInit(DMA_Stream_TypeDef* DMAy_Streamx) {
+	(void)DMAy_Streamx;
+	m_dma_it = false;
+}
+
+void DMA_Init(DMA_Stream_TypeDef* DMAy_Streamx, DMA_InitTypeDef* DMA_InitStruct) {
+	(void)DMAy_Streamx;
+	(void)DMA_InitStruct;
+}
+
+void DMA_Cmd(DMA_Stream_TypeDef* DMAy_Streamx, FunctionalState NewState) {
+	(void)DMAy_Streamx;
+	(void)NewState;
+}
+
+void DMA_ITConfig(DMA_Stream_TypeDef* DMAy_Streamx, uint32_t DMA_IT, FunctionalState NewState) {
+	(void)DMAy_Streamx;
+	if (DMA_IT & DMA_IT_TC) {
+		m_dma_it = NewState == ENABLE;
+	}
+}
+
+void RCC_AHB1PeriphClockCmd(uint32_t RCC_AHB1Periph, FunctionalState NewState) {
+	(void)RCC_AHB1Periph;
+	(void)NewState;
+}
+
+void RCC_APB1PeriphClockCmd(uint32_t RCC_APB1Periph, FunctionalState NewState) {
+	(void)RCC_APB1Periph;
+	(void)NewState;
+}
+
+void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState) {
+	(void)RCC_APB2Periph;
+	(void)NewState;
+}
+
+void WWDG_DeInit(void) {
+}
+
+void WWDG_SetPrescaler(uint32_t WWDG_Prescaler) {
+	(void)WWDG_Prescaler;
+}
+
+void WWDG_SetWindowValue(uint8_t WindowValue) {
+	(void)WindowValue;
+}
+
+void WWDG_Enable(uint8_t Counter) {
+	(void)Counter;
+}
+
+void WWDG_SetCounter(uint8_t Counter) {
+	(void)Counter;
+}
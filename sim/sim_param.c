@@ -0,0 +1,72 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * name=value arguments of the simulator programs, written straight into the
+ * structures they describe.
+ */
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool sim_set_param(const param_t *params, int len, void *base,
+		const char *name, const char *value) {
+	for (int i = 0;i < len;i++) {
+		if (strcmp(params[i].name, name) != 0) {
+			continue;
+		}
+
+		char *ptr = (char*)base + params[i].offset;
+		switch (params[i].type) {
+		case PARAM_FLOAT:
+			*(float*)ptr = strtof(value, 0);
+			break;
+		case PARAM_INT:
+			*(int*)ptr = (int)strtol(value, 0, 0);
+			break;
+		case PARAM_BOOL:
+			*(bool*)ptr = strtol(value, 0, 0) != 0;
+			break;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+void sim_print_params(const param_t *params, int len, const void *base) {
+	for (int i = 0;i < len;i++) {
+		const char *ptr = (const char*)base + params[i].offset;
+		switch (params[i].type) {
+		case PARAM_FLOAT:
+			printf("  %s=%g\n", params[i].name, (double)*(const float*)ptr);
+			break;
+		case PARAM_INT:
+			printf("  %s=%d\n", params[i].name, *(const int*)ptr);
+			break;
+		case PARAM_BOOL:
+			printf("  %s=%d\n", params[i].name, *(const bool*)ptr);
+			break;
+		}
+	}
+}
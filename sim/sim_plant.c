@@ -0,0 +1,488 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#include "sim.h"
+#include <math.h>
+
+#define SQRT3_BY_2		0.8660254037844386
+
+// Largest integration step. The averaged model uses one step per half period.
+#define SIM_STEP_MAX	5e-6
+// Smallest incremental d axis inductance with saturation, relative to ld
+#define SIM_LD_SAT_MIN	0.2
+// Integration step while a switched off leg conducts through a diode, so
+// that the end of the conduction is found in time
+#define SIM_STEP_DIODE	0.2e-6
+// Phase current below which a switched off leg does not conduct, A
+#define SIM_I_OPEN		1e-3
+
+typedef struct {
+	float id;
+	float iq;
+	float w;
+	float th;
+} plant_state_t;
+
+// Electrical acceleration for a motor torque at an electrical speed
+static float accel(const sim_plant_t *p, float w, float torque) {
+	if (p->speed_fixed) {
+		return p->w_accel;
+	} else if (p->j <= 0.0) {
+		return 0.0;
+	}
+
+	const float w_mech = w / p->pole_pairs;
+	float load = p->load;
+	if (w_mech < 0.0) {
+		load = -load;
+	} else if (w_mech == 0.0 && fabsf(torque) < load) {
+		load = torque;
+	}
+	return p->pole_pairs * (torque - load - p->b * w_mech) / p->j;
+}
+
+static void derivative(const sim_plant_t *p, const plant_state_t *x,
+		float v_alpha, float v_beta, bool driven, plant_state_t *dx) {
+	if (driven) {
+		const float s = sinf(x->th);
+		const float c = cosf(x->th);
+		const float vd = c * v_alpha + s * v_beta;
+		const float vq = c * v_beta - s * v_alpha;
+
+		const float ld_inc = p->ld * fmaxf(1.0 - p->ld_sat * x->id, SIM_LD_SAT_MIN);
+
+		dx->id = (vd - p->r * x->id + x->w * p->lq * x->iq) / ld_inc;
+		dx->iq = (vq - p->r * x->iq - x->w * p->ld * x->id - x->w * p->lambda) / p->lq;
+	} else {
+		dx->id = 0.0;
+		dx->iq = 0.0;
+	}
+
+	dx->w = accel(p, x->w, 1.5 * p->pole_pairs *
+			(p->lambda * x->iq + (p->ld - p->lq) * x->id * x->iq));
+	dx->th = x->w;
+}
+
+static void integrate(sim_plant_t *p, float v_alpha, float v_beta, float t, bool driven) {
+	plant_state_t x = {p->id, p->iq, p->w, p->th};
+
+	int steps = p->avg ? 1 : (int)ceilf(t / SIM_STEP_MAX);
+	if (steps < 1) {
+		steps = 1;
+	}
+	const float h = t / (float)steps;
+
+	for (int i = 0;i < steps;i++) {
+		plant_state_t k1, k2, k3, k4, tmp;
+
+		derivative(p, &x, v_alpha, v_beta, driven, &k1);
+		tmp.id = x.id + 0.5 * h * k1.id;
+		tmp.iq = x.iq + 0.5 * h * k1.iq;
+		tmp.w = x.w + 0.5 * h * k1.w;
+		tmp.th = x.th + 0.5 * h * k1.th;
+		derivative(p, &tmp, v_alpha, v_beta, driven, &k2);
+		tmp.id = x.id + 0.5 * h * k2.id;
+		tmp.iq = x.iq + 0.5 * h * k2.iq;
+		tmp.w = x.w + 0.5 * h * k2.w;
+		tmp.th = x.th + 0.5 * h * k2.th;
+		derivative(p, &tmp, v_alpha, v_beta, driven, &k3);
+		tmp.id = x.id + h * k3.id;
+		tmp.iq = x.iq + h * k3.iq;
+		tmp.w = x.w + h * k3.w;
+		tmp.th = x.th + h * k3.th;
+		derivative(p, &tmp, v_alpha, v_beta, driven, &k4);
+
+		x.id += (h / 6.0) * (k1.id + 2.0 * k2.id + 2.0 * k3.id + k4.id);
+		x.iq += (h / 6.0) * (k1.iq + 2.0 * k2.iq + 2.0 * k3.iq + k4.iq);
+		x.w += (h / 6.0) * (k1.w + 2.0 * k2.w + 2.0 * k3.w + k4.w);
+		x.th += (h / 6.0) * (k1.th + 2.0 * k2.th + 2.0 * k3.th + k4.th);
+
+		if (x.iq < p->iq_min) {
+			p->iq_min = x.iq;
+		}
+		if (x.iq > p->iq_max) {
+			p->iq_max = x.iq;
+		}
+	}
+
+	x.th = fmodf(x.th, 2.0 * M_PI);
+	if (x.th < 0.0) {
+		x.th += 2.0 * M_PI;
+	}
+
+	p->id = x.id;
+	p->iq = x.iq;
+	p->w = x.w;
+	p->th = x.th;
+}
+
+void sim_plant_phase_currents(const sim_plant_t *p, float *ia, float *ib, float *ic) {
+	const float s = sinf(p->th);
+	const float c = cosf(p->th);
+	const float i_alpha = c * p->id - s * p->iq;
+	const float i_beta = s * p->id + c * p->iq;
+
+	*ia = i_alpha;
+	*ib = -0.5 * i_alpha + SQRT3_BY_2 * i_beta;
+	*ic = -*ia - *ib;
+}
+
+float sim_plant_torque(const sim_plant_t *p) {
+	return 1.5 * p->pole_pairs * (p->lambda * p->iq + (p->ld - p->lq) * p->id * p->iq);
+}
+
+/**
+ * Run the plant over one half PWM period.
+ *
+ * @param p
+ * The plant.
+ *
+ * @param on
+ * High side on time of each phase in this half period.
+ *
+ * @param on_at_end
+ * The timer counts down in this half period, so the high sides are on at its
+ * end. Otherwise they are on at its start.
+ *
+ * @param t_half
+ * Length of the half period.
+ *
+ * @param driven
+ * The bridge is switching. Otherwise all switches are off and the currents
+ * are zero.
+ */
+void sim_plant_half(sim_plant_t *p, const float on[3], bool on_at_end,
+		float t_half, bool driven) {
+	if (!driven) {
+		p->id = 0.0;
+		p->iq = 0.0;
+		integrate(p, 0.0, 0.0, t_half, false);
+
+		// Floating terminals follow the back emf around half the bus voltage
+		const float e_alpha = -p->w * p->lambda * sinf(p->th);
+		const float e_beta = p->w * p->lambda * cosf(p->th);
+		p->v_term[0] = 0.5 * p->v_bus + e_alpha;
+		p->v_term[1] = 0.5 * p->v_bus - 0.5 * e_alpha + SQRT3_BY_2 * e_beta;
+		p->v_term[2] = 0.5 * p->v_bus - 0.5 * e_alpha - SQRT3_BY_2 * e_beta;
+		for (int i = 0;i < 3;i++) {
+			if (p->v_term[i] < 0.0) {
+				p->v_term[i] = 0.0;
+			} else if (p->v_term[i] > p->v_bus) {
+				p->v_term[i] = p->v_bus;
+			}
+		}
+		return;
+	}
+
+	// The dead time delays the high side turn on at the end of the half period
+	// for current flowing into the motor, and extends the high side on time at
+	// the start of it for current flowing out of the motor.
+	float i_ph[3];
+	sim_plant_phase_currents(p, &i_ph[0], &i_ph[1], &i_ph[2]);
+
+	float t_on[3];
+	for (int i = 0;i < 3;i++) {
+		t_on[i] = on[i];
+		if (on_at_end && i_ph[i] > 0.0) {
+			t_on[i] -= p->dead_time;
+		} else if (!on_at_end && i_ph[i] < 0.0) {
+			t_on[i] += p->dead_time;
+		}
+
+		if (t_on[i] < 0.0) {
+			t_on[i] = 0.0;
+		} else if (t_on[i] > t_half) {
+			t_on[i] = t_half;
+		}
+
+		p->v_term[i] = p->v_bus * t_on[i] / t_half;
+	}
+
+	if (p->avg) {
+		const float *v = p->v_term;
+		const float v_alpha = (2.0 / 3.0) * v[0] - (1.0 / 3.0) * v[1] - (1.0 / 3.0) * v[2];
+		const float v_beta = (v[1] - v[2]) / (2.0 * SQRT3_BY_2);
+		integrate(p, v_alpha, v_beta, t_half, true);
+		return;
+	}
+
+	// Switching instants from the start of the half period, in order
+	float edge[3];
+	for (int i = 0;i < 3;i++) {
+		edge[i] = on_at_end ? t_half - t_on[i] : t_on[i];
+	}
+
+	int order[3] = {0, 1, 2};
+	for (int i = 0;i < 2;i++) {
+		for (int j = 0;j < 2 - i;j++) {
+			if (edge[order[j]] > edge[order[j + 1]]) {
+				const int tmp = order[j];
+				order[j] = order[j + 1];
+				order[j + 1] = tmp;
+			}
+		}
+	}
+
+	// The high sides start off when counting down and on when counting up
+	float v[3];
+	for (int i = 0;i < 3;i++) {
+		v[i] = on_at_end ? 0.0 : p->v_bus;
+	}
+
+	float t_now = 0.0;
+	for (int k = 0;k <= 3;k++) {
+		const float t_next = k < 3 ? edge[order[k]] : t_half;
+		if (t_next > t_now) {
+			const float v_alpha = (2.0 / 3.0) * v[0] - (1.0 / 3.0) * v[1] - (1.0 / 3.0) * v[2];
+			const float v_beta = (v[1] - v[2]) / (2.0 * SQRT3_BY_2);
+			integrate(p, v_alpha, v_beta, t_next - t_now, true);
+			t_now = t_next;
+		}
+
+		if (k < 3) {
+			v[order[k]] = on_at_end ? p->v_bus : 0.0;
+		}
+	}
+}
+
+// Back emf of the phases at an electrical speed and angle
+static void back_emf(const sim_plant_t *p, float w, float th, float e[3]) {
+	e[0] = -w * p->lambda * sinf(th);
+	e[1] = -w * p->lambda * sinf(th - (2.0 * M_PI / 3.0));
+	e[2] = -w * p->lambda * sinf(th + (2.0 * M_PI / 3.0));
+}
+
+/*
+ * Terminal voltages for the leg states, the phase currents i and the back
+ * emfs e. A switched off leg conducts through a body diode while its phase
+ * has current. Without current the phase floats at the star point voltage
+ * plus its back emf, until that gets outside the bus and a diode starts to
+ * conduct. Returns the phases that are connected to the bus as a bit mask.
+ */
+static int terminal_voltages(const sim_plant_t *p, const sim_leg_t leg[3],
+		const float i[3], const float e[3], float v[3]) {
+	int conn = 0;
+	for (int k = 0;k < 3;k++) {
+		if (leg[k] == SIM_LEG_HIGH || (leg[k] == SIM_LEG_OFF && i[k] < -SIM_I_OPEN)) {
+			v[k] = p->v_bus;
+			conn |= 1 << k;
+		} else if (leg[k] == SIM_LEG_LOW || (leg[k] == SIM_LEG_OFF && i[k] > SIM_I_OPEN)) {
+			v[k] = 0.0;
+			conn |= 1 << k;
+		}
+	}
+
+	// A diode that starts to conduct moves the star point, so repeat
+	for (int iter = 0;iter < 3 && conn != 7;iter++) {
+		float sum = 0.0;
+		int n = 0;
+		for (int k = 0;k < 3;k++) {
+			if (conn & (1 << k)) {
+				sum += v[k] - e[k];
+				n++;
+			}
+		}
+		const float vn = n > 0 ? sum / (float)n : 0.5 * p->v_bus;
+
+		bool changed = false;
+		for (int k = 0;k < 3;k++) {
+			if (conn & (1 << k)) {
+				continue;
+			}
+
+			v[k] = vn + e[k];
+			if (v[k] > p->v_bus) {
+				v[k] = p->v_bus;
+				conn |= 1 << k;
+				changed = true;
+			} else if (v[k] < 0.0) {
+				v[k] = 0.0;
+				conn |= 1 << k;
+				changed = true;
+			}
+		}
+
+		if (!changed) {
+			break;
+		}
+	}
+
+	return conn;
+}
+
+// Remove the current of the phases that are not in the mask conn
+static void project_currents(float i[3], int conn) {
+	if (conn == 7) {
+		return;
+	}
+
+	int pair[2];
+	int n = 0;
+	for (int k = 0;k < 3;k++) {
+		if (conn & (1 << k)) {
+			if (n < 2) {
+				pair[n] = k;
+			}
+			n++;
+		} else {
+			i[k] = 0.0;
+		}
+	}
+
+	if (n == 2) {
+		const float i_pair = 0.5 * (i[pair[0]] - i[pair[1]]);
+		i[pair[0]] = i_pair;
+		i[pair[1]] = -i_pair;
+	} else {
+		i[0] = 0.0;
+		i[1] = 0.0;
+		i[2] = 0.0;
+	}
+}
+
+/*
+ * Derivative of the phase model state x, which is the phase currents, the
+ * electrical speed and the electrical angle, with the terminal voltages v of
+ * the phases in conn.
+ */
+static void derivative_abc(const sim_plant_t *p, const float x[5],
+		const float v[3], int conn, float dx[5]) {
+	const float l = 0.5 * (p->ld + p->lq);
+	float e[3];
+	back_emf(p, x[3], x[4], e);
+
+	dx[0] = 0.0;
+	dx[1] = 0.0;
+	dx[2] = 0.0;
+
+	if (conn == 7) {
+		// The back emfs and the currents sum to zero
+		const float vn = (v[0] + v[1] + v[2]) / 3.0;
+		for (int k = 0;k < 3;k++) {
+			dx[k] = (v[k] - vn - p->r * x[k] - e[k]) / l;
+		}
+	} else if (conn == 3 || conn == 5 || conn == 6) {
+		const int j = (conn & 1) ? 0 : 1;
+		const int k = (conn & 4) ? 2 : 1;
+		dx[j] = (v[j] - v[k] - p->r * (x[j] - x[k]) - (e[j] - e[k])) / (2.0 * l);
+		dx[k] = -dx[j];
+	}
+
+	const float i_beta = (x[1] - x[2]) / (2.0 * SQRT3_BY_2);
+	const float iq = cosf(x[4]) * i_beta - sinf(x[4]) * x[0];
+	dx[3] = accel(p, x[3], 1.5 * p->pole_pairs * p->lambda * iq);
+	dx[4] = x[3];
+}
+
+/**
+ * Run the plant for a time with the bridge legs in fixed states, like
+ * six-step commutation drives it. Switched off legs conduct through their
+ * body diodes, see terminal_voltages. The phase model uses the mean of ld and
+ * lq without saturation. v_term gets the terminal voltages at the end.
+ *
+ * @param p
+ * The plant.
+ *
+ * @param leg
+ * State of every bridge leg.
+ *
+ * @param t
+ * Time to run.
+ */
+void sim_plant_run(sim_plant_t *p, const sim_leg_t leg[3], float t) {
+	float x[5];
+	sim_plant_phase_currents(p, &x[0], &x[1], &x[2]);
+	x[3] = p->w;
+	x[4] = p->th;
+
+	float e[3], v[3];
+	float t_left = t;
+	while (t_left > 0.0) {
+		back_emf(p, x[3], x[4], e);
+		const int conn = terminal_voltages(p, leg, x, e, v);
+		project_currents(x, conn);
+
+		int diode = 0;
+		for (int k = 0;k < 3;k++) {
+			if (leg[k] == SIM_LEG_OFF && (conn & (1 << k))) {
+				diode |= 1 << k;
+			}
+		}
+
+		float h = fminf(t_left, diode ? SIM_STEP_DIODE : SIM_STEP_MAX);
+		if (t_left - h < 1e-9) {
+			h = t_left;
+		}
+
+		float k1[5], k2[5], k3[5], k4[5], tmp[5];
+		derivative_abc(p, x, v, conn, k1);
+		for (int i = 0;i < 5;i++) {
+			tmp[i] = x[i] + 0.5 * h * k1[i];
+		}
+		derivative_abc(p, tmp, v, conn, k2);
+		for (int i = 0;i < 5;i++) {
+			tmp[i] = x[i] + 0.5 * h * k2[i];
+		}
+		derivative_abc(p, tmp, v, conn, k3);
+		for (int i = 0;i < 5;i++) {
+			tmp[i] = x[i] + h * k3[i];
+		}
+		derivative_abc(p, tmp, v, conn, k4);
+		for (int i = 0;i < 5;i++) {
+			x[i] += (h / 6.0) * (k1[i] + 2.0 * k2[i] + 2.0 * k3[i] + k4[i]);
+		}
+
+		// A diode stops conducting when its current crosses zero
+		int conn_next = conn;
+		for (int k = 0;k < 3;k++) {
+			if ((diode & (1 << k)) && (v[k] > 0.0 ? x[k] > 0.0 : x[k] < 0.0)) {
+				conn_next &= ~(1 << k);
+			}
+		}
+		project_currents(x, conn_next);
+
+		const float i_beta = (x[1] - x[2]) / (2.0 * SQRT3_BY_2);
+		const float iq = cosf(x[4]) * i_beta - sinf(x[4]) * x[0];
+		if (iq < p->iq_min) {
+			p->iq_min = iq;
+		}
+		if (iq > p->iq_max) {
+			p->iq_max = iq;
+		}
+
+		t_left -= h;
+	}
+
+	x[4] = fmodf(x[4], 2.0 * M_PI);
+	if (x[4] < 0.0) {
+		x[4] += 2.0 * M_PI;
+	}
+
+	const float s = sinf(x[4]);
+	const float c = cosf(x[4]);
+	const float i_beta = (x[1] - x[2]) / (2.0 * SQRT3_BY_2);
+	p->id = c * x[0] + s * i_beta;
+	p->iq = c * i_beta - s * x[0];
+	p->w = x[3];
+	p->th = x[4];
+
+	back_emf(p, p->w, p->th, e);
+	terminal_voltages(p, leg, x, e, p->v_term);
+}
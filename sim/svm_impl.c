@@ -0,0 +1,36 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * One of the SVM implementations in mcpwm_foc.c, for svm_test.c. The
+ * Makefile builds this file once for every MCPWM_FOC_SVM_IMPL and only keeps
+ * SVM_IMPL_FUNC global, so that the copies of mcpwm_foc.c can be linked
+ * together.
+ */
+
+#include "../mcpwm_foc.c"
+
+void SVM_IMPL_FUNC(float alpha, float beta, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3, uint32_t *sector);
+
+void SVM_IMPL_FUNC(float alpha, float beta, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3, uint32_t *sector) {
+	svm(alpha, beta, top, duty1, duty2, duty3, sector);
+}
@@ -0,0 +1,177 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Sweep of the SVM implementations in mcpwm_foc.c over the hexagon. Every
+ * implementation is compared with the ideal min/max injection timings in
+ * double precision and with the default table implementation, and its
+ * sector with the sector of the angle. The results are printed as
+ * name=value lines, sim/test.sh checks them.
+ */
+
+#include "mcpwm_foc.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+typedef void (*svm_func_t)(float alpha, float beta, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3, uint32_t *sector);
+
+typedef struct {
+	const char *name;
+	svm_func_t func;
+	double err_max; // Largest difference to the ideal timings, counts
+	double err_sum;
+	uint64_t diff_table; // Timings that differ from the table implementation
+	int64_t diff_table_max;
+	uint64_t sector_wrong;
+	uint64_t out_of_range;
+} svm_impl_t;
+
+// svm_impl.c, once for every implementation
+void svm_impl_0(float alpha, float beta, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3, uint32_t *sector);
+void svm_impl_1(float alpha, float beta, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3, uint32_t *sector);
+void svm_impl_2(float alpha, float beta, uint32_t top,
+		uint32_t *duty1, uint32_t *duty2, uint32_t *duty3, uint32_t *sector);
+
+// Settings
+#define SWEEP_ANGLES			7200
+#define SWEEP_RADII				200
+#define SECTOR_EDGE_MARGIN		1e-4 // Angle from a sector edge where either sector is right, rad
+
+static svm_impl_t m_impls[] = {
+		{"iftree", svm_impl_0, 0.0, 0.0, 0, 0, 0, 0},
+		{"table", svm_impl_1, 0.0, 0.0, 0, 0, 0, 0},
+		{"minmax", svm_impl_2, 0.0, 0.0, 0, 0, 0, 0},
+};
+
+#define IMPL_NUM		(sizeof(m_impls) / sizeof(m_impls[0]))
+#define IMPL_TABLE		MCPWM_FOC_SVM_TABLE
+
+static uint64_t m_points;
+
+static void test_point(float alpha, float beta, uint32_t top) {
+	// Ideal timings, see the min/max implementation
+	const double va = alpha;
+	const double vb = -0.5 * alpha + (sqrt(3.0) / 2.0) * beta;
+	const double vc = -0.5 * alpha - (sqrt(3.0) / 2.0) * beta;
+	const double v_mid = 0.5 * (fmax(va, fmax(vb, vc)) + fmin(va, fmin(vb, vc)));
+	const double t_ideal[3] = {
+			0.5 * top - (va - v_mid) * (2.0 / 3.0) * top,
+			0.5 * top - (vb - v_mid) * (2.0 / 3.0) * top,
+			0.5 * top - (vc - v_mid) * (2.0 / 3.0) * top
+	};
+
+	double ang = atan2((double)beta, (double)alpha);
+	if (ang < 0.0) {
+		ang += 2.0 * M_PI;
+	}
+	const double sector_pos = ang / (M_PI / 3.0);
+	const uint32_t sector_ideal = (uint32_t)sector_pos % 6 + 1;
+	const bool sector_edge = (alpha == 0.0 && beta == 0.0) ||
+			fabs(sector_pos - round(sector_pos)) * (M_PI / 3.0) < SECTOR_EDGE_MARGIN;
+
+	uint32_t t[IMPL_NUM][3];
+	uint32_t sector[IMPL_NUM];
+	for (unsigned int i = 0;i < IMPL_NUM;i++) {
+		m_impls[i].func(alpha, beta, top, &t[i][0], &t[i][1], &t[i][2], &sector[i]);
+	}
+
+	for (unsigned int i = 0;i < IMPL_NUM;i++) {
+		svm_impl_t *impl = &m_impls[i];
+
+		for (int ph = 0;ph < 3;ph++) {
+			const double err = fabs((double)t[i][ph] - t_ideal[ph]);
+			impl->err_sum += err;
+			if (err > impl->err_max) {
+				impl->err_max = err;
+			}
+
+			if (t[i][ph] > top) {
+				impl->out_of_range++;
+			}
+
+			const int64_t diff = llabs((int64_t)t[i][ph] - (int64_t)t[IMPL_TABLE][ph]);
+			if (diff != 0) {
+				impl->diff_table++;
+				if (diff > impl->diff_table_max) {
+					impl->diff_table_max = diff;
+				}
+			}
+		}
+
+		if (!sector_edge && sector[i] != sector_ideal) {
+			impl->sector_wrong++;
+		}
+	}
+
+	m_points++;
+}
+
+int main(void) {
+	const uint32_t tops[] = {2100, 4200, 8400};
+
+	for (unsigned int k = 0;k < sizeof(tops) / sizeof(tops[0]);k++) {
+		const uint32_t top = tops[k];
+
+		for (int a = 0;a < SWEEP_ANGLES;a++) {
+			const double ang = (double)a * (2.0 * M_PI / (double)SWEEP_ANGLES);
+
+			// Out to the edge of the hexagon, which is at sqrt(3) / 2 in the middle
+			// of the sectors and at 1 in the corners
+			const double ang_sector = fmod(ang, M_PI / 3.0) - M_PI / 6.0;
+			const double r_max = (sqrt(3.0) / 2.0) / cos(ang_sector);
+
+			for (int r = 0;r <= SWEEP_RADII;r++) {
+				const double mag = r_max * (double)r / (double)SWEEP_RADII;
+				test_point((float)(mag * cos(ang)), (float)(mag * sin(ang)), top);
+			}
+		}
+
+		// The sector edges and the axes, where the sector calculations differ
+		for (int e = 0;e < 12;e++) {
+			const double ang = (double)e * (M_PI / 6.0);
+			for (int r = 1;r <= SWEEP_RADII;r++) {
+				const double mag = (sqrt(3.0) / 2.0) * (double)r / (double)SWEEP_RADII;
+				test_point((float)(mag * cos(ang)), (float)(mag * sin(ang)), top);
+				test_point(nextafterf((float)(mag * cos(ang)), 1.0), (float)(mag * sin(ang)), top);
+				test_point((float)(mag * cos(ang)), nextafterf((float)(mag * sin(ang)), -1.0), top);
+			}
+		}
+	}
+
+	printf("points=%llu\n", (unsigned long long)m_points);
+	for (unsigned int i = 0;i < IMPL_NUM;i++) {
+		const svm_impl_t *impl = &m_impls[i];
+		printf("%s_err_max=%.3f\n", impl->name, impl->err_max);
+		printf("%s_err_mean=%.3f\n", impl->name, impl->err_sum / (3.0 * (double)m_points));
+		printf("%s_diff_table=%llu\n", impl->name, (unsigned long long)impl->diff_table);
+		printf("%s_diff_table_max=%lld\n", impl->name, (long long)impl->diff_table_max);
+		printf("%s_sector_wrong=%llu\n", impl->name, (unsigned long long)impl->sector_wrong);
+		printf("%s_out_of_range=%llu\n", impl->name, (unsigned long long)impl->out_of_range);
+	}
+
+	return 0;
+}
@@ -0,0 +1,223 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Accuracy sweep of the atan2 and sine/cosine kernels in utils.c against
+ * libm in double precision, with the host time per call. sincos is checked
+ * on every 256th float in [-pi pi] and on an even grid, atan2 on vectors of
+ * very different lengths around the circle and on the axes. The results are
+ * printed as name=value lines, sim/test.sh checks them.
+ */
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+typedef struct {
+	const char *name;
+	float (*atan2_func)(float y, float x);
+	void (*sincos_func)(float angle, float *sin, float *cos);
+} trig_kernel_t;
+
+typedef struct {
+	double max;
+	double sq_sum;
+	uint64_t n;
+} err_stats_t;
+
+// Settings
+#define SINCOS_FLOAT_STRIDE		256
+#define GRID_POINTS				200000
+#define TIME_BLOCKS				2000
+#define TIME_BLOCK_CALLS		64
+
+static const trig_kernel_t m_kernels[] = {
+		{"legacy", utils_atan2_legacy, utils_sincos_legacy},
+		{"lut", utils_atan2_lut, utils_sincos_lut},
+		{"poly", utils_atan2_poly, utils_sincos_poly},
+		{"cordic", utils_atan2_cordic, utils_sincos_cordic},
+};
+
+static volatile float m_sink;
+
+static void err_add(err_stats_t *e, double err) {
+	err = fabs(err);
+	if (err > e->max) {
+		e->max = err;
+	}
+	e->sq_sum += err * err;
+	e->n++;
+}
+
+static double err_rms(const err_stats_t *e) {
+	return e->n ? sqrt(e->sq_sum / (double)e->n) : 0.0;
+}
+
+static double angle_err(double a, double b) {
+	double d = fmod(a - b, 2.0 * M_PI);
+	if (d > M_PI) {
+		d -= 2.0 * M_PI;
+	} else if (d < -M_PI) {
+		d += 2.0 * M_PI;
+	}
+	return d;
+}
+
+static double host_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void sincos_point(const trig_kernel_t *k, float angle, err_stats_t *e) {
+	float s, c;
+	k->sincos_func(angle, &s, &c);
+	err_add(e, (double)s - sin((double)angle));
+	err_add(e, (double)c - cos((double)angle));
+}
+
+static void sincos_q31_point(float angle, err_stats_t *e) {
+	int32_t s, c;
+	utils_fast_sincos_q31(angle, &s, &c);
+	err_add(e, (double)s / 2147483648.0 - sin((double)angle));
+	err_add(e, (double)c / 2147483648.0 - cos((double)angle));
+}
+
+static void atan2_point(const trig_kernel_t *k, float y, float x, err_stats_t *e) {
+	err_add(e, angle_err((double)k->atan2_func(y, x), atan2((double)y, (double)x)));
+}
+
+static void sweep_sincos(const trig_kernel_t *k, err_stats_t *e, bool q31) {
+	// Every SINCOS_FLOAT_STRIDE float of both signs up to pi
+	uint32_t pi_bits;
+	const float pi = (float)M_PI;
+	memcpy(&pi_bits, &pi, sizeof(pi_bits));
+
+	for (uint32_t bits = 0;bits <= pi_bits;bits += SINCOS_FLOAT_STRIDE) {
+		float a;
+		memcpy(&a, &bits, sizeof(a));
+		if (q31) {
+			sincos_q31_point(a, e);
+			sincos_q31_point(-a, e);
+		} else {
+			sincos_point(k, a, e);
+			sincos_point(k, -a, e);
+		}
+	}
+
+	for (int i = 0;i <= GRID_POINTS;i++) {
+		const float a = (float)(-M_PI + (2.0 * M_PI * (double)i) / (double)GRID_POINTS);
+		if (q31) {
+			sincos_q31_point(a, e);
+		} else {
+			sincos_point(k, a, e);
+		}
+	}
+}
+
+static void sweep_atan2(const trig_kernel_t *k, err_stats_t *e) {
+	const double mags[] = {1e-6, 1e-3, 1.0, 1e3, 1e6};
+
+	for (unsigned int m = 0;m < sizeof(mags) / sizeof(mags[0]);m++) {
+		for (int i = 0;i < GRID_POINTS;i++) {
+			const double a = -M_PI + (2.0 * M_PI * (double)i) / (double)GRID_POINTS;
+			atan2_point(k, (float)(mags[m] * sin(a)), (float)(mags[m] * cos(a)), e);
+		}
+
+		// The axes and the diagonals, where the octant reduction switches
+		for (int i = 0;i < 8;i++) {
+			const double a = (double)i * (M_PI / 4.0);
+			const float y = (float)(mags[m] * sin(a));
+			const float x = (float)(mags[m] * cos(a));
+			atan2_point(k, y, x, e);
+			atan2_point(k, nextafterf(y, 0.0), x, e);
+			atan2_point(k, y, nextafterf(x, 0.0), e);
+		}
+	}
+}
+
+/*
+ * Host time per call, the fastest of TIME_BLOCKS blocks like the trig_bench
+ * terminal command does with the cycle counter.
+ */
+static void time_kernel(const trig_kernel_t *k, double *atan2_ns, double *sincos_ns) {
+	*atan2_ns = 1e9;
+	*sincos_ns = 1e9;
+
+	for (int b = 0;b < TIME_BLOCKS;b++) {
+		const float a = (float)(-M_PI + (2.0 * M_PI * (double)b) / (double)TIME_BLOCKS);
+		const float s_in = sinf(a);
+		const float c_in = cosf(a);
+
+		double t0 = host_ns();
+		for (int i = 0;i < TIME_BLOCK_CALLS;i++) {
+			m_sink = k->atan2_func(s_in, c_in);
+		}
+		double t = (host_ns() - t0) / (double)TIME_BLOCK_CALLS;
+		if (t < *atan2_ns) {
+			*atan2_ns = t;
+		}
+
+		float s, c;
+		t0 = host_ns();
+		for (int i = 0;i < TIME_BLOCK_CALLS;i++) {
+			k->sincos_func(a, &s, &c);
+			m_sink = s + c;
+		}
+		t = (host_ns() - t0) / (double)TIME_BLOCK_CALLS;
+		if (t < *sincos_ns) {
+			*sincos_ns = t;
+		}
+	}
+}
+
+int main(void) {
+	utils_trig_init();
+
+	printf("selected=%d\n", UTILS_TRIG_IMPL);
+	for (unsigned int i = 0;i < sizeof(m_kernels) / sizeof(m_kernels[0]);i++) {
+		const trig_kernel_t *k = &m_kernels[i];
+		err_stats_t e_atan2 = {0.0, 0.0, 0};
+		err_stats_t e_sincos = {0.0, 0.0, 0};
+		double atan2_ns, sincos_ns;
+
+		sweep_atan2(k, &e_atan2);
+		sweep_sincos(k, &e_sincos, false);
+		time_kernel(k, &atan2_ns, &sincos_ns);
+
+		printf("%s_atan2_err_max=%.3e\n", k->name, e_atan2.max);
+		printf("%s_atan2_err_rms=%.3e\n", k->name, err_rms(&e_atan2));
+		printf("%s_atan2_ns=%.2f\n", k->name, atan2_ns);
+		printf("%s_sincos_err_max=%.3e\n", k->name, e_sincos.max);
+		printf("%s_sincos_err_rms=%.3e\n", k->name, err_rms(&e_sincos));
+		printf("%s_sincos_ns=%.2f\n", k->name, sincos_ns);
+	}
+
+	err_stats_t e_q31 = {0.0, 0.0, 0};
+	sweep_sincos(0, &e_q31, true);
+	printf("q31_sincos_err_max=%.3e\n", e_q31.max);
+	printf("q31_sincos_err_rms=%.3e\n", err_rms(&e_q31));
+
+	return 0;
+}
@@ -31,6 +31,9 @@
 #include "encoder.h"
 #include "drv8301.h"
 #include "drv8305.h"
+#include "isr_prof.h"
+#include "conf_general.h"
+#include "digital_filter.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -84,6 +87,151 @@ void terminal_process_string(char *str) {
 		commands_printf("Latest ADC duration: %.4f ms", (double)(mcpwm_get_last_adc_isr_duration() * 1000.0));
 		commands_printf("Latest injected ADC duration: %.4f ms", (double)(mc_interface_get_last_inj_adc_isr_duration() * 1000.0));
 		commands_printf("Latest sample ADC duration: %.4f ms\n", (double)(mc_interface_get_last_sample_adc_isr_duration() * 1000.0));
+	} else if (strcmp(argv[0], "isr_prof") == 0) {
+		if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+			isr_prof_reset();
+			commands_printf("ISR profiler statistics reset\n");
+		} else {
+#if ISR_PROF_ENABLE
+			const float us_per_cycle = 1e6 / (float)SYSTEM_CORE_CLOCK;
+
+			commands_printf("Section              Samples   Min us   Mean us   Max us   P99 us");
+			for (int i = 0;i < ISR_PROF_SECTION_NUM;i++) {
+				isr_prof_stats stats;
+				isr_prof_get_stats(i, &stats);
+				commands_printf("%-20s %8u %8.2f %9.2f %8.2f %8.2f",
+						isr_prof_section_name(i), (unsigned int)stats.samples,
+						(double)((float)stats.min * us_per_cycle),
+						(double)(stats.mean * us_per_cycle),
+						(double)((float)stats.max * us_per_cycle),
+						(double)((float)stats.p99 * us_per_cycle));
+			}
+			commands_printf(" ");
+#else
+			commands_printf("ISR profiling is disabled in this build (ISR_PROF_ENABLE).\n");
+#endif
+		}
+	} else if (strcmp(argv[0], "trig_bench") == 0) {
+		const char *names[] = {"legacy", "lut", "poly", "cordic"};
+		float (*atan2_funcs[])(float, float) = {utils_atan2_legacy, utils_atan2_lut,
+				utils_atan2_poly, utils_atan2_cordic};
+		void (*sincos_funcs[])(float, float*, float*) = {utils_sincos_legacy, utils_sincos_lut,
+				utils_sincos_poly, utils_sincos_cordic};
+		const int points = 10000;
+		volatile float sink = 0.0;
+
+		commands_printf("Kernel  atan2 err  atan2 cyc  sincos err  sincos cyc (selected: %d)",
+				UTILS_TRIG_IMPL);
+		for (int k = 0;k < 4;k++) {
+			float atan2_err = 0.0;
+			float sincos_err = 0.0;
+			uint32_t atan2_cyc = ISR_PROF_ENABLE ? 0xFFFFFFFF : 0;
+			uint32_t sincos_cyc = ISR_PROF_ENABLE ? 0xFFFFFFFF : 0;
+
+			for (int i = 0;i < points;i++) {
+				const float angle = -M_PI + (2.0 * M_PI * (float)i) / (float)points;
+				const float s_ref = sinf(angle);
+				const float c_ref = cosf(angle);
+				float s, c;
+
+				float err = fabsf(utils_angle_difference_rad(atan2_funcs[k](s_ref, c_ref), angle));
+				if (err > atan2_err) {
+					atan2_err = err;
+				}
+
+				sincos_funcs[k](angle, &s, &c);
+				err = utils_max_abs(s - s_ref, c - c_ref);
+				if (fabsf(err) > sincos_err) {
+					sincos_err = fabsf(err);
+				}
+
+#if ISR_PROF_ENABLE
+				// Interrupts only make a block slower, so the fastest block is the
+				// cost of the kernel itself (including the call).
+				uint32_t start = DWT->CYCCNT;
+				sink = atan2_funcs[k](s_ref, c_ref);
+				sink = atan2_funcs[k](c_ref, s_ref);
+				sink = atan2_funcs[k](-s_ref, c_ref);
+				sink = atan2_funcs[k](c_ref, -s_ref);
+				uint32_t cyc = (DWT->CYCCNT - start) / 4;
+				if (cyc < atan2_cyc) {
+					atan2_cyc = cyc;
+				}
+
+				start = DWT->CYCCNT;
+				sincos_funcs[k](angle, &s, &c);
+				sincos_funcs[k](-angle, &s, &c);
+				sincos_funcs[k](angle * 0.5, &s, &c);
+				sincos_funcs[k](-angle * 0.5, &s, &c);
+				cyc = (DWT->CYCCNT - start) / 4;
+				sink = s + c;
+				if (cyc < sincos_cyc) {
+					sincos_cyc = cyc;
+				}
+#endif
+			}
+
+			commands_printf("%-7s %9.2e %10u %11.2e %11u", names[k],
+					(double)atan2_err, (unsigned int)atan2_cyc,
+					(double)sincos_err, (unsigned int)sincos_cyc);
+		}
+		(void)sink;
+		commands_printf(" ");
+	} else if (strcmp(argv[0], "fir_bench") == 0) {
+		// The current FIR and the amplitude FIR lengths
+		const int bits_list[] = {4, 7};
+		static float coeffs[1 << 7];
+		static float samples[1 << 7];
+		volatile float sink = 0.0;
+
+		// Pseudo random samples, the same every run
+		uint32_t seed = 12345;
+		for (int i = 0;i < (1 << 7);i++) {
+			seed = seed * 1664525 + 1013904223;
+			samples[i] = (float)(int32_t)seed / 2147483648.0;
+		}
+
+		commands_printf("Taps  mismatches  masked cyc  new cyc");
+		for (int k = 0;k < 2;k++) {
+			const int bits = bits_list[k];
+			const int size = 1 << bits;
+			int mismatches = 0;
+			uint32_t ref_cyc = ISR_PROF_ENABLE ? 0xFFFFFFFF : 0;
+			uint32_t new_cyc = ISR_PROF_ENABLE ? 0xFFFFFFFF : 0;
+
+			filter_create_fir_lowpass(coeffs, 0.1, bits, 1);
+
+			for (int offset = 0;offset < size;offset++) {
+				const float ref = filter_run_fir_iteration_ref(samples, coeffs, bits, offset);
+				const float res = filter_run_fir_iteration(samples, coeffs, bits, offset);
+				if (memcmp(&ref, &res, sizeof(float)) != 0) {
+					mismatches++;
+				}
+
+#if ISR_PROF_ENABLE
+				// Interrupts only make a run slower, so the fastest run is the
+				// cost of the filter itself (including the call).
+				uint32_t start = DWT->CYCCNT;
+				sink = filter_run_fir_iteration_ref(samples, coeffs, bits, offset);
+				uint32_t cyc = DWT->CYCCNT - start;
+				if (cyc < ref_cyc) {
+					ref_cyc = cyc;
+				}
+
+				start = DWT->CYCCNT;
+				sink = filter_run_fir_iteration(samples, coeffs, bits, offset);
+				cyc = DWT->CYCCNT - start;
+				if (cyc < new_cyc) {
+					new_cyc = cyc;
+				}
+#endif
+			}
+
+			commands_printf("%4d %11d %11u %8u", size, mismatches,
+					(unsigned int)ref_cyc, (unsigned int)new_cyc);
+		}
+		(void)sink;
+		commands_printf(" ");
 	} else if (strcmp(argv[0], "kv") == 0) {
 		commands_printf("Calculated KV: %.2f rpm/volt\n", (double)mcpwm_get_kv_filtered());
 	} else if (strcmp(argv[0], "mem") == 0) {
@@ -329,11 +477,47 @@ void terminal_process_string(char *str) {
 
 		float res = 0.0;
 		float ind = 0.0;
-		mcpwm_foc_measure_res_ind(&res, &ind);
+		float ld_lq_diff = 0.0;
+		mcpwm_foc_measure_res_ind(&res, &ind, &ld_lq_diff);
 		commands_printf("Resistance: %.6f ohm", (double)res);
-		commands_printf("Inductance: %.2f microhenry\n", (double)ind);
+		commands_printf("Inductance: %.2f microhenry", (double)ind);
+		commands_printf("Ld:         %.2f microhenry", (double)(ind - ld_lq_diff / 2.0));
+		commands_printf("Lq:         %.2f microhenry\n", (double)(ind + ld_lq_diff / 2.0));
 
 		mc_interface_set_configuration(&mcconf_old);
+	} else if (strcmp(argv[0], "measure_cc_gains") == 0) {
+		if (argc == 2 || argc == 3) {
+			float bw = -1.0;
+			int apply = 0;
+			sscanf(argv[1], "%f", &bw);
+			if (argc == 3) {
+				sscanf(argv[2], "%d", &apply);
+			}
+
+			if (bw > 0.0) {
+				float res, ind, ld_lq_diff, kp, ki, phase_margin;
+				bool ok = conf_general_detect_current_gains(bw, apply, &res, &ind,
+						&ld_lq_diff, &kp, &ki, &phase_margin);
+
+				commands_printf("Resistance:   %.6f ohm", (double)res);
+				commands_printf("Inductance:   %.2f microhenry", (double)(ind * 1e6));
+				commands_printf("Lq - Ld:      %.2f microhenry", (double)(ld_lq_diff * 1e6));
+				commands_printf("Kp:           %.5f", (double)kp);
+				commands_printf("Ki:           %.2f", (double)ki);
+				commands_printf("Phase margin: %.1f degrees", (double)phase_margin);
+				if (!ok) {
+					commands_printf("Invalid result, lower the bandwidth or raise the switching frequency.\n");
+				} else if (apply) {
+					commands_printf("Applied and stored.\n");
+				} else {
+					commands_printf("Not applied.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires one or two arguments.\n");
+		}
 	} else if (strcmp(argv[0], "measure_linkage_foc") == 0) {
 		if (argc == 2) {
 			float duty = -1.0;
@@ -571,6 +755,16 @@ void terminal_process_string(char *str) {
 		commands_printf("last_adc_duration");
 		commands_printf("  The time the latest ADC interrupt consumed");
 
+		commands_printf("isr_prof [reset]");
+		commands_printf("  Print min/mean/max/p99 execution times of the motor control interrupts");
+		commands_printf("  and their sections. svm is included in control_current. reset clears them.");
+
+		commands_printf("trig_bench");
+		commands_printf("  Max error and cycles per call of the atan2 and sincos kernels (UTILS_TRIG_IMPL).");
+
+		commands_printf("fir_bench");
+		commands_printf("  Compare the FIR filter with the old masked loop bit for bit, and their cycles per call.");
+
 		commands_printf("kv");
 		commands_printf("  The calculated kv of the motor");
 
@@ -626,6 +820,10 @@ void terminal_process_string(char *str) {
 		commands_printf("measure_res_ind");
 		commands_printf("  Measure the motor resistance and inductance with an incremental adaptive algorithm.");
 
+		commands_printf("measure_cc_gains [bandwidth] [apply]");
+		commands_printf("  Measure the motor resistance and inductance and calculate the current");
+		commands_printf("  controller gains for a bandwidth in rad/s. Stores them when apply is 1.");
+
 		commands_printf("measure_linkage_foc [duty]");
 		commands_printf("  Run the motor with FOC and measure the flux linkage.");
 
@@ -294,7 +294,7 @@ float utils_fast_inv_sqrt(float x) {
 }
 
 /**
- * Fast atan2
+ * Original atan2 kernel, about 0.01 rad error.
  *
  * See http://www.dspguru.com/dsp/tricks/fixed-point-atan2-with-self-normalization
  *
@@ -307,7 +307,7 @@ float utils_fast_inv_sqrt(float x) {
  * @return
  * The angle in radians
  */
-float utils_fast_atan2(float y, float x) {
+static inline float atan2_legacy(float y, float x) {
 	float abs_y = fabsf(y) + 1e-20; // kludge to prevent 0/0 condition
 	float angle;
 
@@ -409,7 +409,7 @@ void utils_fast_sincos(float angle, float *sin, float *cos) {
 }
 
 /**
- * Fast sine and cosine implementation.
+ * Original piecewise parabolic sine and cosine kernel.
  *
  * See http://lab.polygonal.de/?p=205
  *
@@ -423,7 +423,7 @@ void utils_fast_sincos(float angle, float *sin, float *cos) {
  * @param cos
  * A pointer to store the cosine value.
  */
-void utils_fast_sincos_better(float angle, float *sin, float *cos) {
+static inline void sincos_legacy(float angle, float *sin, float *cos) {
 	//always wrap input angle to -PI..PI
 	while (angle < -M_PI) {
 		angle += 2.0 * M_PI;
@@ -477,6 +477,329 @@ void utils_fast_sincos_better(float angle, float *sin, float *cos) {
 	}
 }
 
+/*
+ * Selectable atan2 and sine/cosine kernels. utils_fast_atan2 and
+ * utils_fast_sincos_better use the one selected with UTILS_TRIG_IMPL, the
+ * others are exported for comparison (see the trig_bench terminal command).
+ *
+ * Worst case errors over [-pi pi], as measured by sim/trig_test:
+ * LEGACY: atan2 1.1e-2 rad, sincos 1.1e-3
+ * LUT:    atan2 2e-6 rad,   sincos 2e-5 (also utils_fast_sincos_q31)
+ * POLY:   atan2 4e-7 rad,   sincos 2e-7
+ * CORDIC: atan2 3e-6 rad,   sincos 3e-6
+ */
+
+// Lookup tables. CCM has no wait states, but is not initialized at startup.
+#define SIN_LUT_BITS		9
+#define SIN_LUT_SIZE		(1 << SIN_LUT_BITS)
+#define SIN_LUT_MASK		(SIN_LUT_SIZE - 1)
+#define ATAN_LUT_SIZE		256
+
+__attribute__((section(".ram4"))) static float sin_lut[SIN_LUT_SIZE];
+__attribute__((section(".ram4"))) static int32_t sin_lut_q31[SIN_LUT_SIZE];
+__attribute__((section(".ram4"))) static float atan_lut[ATAN_LUT_SIZE + 1];
+
+// CORDIC. Angles are in fixed point with 2^30 units per turn, vectors in Q30.
+#define CORDIC_ITERATIONS	20
+#define CORDIC_TURN_BITS	30
+#define CORDIC_GAIN_INV		0.6072529350 // 1 / prod(sqrt(1 + 2^(-2i)))
+
+static const int32_t cordic_atan[CORDIC_ITERATIONS] = {
+		134217728, 79233351, 41864727, 21251189, 10666833, 5338616, 2669960,
+		1335061, 667541, 333772, 166886, 83443, 41722, 20861, 10430, 5215,
+		2608, 1304, 652, 326
+};
+
+/**
+ * Fill the lookup tables used by the LUT kernels. Has to be called once at
+ * startup, before the motor control is initialized.
+ */
+void utils_trig_init(void) {
+	for (int i = 0;i < SIN_LUT_SIZE;i++) {
+		sin_lut[i] = sinf((2.0 * M_PI * (float)i) / (float)SIN_LUT_SIZE);
+
+		const float s = sin_lut[i] * 2147483648.0;
+		if (s >= 2147483647.0) {
+			sin_lut_q31[i] = INT32_MAX;
+		} else if (s <= -2147483647.0) {
+			sin_lut_q31[i] = -INT32_MAX;
+		} else {
+			sin_lut_q31[i] = (int32_t)s;
+		}
+	}
+
+	for (int i = 0;i <= ATAN_LUT_SIZE;i++) {
+		atan_lut[i] = atanf((float)i / (float)ATAN_LUT_SIZE);
+	}
+}
+
+static inline float atan_unit_lut(float r) {
+	const float idx_f = r * (float)ATAN_LUT_SIZE;
+	int idx = (int)idx_f;
+	if (idx >= ATAN_LUT_SIZE) {
+		idx = ATAN_LUT_SIZE - 1;
+	}
+	const float frac = idx_f - (float)idx;
+	return atan_lut[idx] + frac * (atan_lut[idx + 1] - atan_lut[idx]);
+}
+
+static inline float atan_unit_poly(float r) {
+	// Abramowitz & Stegun 4.4.49, valid in [0 1]
+	const float r2 = r * r;
+	return r * (1.0f + r2 * (-0.3333314528f + r2 * (0.1999355085f + r2 * (-0.1420889944f
+			+ r2 * (0.1065626393f + r2 * (-0.0752896400f + r2 * (0.0429096138f
+			+ r2 * (-0.0161657367f + r2 * 0.0028662257f))))))));
+}
+
+// Reduce atan2 to atan in [0 1] and back. The kernel selection is constant
+// at every call site, so the branch is removed when this is inlined.
+static inline float atan2_octant(float y, float x, bool use_lut) {
+	const float abs_x = fabsf(x);
+	const float abs_y = fabsf(y);
+	float angle;
+
+	if (abs_x >= abs_y) {
+		if (abs_x == 0.0) {
+			return 0.0;
+		}
+		const float r = abs_y / abs_x;
+		angle = use_lut ? atan_unit_lut(r) : atan_unit_poly(r);
+	} else {
+		const float r = abs_x / abs_y;
+		angle = (float)(M_PI / 2.0) - (use_lut ? atan_unit_lut(r) : atan_unit_poly(r));
+	}
+
+	if (x < 0.0) {
+		angle = (float)M_PI - angle;
+	}
+
+	return y < 0.0 ? -angle : angle;
+}
+
+static inline float atan2_cordic(float y, float x) {
+	const float max = utils_max_abs(x, y);
+	if (max == 0.0) {
+		return 0.0;
+	}
+
+	// Normalize to Q29 so that the CORDIC gain cannot overflow
+	const float scale = 536870912.0 / fabsf(max);
+	int32_t xi = (int32_t)(x * scale);
+	int32_t yi = (int32_t)(y * scale);
+	int32_t z = 0;
+
+	// Rotate into the right half plane
+	if (xi < 0) {
+		xi = -xi;
+		yi = -yi;
+		z = yi > 0 ? -(1 << (CORDIC_TURN_BITS - 1)) : (1 << (CORDIC_TURN_BITS - 1));
+	}
+
+	for (int i = 0;i < CORDIC_ITERATIONS;i++) {
+		const int32_t x_shift = xi >> i;
+		const int32_t y_shift = yi >> i;
+		if (yi > 0) {
+			xi += y_shift;
+			yi -= x_shift;
+			z += cordic_atan[i];
+		} else {
+			xi -= y_shift;
+			yi += x_shift;
+			z -= cordic_atan[i];
+		}
+	}
+
+	return (float)z * (float)((2.0 * M_PI) / (float)(1 << CORDIC_TURN_BITS));
+}
+
+static inline void sincos_lut(float angle, float *sin, float *cos) {
+	const float idx_f = angle * (float)(SIN_LUT_SIZE / (2.0 * M_PI));
+	int idx = (int)idx_f;
+	if (idx_f < (float)idx) {
+		idx--;
+	}
+	const float frac = idx_f - (float)idx;
+
+	const float s0 = sin_lut[idx & SIN_LUT_MASK];
+	const float s1 = sin_lut[(idx + 1) & SIN_LUT_MASK];
+	const float c0 = sin_lut[(idx + SIN_LUT_SIZE / 4) & SIN_LUT_MASK];
+	const float c1 = sin_lut[(idx + SIN_LUT_SIZE / 4 + 1) & SIN_LUT_MASK];
+
+	*sin = s0 + frac * (s1 - s0);
+	*cos = c0 + frac * (c1 - c0);
+}
+
+static inline void sincos_poly(float angle, float *sin, float *cos) {
+	// Reduce to [-pi/4 pi/4] and the quadrant
+	const float q_f = angle * (float)(2.0 / M_PI);
+	const int q = (int)(q_f >= 0.0 ? q_f + 0.5 : q_f - 0.5);
+	const float r = angle - (float)q * (float)(M_PI / 2.0);
+	const float r2 = r * r;
+
+	// Minimax polynomials from Cephes sinf/cosf
+	const float s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+	const float c = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f
+			+ r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+
+	switch (q & 3) {
+	case 0: *sin = s; *cos = c; break;
+	case 1: *sin = c; *cos = -s; break;
+	case 2: *sin = -s; *cos = -c; break;
+	default: *sin = -c; *cos = s; break;
+	}
+}
+
+static inline void sincos_cordic(float angle, float *sin, float *cos) {
+	while (angle < -M_PI) {
+		angle += 2.0 * M_PI;
+	}
+
+	while (angle > M_PI) {
+		angle -= 2.0 * M_PI;
+	}
+
+	// Quadrant and remainder in [-pi/4 pi/4]
+	const int32_t z_full = (int32_t)(angle * (float)((float)(1 << CORDIC_TURN_BITS) / (2.0 * M_PI)));
+	const int32_t q = (z_full + (1 << (CORDIC_TURN_BITS - 3))) >> (CORDIC_TURN_BITS - 2);
+	int32_t z = z_full - q * (1 << (CORDIC_TURN_BITS - 2));
+
+	int32_t xi = (int32_t)(CORDIC_GAIN_INV * 1073741824.0);
+	int32_t yi = 0;
+
+	for (int i = 0;i < CORDIC_ITERATIONS;i++) {
+		const int32_t x_shift = xi >> i;
+		const int32_t y_shift = yi >> i;
+		if (z >= 0) {
+			xi -= y_shift;
+			yi += x_shift;
+			z -= cordic_atan[i];
+		} else {
+			xi += y_shift;
+			yi -= x_shift;
+			z += cordic_atan[i];
+		}
+	}
+
+	const float s = (float)yi * (1.0f / 1073741824.0f);
+	const float c = (float)xi * (1.0f / 1073741824.0f);
+
+	switch (q & 3) {
+	case 0: *sin = s; *cos = c; break;
+	case 1: *sin = c; *cos = -s; break;
+	case 2: *sin = -s; *cos = -c; break;
+	default: *sin = -c; *cos = s; break;
+	}
+}
+
+/**
+ * Fast atan2, using the kernel selected with UTILS_TRIG_IMPL.
+ *
+ * @param y
+ * y
+ *
+ * @param x
+ * x
+ *
+ * @return
+ * The angle in radians
+ */
+float utils_fast_atan2(float y, float x) {
+#if UTILS_TRIG_IMPL == UTILS_TRIG_LUT
+	return atan2_octant(y, x, true);
+#elif UTILS_TRIG_IMPL == UTILS_TRIG_POLY
+	return atan2_octant(y, x, false);
+#elif UTILS_TRIG_IMPL == UTILS_TRIG_CORDIC
+	return atan2_cordic(y, x);
+#else
+	return atan2_legacy(y, x);
+#endif
+}
+
+/**
+ * Fast sine and cosine, using the kernel selected with UTILS_TRIG_IMPL.
+ *
+ * @param angle
+ * The angle in radians
+ * WARNING: Don't use too large angles.
+ *
+ * @param sin
+ * A pointer to store the sine value.
+ *
+ * @param cos
+ * A pointer to store the cosine value.
+ */
+void utils_fast_sincos_better(float angle, float *sin, float *cos) {
+#if UTILS_TRIG_IMPL == UTILS_TRIG_LUT
+	sincos_lut(angle, sin, cos);
+#elif UTILS_TRIG_IMPL == UTILS_TRIG_POLY
+	sincos_poly(angle, sin, cos);
+#elif UTILS_TRIG_IMPL == UTILS_TRIG_CORDIC
+	sincos_cordic(angle, sin, cos);
+#else
+	sincos_legacy(angle, sin, cos);
+#endif
+}
+
+float utils_atan2_legacy(float y, float x) {
+	return atan2_legacy(y, x);
+}
+
+float utils_atan2_lut(float y, float x) {
+	return atan2_octant(y, x, true);
+}
+
+float utils_atan2_poly(float y, float x) {
+	return atan2_octant(y, x, false);
+}
+
+float utils_atan2_cordic(float y, float x) {
+	return atan2_cordic(y, x);
+}
+
+void utils_sincos_legacy(float angle, float *sin, float *cos) {
+	sincos_legacy(angle, sin, cos);
+}
+
+void utils_sincos_lut(float angle, float *sin, float *cos) {
+	sincos_lut(angle, sin, cos);
+}
+
+void utils_sincos_poly(float angle, float *sin, float *cos) {
+	sincos_poly(angle, sin, cos);
+}
+
+void utils_sincos_cordic(float angle, float *sin, float *cos) {
+	sincos_cordic(angle, sin, cos);
+}
+
+/**
+ * Sine and cosine in Q31 from the interpolated table, for fixed point code.
+ * The error is the same as for the LUT kernel. Needs utils_trig_init.
+ *
+ * @param angle
+ * The angle in radians, less than two turns in magnitude.
+ *
+ * @param sin
+ * A pointer to store the sine value.
+ *
+ * @param cos
+ * A pointer to store the cosine value.
+ */
+void utils_fast_sincos_q31(float angle, int32_t *sin, int32_t *cos) {
+	const int frac_bits = CORDIC_TURN_BITS - SIN_LUT_BITS;
+	const int32_t turn = (int32_t)(angle * (float)((float)(1 << CORDIC_TURN_BITS) / (2.0 * M_PI)));
+	const int idx = turn >> frac_bits;
+	const int32_t frac = turn & ((1 << frac_bits) - 1);
+
+	const int32_t s0 = sin_lut_q31[idx & SIN_LUT_MASK];
+	const int32_t s1 = sin_lut_q31[(idx + 1) & SIN_LUT_MASK];
+	const int32_t c0 = sin_lut_q31[(idx + SIN_LUT_SIZE / 4) & SIN_LUT_MASK];
+	const int32_t c1 = sin_lut_q31[(idx + SIN_LUT_SIZE / 4 + 1) & SIN_LUT_MASK];
+
+	*sin = s0 + (int32_t)(((int64_t)(s1 - s0) * frac) >> frac_bits);
+	*cos = c0 + (int32_t)(((int64_t)(c1 - c0) * frac) >> frac_bits);
+}
+
 /**
  * Calculate the values with the lowest magnitude.
  *
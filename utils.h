@@ -21,6 +21,7 @@
 #define UTILS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 void utils_step_towards(float *value, float goal, float step);
 float utils_calc_ratio(float low, float high, float val);
@@ -42,6 +43,16 @@ float utils_fast_atan2(float y, float x);
 bool utils_saturate_vector_2d(float *x, float *y, float max);
 void utils_fast_sincos(float angle, float *sin, float *cos);
 void utils_fast_sincos_better(float angle, float *sin, float *cos);
+void utils_trig_init(void);
+float utils_atan2_legacy(float y, float x);
+float utils_atan2_lut(float y, float x);
+float utils_atan2_poly(float y, float x);
+float utils_atan2_cordic(float y, float x);
+void utils_sincos_legacy(float angle, float *sin, float *cos);
+void utils_sincos_lut(float angle, float *sin, float *cos);
+void utils_sincos_poly(float angle, float *sin, float *cos);
+void utils_sincos_cordic(float angle, float *sin, float *cos);
+void utils_fast_sincos_q31(float angle, int32_t *sin, int32_t *cos);
 float utils_min_abs(float va, float vb);
 float utils_max_abs(float va, float vb);
 void utils_byte_to_binary(int x, char *b);
@@ -82,4 +93,14 @@ void utils_sys_unlock_cnt(void);
 #define TWO_BY_SQRT3			(2.0f * 0.57735026919)
 #define SQRT3_BY_2				(0.86602540378)
 
+// Kernels for utils_fast_atan2 and utils_fast_sincos_better
+#define UTILS_TRIG_LEGACY		0 // Cheapest, about 1e-2 rad atan2 error
+#define UTILS_TRIG_LUT			1 // Interpolated tables in CCM, needs utils_trig_init
+#define UTILS_TRIG_POLY			2 // Minimax polynomials, close to float precision
+#define UTILS_TRIG_CORDIC		3 // 20 fixed point CORDIC iterations
+
+#ifndef UTILS_TRIG_IMPL
+#define UTILS_TRIG_IMPL			UTILS_TRIG_LEGACY
+#endif
+
 #endif /* UTILS_H_ */